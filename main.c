@@ -1,4 +1,6 @@
 
+#define _GNU_SOURCE
+
 #include <inttypes.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -12,36 +14,692 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <endian.h>
+#include <sched.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <ftw.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
+#include <linux/io_uring.h>
 
 #include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include <getopt.h>
 
 /***************************************************************************/
 
-/* структура - односвязный список, описывающая файлы */
-typedef struct dirlist {
-    char* name; /* имя файла */
+/* структура, описывающая файл. имя хранится в пуле строк таблицы */
+typedef struct fileentry {
+    u_int64_t name; /* смещение имени относительно корня в пуле строк */
+    u_int64_t size; /* размер файла */
+    time_t date; /* тайм штамп */
+    u_int32_t date_ns; /* наносекунды тайм штампа */
+    u_int32_t dev; /* устройство, упакованное dev_pack() */
+    u_int64_t ino; /* номер inode, если у файла несколько жестких ссылок, иначе 0 */
+} fileentry;
+
+/* структура, описывающая каталог. имя хранится в пуле строк таблицы */
+typedef struct direntry {
+    u_int64_t name; /* смещение имени относительно корня в пуле строк */
     time_t date; /* тайм штамп */
-    int done; /* флаг, указывающий, был ли этот файл уже скопирован */
+    u_int32_t date_ns; /* наносекунды тайм штампа */
+} direntry;
+
+/* таблица файлов одного каталога: массив описаний и непрерывный пул имен */
+typedef struct filetable {
+    const char* root; /* имя корневого каталога */
+    fileentry* files; /* описания файлов */
+    u_int64_t nfiles; /* кол-во файлов */
+    u_int64_t cap; /* емкость массива описаний */
+    direntry* dirs; /* описания подкаталогов, включая корень */
+    u_int64_t ndirs; /* кол-во каталогов */
+    u_int64_t dircap; /* емкость массива каталогов */
+    char* pool; /* имена файлов относительно корня, разделенные '\0' */
+    u_int64_t poolsize; /* занятый размер пула */
+    u_int64_t poolcap; /* емкость пула */
+    u_int64_t* hashes; /* хеши содержимого файлов или NULL, 0 - неизвестен */
+    u_int64_t* islots; /* готовый хеш-индекс из файла индекса или NULL */
+    u_int64_t* ihashes; /* хеши имен готового индекса */
+    u_int64_t nslots; /* размер готового индекса */
+    void* map; /* отображенный в память файл индекса, массивы указывают в него */
+    size_t mapsize; /* размер отображения */
+} filetable;
+
+/* заголовок файла индекса каталога назначения. за ним, с выравниванием
+  на 8 байт, следуют массивы в порядке смещений */
+typedef struct index_header {
+    char magic[8]; /* "DSYNCIDX" */
+    u_int32_t version; /* версия формата */
+    u_int32_t entrysize; /* sizeof(fileentry), защита от чужой сборки */
+    u_int64_t nfiles; /* кол-во файлов */
+    u_int64_t ndirs; /* кол-во каталогов */
+    u_int64_t nslots; /* размер хеш-индекса */
+    u_int64_t poolsize; /* размер пула имен */
+    u_int64_t files_off; /* fileentry[nfiles] */
+    u_int64_t dirs_off; /* direntry[ndirs] */
+    u_int64_t slots_off; /* u_int64_t[nslots], ячейки хеш-индекса */
+    u_int64_t shash_off; /* u_int64_t[nslots], хеши имен */
+    u_int64_t hashes_off; /* u_int64_t[nfiles], хеши содержимого */
+    u_int64_t pool_off; /* пул имен */
+    u_int64_t root_off; /* имя корневого каталога, с завершающим '\0' */
+    u_int64_t size; /* полный размер файла */
+} index_header;
+
+/* список файлов к копированию - индексы в таблице исходного каталога */
+typedef struct copylist {
+    filetable* src; /* таблица исходного каталога */
+    u_int64_t* idx; /* индексы файлов */
+    u_int64_t count; /* кол-во файлов */
+    u_int64_t cap; /* емкость массива индексов */
+} copylist;
+
+/* хеш-индекс файлов или каталогов по имени относительно корня (открытая
+  адресация). первое поле индексируемых записей - смещение имени в пуле */
+typedef struct pathindex {
+    const char* pool; /* пул имен */
+    const char* entries; /* индексируемые записи */
+    size_t stride; /* размер записи */
+    u_int64_t* slots; /* ячейки: индекс записи плюс один, 0 - свободная */
+    u_int64_t* hashes; /* хеши имен, чтобы не сравнивать строки при коллизиях */
+    size_t mask; /* размер таблицы минус один, размер - степень двойки */
+    int mapped; /* ячейки взяты из файла индекса, освобождать не нужно */
+} pathindex;
+
+/* задание сканера - один каталог */
+typedef struct scan_job {
+    int fd; /* уже открытый дескриптор каталога, или -1 */
+    unsigned tree; /* индекс сканируемого дерева */
+    char* rel; /* путь относительно корня, "" для самого корня */
+} scan_job;
+
+/* очередь заданий потока сканера. владелец берет задания с конца,
+  остальные потоки воруют с начала */
+typedef struct scan_deque {
+    pthread_mutex_t lock;
+    scan_job* jobs; /* кольцевой буфер */
+    size_t head; /* индекс первого задания */
+    size_t count; /* кол-во заданий */
+    size_t cap; /* емкость буфера */
+} scan_deque;
+
+/* сканируемое дерево */
+typedef struct scan_tree {
+    const char* root; /* имя корневого каталога */
+    int rootfd; /* дескриптор корневого каталога */
+    filetable* table; /* таблица, в которую собирается результат */
+    atomic_size_t pending; /* кол-во заданий дерева в очередях и в работе */
+    struct timespec finished; /* время завершения сканирования дерева */
+} scan_tree;
+
+struct scanner;
+
+/* данные потока сканера */
+typedef struct scan_worker {
+    struct scanner* sc;
+    unsigned id;
+    pthread_t thread;
+    scan_deque dq;
+    filetable* tables; /* собственная таблица для каждого дерева */
+    u_int64_t* cpu_ns; /* процессорное время потока на каждое дерево */
+    char* buf; /* буфер для getdents64 */
+} scan_worker;
+
+/* общее состояние сканера */
+typedef struct scanner {
+    scan_tree* trees;
+    unsigned ntrees;
+    scan_worker* workers;
+    unsigned nworkers;
+    atomic_size_t pending; /* кол-во заданий в очередях и в работе */
+    atomic_int openfds; /* кол-во открытых дескрипторов в очередях */
+    atomic_uint nidle; /* кол-во ожидающих потоков */
+    atomic_uint_fast64_t errors; /* кол-во записей, которые не удалось прочитать */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+} scanner;
+
+/* способы копирования содержимого файла, в порядке предпочтения */
+enum copy_engine {
+    ENGINE_AUTO = -1, /* перебирать способы, начиная с лучшего */
+    ENGINE_REFLINK, /* клонирование экстентов ioctl(FICLONE) */
+    ENGINE_COPY_FILE_RANGE, /* copy_file_range(), копирование силами ФС */
+    ENGINE_SENDFILE, /* sendfile() */
+    ENGINE_READWRITE, /* read()/write() через буфер */
+    ENGINE_COUNT
+};
+
+/* выбранный для пары устройств способ копирования */
+typedef struct engine_cache_entry {
+    dev_t srcdev; /* устройство исходного файла */
+    dev_t dstdev; /* устройство файла назначения */
+    int engine; /* первый способ, который имеет смысл пробовать */
+} engine_cache_entry;
+
+/* классы размеров файлов при автонастройке: до 64K, 1M, 16M, 256M и больше */
+#define TUNE_BUCKETS 5
+
+/* способы копирования, из которых выбирает автонастройка */
+enum tune_strategy {
+    TUNE_RANGE, /* copy_file_range() */
+    TUNE_SENDFILE, /* sendfile() */
+    TUNE_RW_64K, /* read()/write() буфером 64K */
+    TUNE_RW_256K, /* read()/write() буфером 256K */
+    TUNE_RW_1M, /* read()/write() буфером 1M */
+    TUNE_STRATEGIES
+};
+
+/* измерения и выбор способа для одного класса размеров */
+typedef struct tune_bucket {
+    u_int64_t samples[TUNE_STRATEGIES]; /* кол-во измеренных файлов */
+    u_int64_t bytes[TUNE_STRATEGIES]; /* объем, скопированный при измерении */
+    u_int64_t ns[TUNE_STRATEGIES]; /* затраченное время */
+    unsigned disabled; /* маска способов, не работающих для пары ФС */
+    int best; /* выбранный способ, -1 - еще измеряется */
+    unsigned threads; /* сколько файлов класса копировать одновременно, 0 - без ограничения */
+    unsigned active; /* сколько копируется сейчас */
+    double rate; /* скорость выбранного способа, байт/с */
+    int learned; /* выбор сделан в этом запуске и будет сохранен */
+} tune_bucket;
+
+/* профиль автонастройки пары устройств */
+typedef struct tune_profile {
+    dev_t srcdev; /* исходное устройство */
+    dev_t dstdev; /* устройство назначения */
+    char srcfs[40]; /* тип и fsid исходной ФС, ключ в файле профилей */
+    char dstfs[40]; /* то же для ФС назначения */
+    tune_bucket buckets[TUNE_BUCKETS];
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* в классе с ограничением потоков освободилось место */
+} tune_profile;
+
+/* выбор для класса размеров пары ФС из файла профилей */
+typedef struct tune_saved {
+    char srcfs[40];
+    char dstfs[40];
+    unsigned bucket;
+    int strategy;
+    unsigned threads;
+    double rate;
+} tune_saved;
+
+/* наибольшее кол-во файлов в работе у одного потока io_uring. кольцо
+  ядра вмещает не больше 32768 заданий, на файл их уходит 7 */
+#define URING_MAX_SLOTS 4096
+
+/* кольцо io_uring, отображенное в память процесса */
+typedef struct uring {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+    unsigned to_submit; /* кол-во подготовленных, но не отправленных заданий */
+} uring;
+
+/* файл, копируемый через io_uring */
+typedef struct uring_slot {
+    char* srcname; /* полное имя исходного файла */
+    char* dstname; /* полное имя файла назначения */
+    time_t date; /* тайм штамп исходного файла */
+    u_int32_t date_ns; /* наносекунды тайм штампа */
+    unsigned pending; /* кол-во незавершенных операций цепочки */
+    int failed; /* одна из операций цепочки завершилась неудачно */
     u_int64_t size; /* размер файла */
-    struct dirlist* next; /* указатель на следующий элемент списка */
-} dirlist;
+    u_int64_t file; /* позиция в списке копирования */
+    struct timespec started; /* время постановки в очередь */
+    struct statx stx; /* исходный файл после чтения */
+} uring_slot;
+
+/* способы определения изменившихся файлов */
+enum compare_mode {
+    COMPARE_MTIME, /* файл в источнике новее (с точностью до секунды) */
+    COMPARE_SIZE_MTIME, /* отличается размер или тайм штамп с точностью до наносекунды */
+    COMPARE_CHECKSUM /* отличается размер или хеш содержимого */
+};
+
+/* состояние потокового хеша содержимого */
+typedef struct hash_state {
+    u_int64_t acc[8]; /* аккумуляторы полос */
+    u_int64_t stripes; /* кол-во полос в текущем блоке */
+    u_int64_t total; /* кол-во обработанных байт */
+} hash_state;
+
+/* задание на сравнение содержимого файлов в обоих каталогах */
+typedef struct hash_job {
+    const char* srcdir; /* имя исходного каталога */
+    const char* dstdir; /* имя каталога назначения */
+    const filetable* src; /* таблица исходного каталога */
+    const u_int64_t* idx; /* индексы сравниваемых файлов */
+    u_int64_t count; /* кол-во сравниваемых файлов */
+    const u_int64_t* known; /* известные хеши файлов назначения или NULL, 0 - неизвестен */
+    u_int64_t* hashes; /* результат: хеши исходных файлов или NULL */
+    unsigned char* differs; /* результат: 0 - совпадают, 1 - отличаются, 2 - ошибка */
+    atomic_uint_fast64_t cursor; /* индекс следующего файла */
+} hash_job;
+
+/* задание создания каталогов назначения */
+typedef struct mkdir_job {
+    const char* dstdir; /* имя каталога назначения */
+    const filetable* src; /* таблица исходного каталога */
+    const u_int64_t* dirs; /* индексы недостающих каталогов, упорядоченные так, что поддерево идет подряд */
+    u_int64_t ndirs; /* кол-во недостающих каталогов */
+    const u_int64_t* roots; /* позиции в dirs каталогов, родитель которых уже существует */
+    u_int64_t nroots; /* кол-во таких каталогов */
+    atomic_uint_fast64_t cursor; /* индекс следующего поддерева */
+    atomic_uint_fast64_t errors; /* кол-во ошибок */
+} mkdir_job;
 
 typedef struct dirinfo_t {
     u_int64_t nfiles;
     u_int64_t size;
 } dirinfo;
 
+/* состояние файла, копируемого по частям несколькими потоками */
+typedef struct chunkstate {
+    atomic_uint_fast64_t remaining; /* кол-во незавершенных частей */
+    atomic_int failed; /* подготовка или одна из частей завершилась с ошибкой */
+    int delta; /* файл обновляется поблочно */
+    int cloned; /* файл склонирован целиком, части копировать не нужно */
+} chunkstate;
+
+/* задание копирования: файл целиком или его часть */
+typedef struct copytask {
+    u_int64_t file; /* индекс в списке копируемых */
+    u_int64_t offset; /* начало части */
+    u_int64_t length; /* длина части */
+    chunkstate* chunk; /* состояние файла, копируемого по частям, или NULL */
+} copytask;
+
+/* копирование файлов с дырами */
+enum sparse_mode {
+    SPARSE_NEVER, /* копировать все байты */
+    SPARSE_AUTO, /* обходить дыры файлов, занимающих меньше блоков, чем их размер */
+    SPARSE_ALWAYS /* кроме того пропускать нулевые блоки данных */
+};
+
+/* копирует диапазон [start, end) экстента данных */
+typedef int (*copy_span_proc)(int fdin, int fdout, off_t start, off_t end, void* arg);
+
+/* копирование в обход кеша страниц */
+enum nocache_mode {
+    NOCACHE_OFF, /* обычное копирование */
+    NOCACHE_DIRECT, /* O_DIRECT, невыровненные края - как NOCACHE_FADVISE */
+    NOCACHE_FADVISE /* через буфер, записанное и прочитанное выбрасывается из кеша */
+};
+
+/* двойной буфер копирования с O_DIRECT: поток записи пишет один буфер,
+  пока в другой читается следующий блок */
+typedef struct direct_writer {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd; /* файл назначения */
+    char* buf[2]; /* буферы */
+    size_t len[2]; /* объем данных в буфере */
+    off_t off[2]; /* смещение данных буфера в файле */
+    int full[2]; /* буфер прочитан и ждет записи */
+    int done; /* чтение закончено */
+    int ec; /* ошибка записи */
+} direct_writer;
+
+/* порядок копирования файлов */
+enum copy_order {
+    ORDER_PATH, /* по имени */
+    ORDER_LARGEST_FIRST, /* сначала большие */
+    ORDER_SMALLEST_FIRST /* сначала маленькие */
+};
+
+/* кол-во групп файлов по размеру в гистограмме задержек */
+#define STAT_SIZE_BUCKETS 6
+/* кол-во интервалов задержки: степени двойки микросекунд */
+#define STAT_LAT_BUCKETS 32
+
+/* этапы синхронизации */
+enum sync_phase {
+    PHASE_SCAN_SRC,
+    PHASE_SCAN_DST,
+    PHASE_DIFF,
+    PHASE_MKDIR,
+    PHASE_COPY,
+    PHASE_COUNT
+};
+
+/* время этапа */
+typedef struct phase_stat {
+    double wall; /* секунды */
+    double cpu; /* процессорное время, секунды */
+    int done; /* этап выполнялся */
+} phase_stat;
+
+/* счетчики потока копирования. пишет их только сам поток, поэтому
+  достаточно relaxed, а читаются они лишь при выводе прогресса и итогов */
+typedef struct worker_stat {
+    atomic_uint_fast64_t files; /* скопировано файлов */
+    atomic_uint_fast64_t bytes; /* скопировано байт */
+    atomic_uint_fast64_t errors; /* кол-во ошибок */
+    struct timespec finished; /* время завершения потока */
+    double idle; /* ожидание остальных потоков после завершения, секунды */
+    u_int64_t latency[STAT_SIZE_BUCKETS][STAT_LAT_BUCKETS]; /* гистограммы задержек */
+} __attribute__((aligned(64))) worker_stat;
+
+/* статистика запуска */
+typedef struct sync_stats {
+    phase_stat phases[PHASE_COUNT];
+    worker_stat* workers; /* счетчики потоков последнего копирования */
+    unsigned nworkers;
+    u_int64_t files; /* кол-во файлов к копированию */
+    u_int64_t bytes; /* их суммарный объем */
+} sync_stats;
+
+/* данные потока вывода прогресса */
+typedef struct progress_data {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stop; /* копирование завершено */
+    struct timespec started; /* начало копирования */
+} progress_data;
+
+/* наблюдение за исходным каталогом */
+typedef struct watcher {
+    int fd; /* дескриптор inotify */
+    const char* srcdir; /* имя исходного каталога */
+    char** paths; /* путь каталога относительно корня по дескриптору наблюдения */
+    int npaths;
+    char** files; /* измененные файлы за окно накопления */
+    size_t nfiles, filecap;
+    char** subtrees; /* новые каталоги, которые нужно пересканировать целиком */
+    size_t nsubtrees, subtreecap;
+} watcher;
+
+/* запись каталога при обходе по каталогам */
+typedef struct pipe_entry {
+    size_t name; /* смещение имени в пуле строк списка */
+    unsigned char type; /* DT_REG или DT_DIR */
+    u_int64_t size; /* размер файла */
+    time_t date; /* тайм штамп файла */
+    u_int32_t date_ns; /* наносекунды тайм штампа */
+} pipe_entry;
+
+/* содержимое одного каталога */
+typedef struct pipe_list {
+    pipe_entry* e;
+    size_t n, cap;
+    char* pool; /* имена */
+    size_t poolsize, poolcap;
+} pipe_list;
+
+/* файл в очереди копирования конвейера */
+typedef struct pipe_item {
+    char* rel; /* имя относительно корня */
+    u_int64_t size; /* размер */
+    time_t date; /* тайм штамп */
+    u_int32_t date_ns; /* наносекунды тайм штампа */
+    int check; /* перед копированием сверить содержимое по хешу */
+} pipe_item;
+
+/* ограниченная очередь файлов между обходом и копированием */
+typedef struct pipe_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t notfull;
+    pthread_cond_t notempty;
+    pipe_item* items; /* кольцевой буфер */
+    size_t head, count, cap;
+    int closed; /* обход закончен, новых файлов не будет */
+} pipe_queue;
+
+/* общее состояние конвейера */
+typedef struct pipeline {
+    const char* srcdir; /* имя исходного каталога */
+    const char* dstdir; /* имя каталога назначения */
+    int srcfd; /* дескриптор исходного каталога */
+    int dstfd; /* дескриптор каталога назначения */
+    pthread_mutex_t dirlock;
+    pthread_cond_t dircond;
+    char** dirs; /* каталоги, ожидающие обхода */
+    size_t ndirs, dircap;
+    size_t active; /* кол-во каталогов в обработке */
+    pipe_queue queue;
+    atomic_uint nextstat; /* индекс счетчиков для следующего потока копирования */
+} pipeline;
+
+/* общее для всех потоков ограничение скорости: ведро токенов по байтам
+  и по операциям */
+typedef struct throttle_state {
+    pthread_mutex_t lock;
+    atomic_uint_fast64_t bwlimit; /* байт в секунду, 0 - без ограничения */
+    atomic_uint_fast64_t iopslimit; /* операций в секунду, 0 - без ограничения */
+    double bytes; /* доступный объем, в долг может уходить в минус */
+    double ops; /* доступные операции */
+    struct timespec last; /* время последнего пополнения */
+} throttle_state;
+
+/* ограничение кол-ва потоков для устройства */
+typedef struct device_limit {
+    dev_t dev; /* устройство */
+    unsigned threads; /* кол-во потоков */
+} device_limit;
+
+/* наибольшее кол-во каталогов назначения */
+#define MAX_DESTINATIONS 32
+
+/* копирование в несколько каталогов назначения */
+typedef struct fanout {
+    filetable* src; /* таблица исходного каталога */
+    filetable** dsts; /* таблицы каталогов назначения */
+    unsigned ndst; /* кол-во каталогов назначения */
+    u_int32_t* need; /* для файла исходного каталога: маска назначений, которым он нужен */
+    u_int32_t* failed; /* для файла исходного каталога: маска назначений, куда он не скопирован */
+    copylist files; /* файлы, нужные хотя бы одному назначению */
+    atomic_uint_fast64_t cursor; /* индекс следующего файла */
+    atomic_uint nextstat; /* индекс счетчиков для следующего потока */
+} fanout;
+
+/* метка протокола сетевого режима, с нее начинаются приветствие и список */
+#define NET_MAGIC "DSYNCNT3"
+/* размер случайного вызова сервера и ответа клиента на него */
+#define NET_NONCE_SIZE 32
+/* наибольшая длина общего секрета */
+#define NET_SECRET_MAX 4096
+/* размер буферов чтения и отправки пакетов */
+#define NET_BUF_SIZE (256*1024)
+/* файлы не больше этого размера передаются в общем пакете */
+#define NET_SMALL_FILE (64*1024)
+
+/* типы сообщений клиента */
+enum net_msg_type {
+    NET_MKDIR = 1, /* создать каталог */
+    NET_FILE, /* файл, за заголовком и именем следуют size байт данных и net_file_end */
+    NET_END /* конец передачи, сервер отвечает итогом */
+};
+
+/* заголовок сообщения клиента, за ним имя без завершающего нуля.
+  все числа в little-endian */
+typedef struct net_msg {
+    u_int32_t type; /* тип сообщения */
+    u_int32_t namelen; /* длина имени */
+    u_int64_t size; /* размер данных файла */
+    u_int64_t date; /* тайм штамп файла */
+    u_int32_t date_ns; /* наносекунды тайм штампа */
+    u_int32_t pad;
+} __attribute__((packed)) net_msg;
+
+/* завершение файла: клиент сообщает, удалось ли прочитать данные целиком.
+  если нет, данные были добиты нулями и сервер файл не оставляет */
+typedef struct net_file_end {
+    u_int32_t error; /* errno чтения исходного файла или 0 */
+    u_int32_t pad;
+} __attribute__((packed)) net_file_end;
+
+/* заголовок списка файлов сервера. за ним nfiles описаний файлов,
+  ndirs описаний каталогов и пул имен */
+typedef struct net_list_header {
+    char magic[8]; /* NET_MAGIC */
+    u_int64_t nfiles;
+    u_int64_t ndirs;
+    u_int64_t poolsize;
+} __attribute__((packed)) net_list_header;
+
+/* описание файла или каталога в списке */
+typedef struct net_entry {
+    u_int64_t name; /* смещение имени в пуле */
+    u_int64_t size; /* размер, у каталога 0 */
+    u_int64_t date; /* тайм штамп */
+    u_int32_t date_ns; /* наносекунды тайм штампа */
+    u_int32_t pad;
+} __attribute__((packed)) net_entry;
+
+/* итог сессии, который сервер присылает в ответ на NET_END */
+typedef struct net_result {
+    u_int64_t files; /* принято файлов */
+    u_int64_t errors; /* кол-во ошибок */
+} __attribute__((packed)) net_result;
+
+/* буферизованное чтение из сокета */
+typedef struct net_reader {
+    int fd;
+    char* buf;
+    size_t pos, len; /* непрочитанные данные буфера */
+} net_reader;
+
+/* накопление мелких сообщений в пакет */
+typedef struct net_writer {
+    int fd;
+    char* buf;
+    size_t len; /* заполнено */
+} net_writer;
+
+/* отметка начала этапа */
+typedef struct phase_clock {
+    struct timespec wall;
+    struct timespec cpu;
+} phase_clock;
+
+/* файл с несколькими жесткими ссылками при поиске групп ссылок */
+typedef struct link_cand {
+    u_int32_t dev; /* устройство */
+    u_int64_t ino; /* inode */
+    u_int64_t idx; /* индекс в таблице исходного каталога */
+    u_int64_t pos; /* позиция в списке копирования */
+    int incopy; /* файл есть в списке копирования */
+} link_cand;
+
+/* группы жестких ссылок среди копируемых файлов. копируется одно имя
+  группы, остальные создаются ссылками на него */
+typedef struct hardlinks {
+    u_int64_t* group; /* для позиции в списке копирования: номер группы плюс один, 0 - ссылок нет */
+    u_int64_t* first; /* начало имен группы в names, ngroups+1 элементов */
+    u_int64_t* names; /* индексы остальных имен групп в таблице исходного каталога */
+    u_int64_t ngroups; /* кол-во групп */
+} hardlinks;
+
 /* структура данных потока */
 typedef struct thread_data {
-    dirlist* dlist; /* указатель на список файлов */
+    copylist* files; /* список файлов к копированию */
     const char* srcdir; /* имя исходного каталога */
     const char* dstdir; /* имя каталога назначения */
+    copytask* tasks; /* задания копирования */
+    u_int64_t ntasks; /* кол-во заданий */
+    chunkstate* chunks; /* состояния файлов, копируемых по частям */
+    u_int64_t nchunked; /* кол-во таких файлов */
+    atomic_uint_fast64_t cursor; /* индекс следующего задания */
+    worker_stat* stats; /* счетчики потоков */
+    atomic_uint nextstat; /* индекс счетчиков для следующего потока */
+    const hardlinks* links; /* группы жестких ссылок или NULL */
 } thread_data;
 
-int threads_count = 0; /* счетчик кол-ва потоков */
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER; /* мьютекс блокировки доступа потоков к списку файлов */
+/* группа заданий с одной парой устройств и своим набором потоков */
+typedef struct device_group {
+    dev_t srcdev; /* исходное устройство */
+    dev_t dstdev; /* устройство назначения */
+    u_int64_t first; /* первое задание группы */
+    u_int64_t count; /* кол-во заданий группы */
+    unsigned nthreads; /* кол-во потоков группы */
+    int node; /* NUMA узел исходного устройства, -1 - неизвестен */
+    thread_data data; /* данные потоков группы, задания - часть общего массива */
+} device_group;
+
+int copy_engine = ENGINE_AUTO; /* способ копирования, заданный пользователем */
+int use_uring = 0; /* копировать мелкие файлы через io_uring */
+u_int64_t uring_slots = 256; /* кол-во файлов, одновременно копируемых одним потоком через io_uring */
+int compare_mode = COMPARE_MTIME; /* способ определения изменившихся файлов */
+atomic_uint_fast64_t copy_errors; /* кол-во файлов, скопированных с ошибкой */
+u_int64_t delta_threshold = 0; /* файлы не меньше этого размера обновляются поблочно, 0 - никогда */
+u_int64_t delta_block = 1024*1024; /* размер блока при поблочном обновлении */
+atomic_uint_fast64_t delta_total; /* объем файлов, обновленных поблочно */
+atomic_uint_fast64_t delta_written; /* объем фактически перезаписанных блоков */
+u_int64_t chunk_size = 64*1024*1024; /* размер части при копировании файла несколькими потоками, 0 - не делить */
+int copy_order = ORDER_PATH; /* порядок копирования файлов */
+int quiet = 0; /* не выводить сообщения о каждом файле */
+unsigned progress_interval = 0; /* период вывода прогресса в секундах, 0 - не выводить */
+sync_stats stats; /* статистика запуска */
+int sparse_mode = SPARSE_AUTO; /* копирование файлов с дырами */
+atomic_uint_fast64_t sparse_skipped; /* объем дыр и нулевых блоков, которые не писались */
+atomic_uint_fast64_t links_created; /* кол-во имен, созданных жесткими ссылками */
+/* размер блока при поиске нулевых блоков */
+#define SPARSE_BLOCK 4096
+u_int64_t atomic_batch = 0; /* атомарная замена файлов, syncfs после стольких файлов, 0 - копировать на месте */
+atomic_uint_fast64_t atomic_published; /* кол-во атомарно замененных файлов */
+int nocache_mode = NOCACHE_OFF; /* копирование в обход кеша страниц */
+/* выравнивание буферов и смещений для O_DIRECT */
+#define NOCACHE_ALIGN 4096
+/* размер одного буфера при копировании в обход кеша */
+#define NOCACHE_BUF_SIZE (1024*1024)
+/* объем записанного, после которого он отдается на запись и выбрасывается из кеша */
+#define NOCACHE_WINDOW (8*1024*1024)
+char* nocache_pool = NULL; /* свободные пары буферов */
+pthread_mutex_t nocache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define DEVICE_LIMITS_MAX 32
+device_limit device_limits[DEVICE_LIMITS_MAX]; /* заданные кол-ва потоков по устройствам */
+unsigned ndevice_limits = 0;
+int pin_workers = 0; /* привязывать потоки копирования к процессорам узла NUMA устройства */
+throttle_state throttle = {PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, {0, 0}}; /* ограничение скорости копирования */
+const char* limits_file = NULL; /* файл с ограничениями, перечитывается по SIGHUP */
+volatile sig_atomic_t limits_reload = 0; /* получен SIGHUP */
+/* при ограничении скорости данные передаются частями не больше этой */
+#define THROTTLE_CHUNK (1024*1024)
+int autotune = 0; /* подбирать способ копирования по классам размеров файлов */
+int calibrate = 0; /* перед копированием измерить способы на образцах */
+#define TUNE_PROFILES_MAX 64
+tune_profile* tune_profiles[TUNE_PROFILES_MAX]; /* профили пар устройств этого запуска */
+unsigned tune_nprofiles = 0;
+pthread_rwlock_t tune_lock = PTHREAD_RWLOCK_INITIALIZER;
+tune_saved* tune_saved_list = NULL; /* профили, прочитанные из файла */
+unsigned tune_nsaved = 0;
+char* tune_pool = NULL; /* свободные буферы автонастройки */
+pthread_mutex_t tune_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define ENGINE_CACHE_SIZE 64
+engine_cache_entry engine_cache[ENGINE_CACHE_SIZE]; /* кеш способов копирования по парам устройств */
+unsigned engine_cache_count = 0;
+pthread_rwlock_t engine_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 /***************************************************************************/
 
@@ -49,58 +707,307 @@ const char* readable_fs(char *buf, u_int64_t fsize);
 
 const char* readable_pthread_t(char *buf, pthread_t pt);
 
-/* функция, читает содержимое каталога в список */
-dirlist* read_dir_tree(dirlist* dlist, const char* path);
+/* параллельно читает содержимое нескольких каталогов в таблицы */
+int read_dir_trees(filetable** tables, unsigned ntrees, unsigned nthreads, phase_stat* times);
+
+/* добавляет файл в таблицу, возвращает его индекс */
+u_int64_t filetable_add(filetable* ft, const char* relname, const struct stat* st);
+
+/* добавляет описание файла в таблицу, возвращает его индекс */
+u_int64_t filetable_add_entry(filetable* ft, const char* relname, const fileentry* e);
+
+/* добавляет каталог в таблицу */
+void filetable_add_dir(filetable* ft, const char* relname, const struct stat* st);
+
+/* переносит содержимое одной таблицы в конец другой */
+void filetable_append(filetable* ft, const filetable* from);
+
+/* возвращает имя файла относительно корня */
+static inline const char* file_name(const filetable* ft, const fileentry* e) {
+    return ft->pool+e->name;
+}
+
+/* добавляет индекс файла в список копируемых */
+void copylist_add(copylist* cl, u_int64_t idx);
+
+/* получает следующее, еще не выполненное задание */
+const copytask* get_next(thread_data* data);
+
+/* упорядочивает список копируемых файлов */
+void sort_copylist(copylist* cl, int order);
+
+/* строит задания копирования, большие файлы делит на части */
+void build_tasks(thread_data* data);
+
+/* создает файлы назначения для копирования по частям */
+void prepare_chunked(thread_data* data);
+
+/* упаковывает номер устройства в 32 бита */
+u_int32_t dev_pack(dev_t dev);
+
+/* задает кол-во потоков для устройства по спецификации PATH=N */
+int parse_device_threads(const char* spec);
 
-/* выделяет память для элемента списка */
-dirlist* alloc_next();
+/* делит задания на группы по устройствам, у каждой группы свои потоки */
+unsigned build_device_groups(thread_data* data, dev_t dstdev, unsigned nthreads, device_group** result);
 
-/* связывает элементы списка */
-dirlist* link_nodes(dirlist* left, const dirlist* right);
+/* привязывает поток группы к процессору узла NUMA ее устройства */
+void device_pin(const device_group* g, pthread_t thread, unsigned index);
 
-/* получает следующий, еще не скопированный файл */
-dirlist* get_next(dirlist* dlist);
+/* выполняет задание копирования */
+void copy_task(thread_data* data, const copytask* task, const char* who, worker_stat* ws);
 
-/* возвращает кол-во файлов в списке */
-void get_dirinfo(dirinfo *di, const dirlist* dlist);
+/* копирует часть файла */
+int copy_chunk(const char* srcname, const char* dstname, u_int64_t offset, u_int64_t length, int delta);
 
-/* создает имя результирующего файла */
-char* create_dst_filename(const char* srcdir, const char* srcname, const char* dstdir);
+/* возвращает кол-во файлов в таблице */
+void get_dirinfo(dirinfo *di, const filetable* ft);
 
-/* создает имя исходного файла */
-char* create_src_filename(const char* dstdir, const char* dstname, const char* srcdir);
+/* возвращает кол-во файлов в списке копируемых */
+void get_copyinfo(dirinfo *di, const copylist* cl);
 
-/* извлекает имя каталога */
-char* extract_path(const char* filename);
+/* создает полное имя файла из имени каталога и имени относительно него */
+char* make_filename(const char* dir, const char* relname);
 
-/* создает структуру каталога */
-int create_dir_tree(const char* dirname);
+/* строит хеш-индекс таблицы файлов по именам относительно корня */
+void build_pathindex(pathindex* idx, const filetable* ft);
+
+/* строит хеш-индекс каталогов таблицы */
+void build_dirindex(pathindex* idx, const filetable* ft);
+
+/* находит запись по имени, возвращает ее индекс или -1 */
+int64_t pathindex_find(const pathindex* idx, const char* relname);
+
+/* находит файл по имени относительно корня */
+const fileentry* find_by_relname(const pathindex* idx, const char* relname);
+
+void free_pathindex(pathindex* idx);
+
+/* создает недостающие каталоги назначения в nthreads потоков */
+int create_dst_skeleton(const filetable* src, const filetable* dst, const char* dstdir, unsigned nthreads);
 
 /* копирует файл */
 int copy_file(const char* srcname, const char* dstname, time_t srctime);
 
+/* сбрасывает на диск файлы, атомарно замененные после последнего syncfs */
+void atomic_finish(const char* dstdir);
+
+/* копирует содержимое открытого файла способом, подходящим для пары устройств */
+int copy_data(int fdin, int fdout, const struct stat* st);
+
+/* клонирует файл целиком, если copy_data начала бы с reflink */
+int clone_whole(int fdin, int fdout, const struct stat* st);
+
+/* перезаписывает в файле назначения только отличающиеся блоки */
+int copy_delta(int fdin, int fdout, const struct stat* st);
+
+/* проверяет, нужно ли копировать файл с учетом дыр */
+int is_sparse_copy(const struct stat* st);
+
+/* копирует файл с дырами */
+int copy_sparse(int fdin, int fdout, const struct stat* st);
+
+/* копирует диапазон [start, end) в обход кеша страниц */
+int copy_nocache(int fdin, int fdout, off_t start, off_t end, void* arg);
+
+/* освобождает пул буферов копирования в обход кеша */
+void nocache_pool_free();
+
+/* копирует содержимое способом, выбранным автонастройкой для класса размера */
+int copy_tuned(int fdin, int fdout, const struct stat* st, dev_t dstdev);
+
+/* измеряет способы копирования на файлах исходного каталога */
+int tune_calibrate(const filetable* src, const char* dstdir, unsigned nthreads);
+
+/* читает файл профилей автонастройки */
+int tune_load(const char* path);
+
+/* выводит выбранные способы с префиксом */
+void tune_print(const char* prefix);
+
+/* выводит выбор этого запуска и сохраняет его в файл профилей */
+void tune_finish(const char* path, int show_info);
+
+/* освобождает пул буферов автонастройки */
+void tune_pool_free();
+
+/* копирует только экстенты данных диапазона [start, end) */
+int copy_extents(int fdin, int fdout, off_t start, off_t end, copy_span_proc proc, void* arg);
+
+/* перезаписывает отличающиеся блоки в диапазоне [start, end) */
+int copy_delta_range(int fdin, int fdout, off_t start, off_t end, off_t dstsize, u_int64_t* written);
+
+/* разбирает размер с необязательным суффиксом K, M, G, T */
+int parse_size(const char* str, u_int64_t* size);
+
+/* возвращает способ копирования по имени */
+int parse_copy_engine(const char* name);
+
+/* списывает want байт и одну операцию с ограничения скорости, при
+  необходимости ждет. возвращает объем, который можно передать за раз */
+size_t throttle_take(size_t want);
+
+/* читает ограничения скорости из файла */
+int load_limits(const char* path);
+
+/* обработчик SIGHUP: ограничения будут перечитаны при следующем списании */
+void limits_signal(int sig);
+
 /* возвращает список файлов которые необходимо скопировать */
-dirlist* get_difference(
-    dirlist* result,
-    const dirlist* srclist, const char* srcdir,
-    const dirlist* dstlist, const char* dstdir
-);
+copylist* get_difference(copylist* result, filetable* srclist, filetable* dstlist, unsigned nthreads);
+
+/* хеширует содержимое файла */
+int hash_file(const char* name, u_int64_t* digest, unsigned char* buf);
+
+/* сравнивает содержимое файлов по хешу в nthreads потоков */
+void compare_contents(hash_job* job, unsigned nthreads);
+
+/* сверяет содержимое скопированных файлов, возвращает кол-во несовпадений */
+u_int64_t verify_copied(const copylist* cl, const char* srcdir, const char* dstdir, unsigned nthreads, u_int64_t* hashes);
+
+/* загружает таблицу каталога назначения из файла индекса */
+int load_index(filetable* ft, const char* path);
+
+/* проверяет, что каталоги не менялись с момента записи индекса */
+int index_is_fresh(const filetable* ft);
+
+/* строит таблицу каталога назначения после копирования */
+void build_synced_table(filetable* out, const filetable* src, const filetable* dst, const copylist* copied, const u_int64_t* copiedhashes);
 
-void free_dirlist(dirlist *list);
+/* записывает таблицу в файл индекса */
+int write_index(const filetable* ft, const char* path);
+
+void free_filetable(filetable* ft);
+
+void free_copylist(copylist* cl);
+
+/* находит группы жестких ссылок в списке копирования. work получает
+  список без имен, которые будут созданы ссылками */
+void build_hardlinks(hardlinks* hl, copylist* work, const copylist* cl, const char* dstdir);
+
+/* освобождает группы жестких ссылок */
+void free_hardlinks(hardlinks* hl);
+
+/* создает остальные имена скопированного файла */
+void link_copied(thread_data* data, u_int64_t pos, int copied, worker_stat* ws);
 
 /* функция потока выполняющая копирование файлов */
 void* thread_proc(void* p);
 
+/* функция потока выполняющая копирование файлов через io_uring */
+void* uring_thread_proc(void* p);
+
+/* проверяет, что ядро поддерживает нужные операции io_uring */
+int uring_available();
+
+/* запускает и останавливает поток вывода прогресса */
+void progress_start(progress_data* pd, pthread_t* thread);
+void progress_stop(progress_data* pd, pthread_t thread);
+
+/* копирует файлы списка в nthreads потоков */
+void copy_files(copylist* result, const filetable* srclist, const filetable* dstlist, unsigned nthreads);
+
+/* генерирует тестовое дерево и измеряет этапы синхронизации */
+int run_bench(const char* spec);
+
+/* читает общий секрет сетевого режима из первой строки файла */
+int net_load_secret(const char* path, char* secret, size_t size);
+
+/* отдает каталог dstdir клиентам, подключающимся к [HOST:]PORT */
+int run_server(const char* spec, const char* dstdir, unsigned nthreads, const char* secret);
+
+/* синхронизирует srcdir с каталогом сервера [HOST:]PORT */
+int run_client(const char* srcdir, const char* spec, unsigned nthreads, int show_info, const char* secret);
+
+/* синхронизирует исходный каталог с несколькими каталогами назначения */
+int run_fanout(const char* srcdir, const char** dstdirs, unsigned ndst, unsigned nthreads, int show_info);
+
+/* синхронизирует каталоги конвейером с очередью на depth файлов */
+int run_pipeline(const char* srcdir, const char* dstdir, unsigned nthreads, unsigned depth);
+
+/* подписывается на изменения во всех каталогах исходного дерева */
+int watch_init(watcher* w, const filetable* src);
+
+/* синхронизирует изменения исходного каталога до получения сигнала */
+int watch_loop(watcher* w, const char* dstdir, unsigned nthreads, unsigned debounce_ms);
+
+void watch_free(watcher* w);
+
+/* запоминает начало этапа */
+void phase_begin(phase_clock* pc);
+
+/* записывает время этапа в статистику */
+void phase_end(int phase, const phase_clock* pc);
+
+/* учитывает скопированный файл или часть файла в счетчиках потока */
+void stat_copied(worker_stat* ws, u_int64_t size, const struct timespec* started, u_int64_t files);
+
+/* выводит итоговую статистику */
+void print_stats();
+
+/* записывает статистику в файл в формате JSON */
+int write_stats_json(const char* path);
+
 void usage(const char* pname) {
     char* p = strrchr(pname, '/');
     p = (p)?p+1:"dsync2";
 
     static const char* usage_string =
             "\t--src=dir_name     --  source directory name\n"
-            "\t--dst=dir_name     --  destination directory name\n"
+            "\t--dst=dir_name     --  destination directory name, may be repeated to sync\n"
+            "\t                       several destinations reading the source once\n"
             "\t--symlinks=yes|no  --  read symlinks\n"
             "\t--threads=N        --  number of worker threads\n"
+            "\t--copy-engine=E    --  auto|reflink|copy_file_range|sendfile|readwrite\n"
+            "\t--io-uring[=N]     --  copy small files through io_uring, N files in flight\n"
+            "\t                       per thread (default 256)\n"
+            "\t--compare=M        --  mtime|size+mtime|checksum\n"
+            "\t--verify           --  verify copied files by checksum\n"
+            "\t--index=file_name  --  persistent destination index\n"
+            "\t--delta=SIZE       --  update files of at least SIZE block by block\n"
+            "\t--delta-block=SIZE --  block size for --delta (default 1M)\n"
+            "\t--chunk-size=SIZE  --  split files of at least 2*SIZE between threads (default 64M, 0 - off)\n"
+            "\t--order=O          --  path|largest-first|smallest-first\n"
+            "\t--sparse=M         --  never|auto|always (always also skips zero blocks)\n"
             "\t--info             --  show statistic at finish\n"
+            "\t--quiet            --  do not print a line per copied file\n"
+            "\t--progress[=SEC]   --  print progress with throughput and ETA every SEC seconds (default 1)\n"
+            "\t--stats-json=FILE  --  write phase times, per-thread counters and latencies to FILE\n"
+            "\t--bwlimit=SIZE     --  limit total copy bandwidth to SIZE bytes per second\n"
+            "\t--iops-limit=N     --  limit total copy operations to N per second\n"
+            "\t--limits-file=PATH --  read bwlimit= and iops-limit= lines from PATH,\n"
+            "\t                       reread it on SIGHUP\n"
+            "\t--device-threads=PATH=N\n"
+            "\t                   --  use at most N copy threads for files read from or\n"
+            "\t                       written to the device holding PATH, may be repeated.\n"
+            "\t                       files are grouped by source device, each group has its\n"
+            "\t                       own threads within the limit of its source device, and\n"
+            "\t                       all groups share the limit of the --dst device. a thread\n"
+            "\t                       reads and writes its file itself, so one limit per device\n"
+            "\t                       covers both directions\n"
+            "\t--no-cache[=MODE]  --  keep copied data out of the page cache: direct (default,\n"
+            "\t                       O_DIRECT with double buffering) or fadvise (buffered,\n"
+            "\t                       written data is flushed and dropped behind a window)\n"
+            "\t--serve=[HOST:]PORT\n"
+            "\t                   --  serve the --dst directory to dsync2 clients over TCP,\n"
+            "\t                       on loopback unless HOST is given (0.0.0.0 or [::] for all)\n"
+            "\t--remote=HOST:PORT --  sync --src into the directory served at HOST:PORT\n"
+            "\t--secret-file=PATH --  shared secret for --serve and --remote, first line of PATH\n"
+            "\t--atomic[=N]       --  write each file to a temporary file and rename it into\n"
+            "\t                       place, syncfs the destination every N files (1000)\n"
+            "\t--autotune[=FILE]  --  measure copy methods per file size class during the run and\n"
+            "\t                       keep the fastest; choices are saved per filesystem pair\n"
+            "\t                       in FILE (default ~/.dsync2-tune) and reused later\n"
+            "\t--calibrate        --  like --autotune, but first measure methods and concurrency\n"
+            "\t                       on sample source files copied to a scratch directory\n"
+            "\t--pin-cpus         --  pin copy threads to CPUs of the source device's NUMA node\n"
+            "\t--pipeline[=N]     --  diff directory by directory and copy at the same time\n"
+            "\t                       through a queue of N files (default 4096)\n"
+            "\t--watch[=MS]       --  after the sync keep watching the source and copy changes,\n"
+            "\t                       coalescing events for MS milliseconds (default 200)\n"
+            "\t--bench[=SPEC]     --  generate a synthetic tree and benchmark scan, diff and copy\n"
+            "\t                       SPEC: key=value,... dir, files, min, max, depth, fanout,\n"
+            "\t                       sparse (%), modified (%), threads (1:2:4), engines (auto:readwrite), seed, keep\n"
             "\t--version          --  show program version\n"
             ;
     fprintf(stdout,
@@ -123,7 +1030,7 @@ void version(const char *pname) {
 
 int main(int argc, char** argv) {
     /**  */
-    if ( argc < 3 ) {
+    if ( argc < 2 ) {
         usage(argv[0]);
         return 1;
     }
@@ -133,37 +1040,77 @@ int main(int argc, char** argv) {
     /** flags */
     int show_info = 0;
     int show_version = 0;
+    int verify = 0;
 
     /**  */
     const char* srcdir = NULL; /* имя исходного каталога */
     const char* dstdir = NULL; /* имя каталога назначения */
+    const char* dstdirs[MAX_DESTINATIONS]; /* все каталоги назначения */
+    unsigned ndst = 0; /* кол-во каталогов назначения */
+    const char* index_path = NULL; /* имя файла индекса каталога назначения */
+    int index_loaded = 0; /* каталог назначения взят из индекса */
 
     /**  */
-    unsigned idx = 0;
     unsigned nthreads = 2; /* кол-во потоков копирования */
+    const char* bench_spec = NULL; /* параметры встроенного теста производительности */
+    const char* stats_json = NULL; /* файл для статистики в формате JSON */
+    unsigned pipeline_depth = 0; /* глубина очереди конвейерного режима, 0 - обычный режим */
+    int chunk_given = 0; /* размер части задан явно */
+    const char* serve = NULL; /* адрес, на котором отдавать каталог назначения */
+    const char* remote = NULL; /* адрес сервера с каталогом назначения */
+    const char* secret_file = NULL; /* файл с общим секретом сетевого режима */
+    char secret[NET_SECRET_MAX];
+    const char* tune_path = NULL; /* файл профилей автонастройки */
+    char tunebuf[PATH_MAX];
+    int watch = 0; /* после синхронизации следить за исходным каталогом */
+    unsigned watch_debounce = 200; /* окно накопления событий, мс */
+    watcher w; /* наблюдение за исходным каталогом */
+    phase_clock pc; /* начало текущего этапа */
 
     /**  */
-    dirlist srclist = {0,0,0,0,0}; /* список файлов в исходном каталоге */
-    dirlist dstlist = {0,0,0,0,0}; /* список файлов в каталоге назначения */
-    dirlist result  = {0,0,0,0,0}; /* список файлов к копированию */
+    filetable srclist; /* таблица файлов в исходном каталоге */
+    filetable dstlist; /* таблица файлов в каталоге назначения */
+    copylist result; /* список файлов к копированию */
 
     /**  */
     dirinfo srcdi = {0,0};
     dirinfo dstdi = {0,0};
     dirinfo tocopy= {0,0};
 
-    /**  */
-    pthread_t* threads; /* указатель на потоки копирования */
-
-    /* заполняю структуру данных потоков */
-    thread_data thdata;
-
     /**  */
     static struct option long_options[] = {
         {"src", required_argument, 0, 's'},
         {"dst", required_argument, 0, 'd'},
         {"threads", required_argument, 0, 't'},
+        {"copy-engine", required_argument, 0, 'e'},
+        {"io-uring", optional_argument, 0, 'u'},
+        {"compare", required_argument, 0, 'c'},
+        {"verify", no_argument, 0, 'V'},
+        {"index", required_argument, 0, 'x'},
+        {"delta", required_argument, 0, 'D'},
+        {"delta-block", required_argument, 0, 'B'},
+        {"chunk-size", required_argument, 0, 'C'},
+        {"order", required_argument, 0, 'O'},
+        {"sparse", required_argument, 0, 'S'},
         {"info", no_argument, 0, 'i'},
+        {"bench", optional_argument, 0, 'b'},
+        {"quiet", no_argument, 0, 'q'},
+        {"progress", optional_argument, 0, 'p'},
+        {"stats-json", required_argument, 0, 'j'},
+        {"watch", optional_argument, 0, 'w'},
+        {"pipeline", optional_argument, 0, 'P'},
+        {"device-threads", required_argument, 0, 'T'},
+        {"pin-cpus", no_argument, 0, 'a'},
+        {"no-cache", optional_argument, 0, 'n'},
+        {"serve", required_argument, 0, 'z'},
+        {"atomic", optional_argument, 0, 'A'},
+        {"autotune", optional_argument, 0, 'U'},
+        {"calibrate", no_argument, 0, 'K'},
+        {"remote", required_argument, 0, 'r'},
+        {"secret-file", required_argument, 0, 'Y'},
+        {"bwlimit", required_argument, 0, 'L'},
+        {"iops-limit", required_argument, 0, 'I'},
+        {"limits-file", required_argument, 0, 'F'},
         {"version", no_argument, 0, 'v'},
         {0,0,0,0}
     };
@@ -172,7 +1119,7 @@ int main(int argc, char** argv) {
         int opt = 0, option_index = 0;
         opt = getopt_long(
                     argc, argv,
-                    "s:d:t:iv",
+                    "s:d:t:e:u::c:Vx:D:B:C:O:S:b::qp::j:w::P::L:I:F:T:an::z:r:Y:A::U::Kiv",
                     long_options,
                     &option_index
                     );
@@ -180,10 +1127,154 @@ int main(int argc, char** argv) {
 
         switch ( opt ) {
         case 's': srcdir = optarg; break;
-        case 'd': dstdir = optarg; break;
+        case 'd':
+            if ( ndst == MAX_DESTINATIONS ) {
+                printf("too many destination directories! terminate.\n");
+                return 1;
+            }
+            dstdirs[ndst++] = optarg;
+            dstdir = dstdirs[0];
+            break;
         case 't': nthreads=atoi(optarg); break;
+        case 'e':
+            copy_engine = parse_copy_engine(optarg);
+            if ( copy_engine == ENGINE_COUNT ) {
+                printf("unknown copy engine \"%s\"! terminate.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'u':
+            use_uring = 1;
+            if ( optarg && (parse_size(optarg, &uring_slots) || !uring_slots || uring_slots > URING_MAX_SLOTS) ) {
+                printf("wrong io_uring depth \"%s\"! terminate.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            if ( 0 == strcmp(optarg, "mtime") ) compare_mode = COMPARE_MTIME;
+            else if ( 0 == strcmp(optarg, "size+mtime") ) compare_mode = COMPARE_SIZE_MTIME;
+            else if ( 0 == strcmp(optarg, "checksum") ) compare_mode = COMPARE_CHECKSUM;
+            else {
+                printf("unknown compare mode \"%s\"! terminate.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'V': verify=1; break;
+        case 'x': index_path = optarg; break;
+        case 'D':
+            if ( parse_size(optarg, &delta_threshold) ) {
+                printf("wrong delta threshold \"%s\"! terminate.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'B':
+            if ( parse_size(optarg, &delta_block) || !delta_block ) {
+                printf("wrong delta block size \"%s\"! terminate.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'C':
+            if ( parse_size(optarg, &chunk_size) ) {
+                printf("wrong chunk size \"%s\"! terminate.\n", optarg);
+                return 1;
+            }
+            chunk_given = 1;
+            break;
+        case 'O':
+            if ( 0 == strcmp(optarg, "path") ) copy_order = ORDER_PATH;
+            else if ( 0 == strcmp(optarg, "largest-first") ) copy_order = ORDER_LARGEST_FIRST;
+            else if ( 0 == strcmp(optarg, "smallest-first") ) copy_order = ORDER_SMALLEST_FIRST;
+            else {
+                printf("unknown order \"%s\"! terminate.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'S':
+            if ( 0 == strcmp(optarg, "never") ) sparse_mode = SPARSE_NEVER;
+            else if ( 0 == strcmp(optarg, "auto") ) sparse_mode = SPARSE_AUTO;
+            else if ( 0 == strcmp(optarg, "always") ) sparse_mode = SPARSE_ALWAYS;
+            else {
+                printf("unknown sparse mode \"%s\"! terminate.\n", optarg);
+                return 1;
+            }
+            break;
         case 'i': show_info=1; break;
         case 'v': show_version=1; break;
+        case 'b': bench_spec = optarg ? optarg : ""; break;
+        case 'q': quiet = 1; break;
+        case 'p':
+            /* прогресс заменяет сообщения о каждом файле */
+            progress_interval = optarg ? (unsigned)atoi(optarg) : 1;
+            if ( !progress_interval ) {
+                printf("wrong progress interval \"%s\"! terminate.\n", optarg);
+                return 1;
+            }
+            quiet = 1;
+            break;
+        case 'j': stats_json = optarg; break;
+        case 'L':
+        case 'I': {
+            u_int64_t limit;
+            if ( parse_size(optarg, &limit) ) {
+                printf("wrong %s \"%s\"! terminate.\n", opt == 'L' ? "bwlimit" : "iops limit", optarg);
+                return 1;
+            }
+            atomic_store(opt == 'L' ? &throttle.bwlimit : &throttle.iopslimit, limit);
+            break;
+        }
+        case 'F':
+            limits_file = optarg;
+            if ( load_limits(limits_file) ) {
+                printf("error reading limits file \"%s\"! terminate.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'T':
+            if ( parse_device_threads(optarg) ) {
+                printf("wrong device threads \"%s\"! terminate.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'a':
+            pin_workers = 1;
+            break;
+        case 'A':
+            atomic_batch = 1000;
+            if ( optarg && (parse_size(optarg, &atomic_batch) || !atomic_batch) ) {
+                printf("wrong atomic batch \"%s\"! terminate.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'U':
+            autotune = 1;
+            if ( optarg ) tune_path = optarg;
+            break;
+        case 'K': autotune = calibrate = 1; break;
+        case 'z': serve = optarg; break;
+        case 'r': remote = optarg; break;
+        case 'Y': secret_file = optarg; break;
+        case 'n':
+            if ( !optarg || 0 == strcmp(optarg, "direct") ) nocache_mode = NOCACHE_DIRECT;
+            else if ( 0 == strcmp(optarg, "fadvise") ) nocache_mode = NOCACHE_FADVISE;
+            else {
+                printf("unknown no-cache mode \"%s\"! terminate.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'P':
+            pipeline_depth = optarg ? (unsigned)atoi(optarg) : 4096;
+            if ( !pipeline_depth ) {
+                printf("wrong pipeline depth \"%s\"! terminate.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'w':
+            watch = 1;
+            if ( optarg && !(watch_debounce = (unsigned)atoi(optarg)) ) {
+                printf("wrong watch debounce \"%s\"! terminate.\n", optarg);
+                return 1;
+            }
+            break;
         default: usage(argv[0]); exit(1);
         }
     }
@@ -193,10 +1284,87 @@ int main(int argc, char** argv) {
         return 0;
     }
 
+    /* части и поблочное обновление пишут в файл назначения на месте,
+      а io_uring открывает его с O_TRUNC */
+    if ( atomic_batch ) {
+        if ( delta_threshold || use_uring ) {
+            fprintf(stderr, "--delta and --io-uring are not used with --atomic\n");
+        }
+        chunk_size = 0;
+        delta_threshold = 0;
+        use_uring = 0;
+    }
+
+    /* автонастройка сама выбирает способ копирования */
+    if ( autotune && (copy_engine != ENGINE_AUTO || nocache_mode) ) {
+        fprintf(stderr, "--autotune and --calibrate are not used with --copy-engine and --no-cache\n");
+        autotune = calibrate = 0;
+    }
+    /* части копируются своими способами, выбранный пользователем способ
+      или автонастройка действуют только на файл целиком */
+    if ( copy_engine != ENGINE_AUTO || autotune ) {
+        if ( chunk_given && chunk_size ) {
+            fprintf(stderr, "--chunk-size is not used with --copy-engine, --autotune and --calibrate\n");
+        }
+        chunk_size = 0;
+    }
+    if ( autotune ) {
+        if ( !tune_path && getenv("HOME") ) {
+            snprintf(tunebuf, sizeof(tunebuf), "%s/.dsync2-tune", getenv("HOME"));
+            tune_path = tunebuf;
+        }
+        if ( tune_path && !calibrate ) tune_load(tune_path);
+    }
+
+    if ( limits_file ) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = limits_signal;
+        sigaction(SIGHUP, &sa, NULL);
+    }
+
+    if ( bench_spec ) {
+        return run_bench(bench_spec);
+    }
+
+    /* сетевой режим пускает только знающих общий секрет */
+    if ( serve || remote ) {
+        int ec = secret_file ? net_load_secret(secret_file, secret, sizeof(secret)) : EINVAL;
+        if ( ec ) {
+            printf("--serve and --remote need a non-empty --secret-file! terminate.\n");
+            return 1;
+        }
+    }
+
+    if ( serve ) {
+        if ( !dstdir || access(dstdir, F_OK) ) {
+            printf("destination directory is not specified or not exists! terminate.\n");
+            return 1;
+        }
+        return run_server(serve, dstdir, nthreads ? nthreads : 1, secret);
+    }
+
     if ( !srcdir ) {
         printf("source directory is not specified! terminate.\n");
         return 1;
     }
+
+    if ( remote ) {
+        int ret;
+        if ( access(srcdir, F_OK) ) {
+            printf("source directory is not exists! terminate.\n");
+            return 1;
+        }
+        if ( compare_mode == COMPARE_CHECKSUM ) {
+            printf("--compare=checksum is not supported with --remote! terminate.\n");
+            return 1;
+        }
+        ret = run_client(srcdir, remote, nthreads ? nthreads : 1, show_info, secret);
+        if ( show_info ) print_stats();
+        if ( stats_json ) write_stats_json(stats_json);
+        free(stats.workers);
+        return ret;
+    }
     if ( !dstdir ) {
         printf("destination directory is not specified! terminate.\n");
         return 1;
@@ -207,14 +1375,96 @@ int main(int argc, char** argv) {
         printf("source directory is not exists! terminate.\n");
         return 1;
     }
-    if ( access(dstdir, F_OK) ) {
-        printf("destination directory is not exists! terminate.\n");
-        return 1;
+    for ( unsigned k = 0; k < ndst; ++k ) {
+        if ( access(dstdirs[k], F_OK) ) {
+            printf("destination directory %s is not exists! terminate.\n", dstdirs[k]);
+            return 1;
+        }
+    }
+
+    if ( ndst > 1 ) {
+        int ret;
+        if ( nthreads <= 0 ) {
+            printf("wrong num of threads. terminate.\n");
+            return 0;
+        }
+        if ( index_path || verify || watch || pipeline_depth || use_uring || delta_threshold
+            || chunk_given || calibrate || ndevice_limits || pin_workers ) {
+            fprintf(stderr, "--index, --verify, --watch, --pipeline, --io-uring, --delta, --chunk-size, --calibrate,\n"
+                            "--device-threads and --pin-cpus are not used with several destinations\n");
+        }
+        /* без калибровки автонастройка берет сохраненный профиль */
+        if ( calibrate ) {
+            calibrate = 0;
+            if ( tune_path ) tune_load(tune_path);
+        }
+        ret = run_fanout(srcdir, dstdirs, ndst, nthreads, show_info);
+        tune_finish(tune_path, show_info);
+        if ( show_info ) print_stats();
+        if ( stats_json ) write_stats_json(stats_json);
+        free(stats.workers);
+        return ret;
+    }
+
+    if ( pipeline_depth ) {
+        int ret;
+        if ( nthreads <= 0 ) {
+            printf("wrong num of threads. terminate.\n");
+            return 0;
+        }
+        if ( index_path || verify || watch || use_uring || calibrate ) {
+            fprintf(stderr, "--index, --verify, --watch, --io-uring and --calibrate are not used with --pipeline\n");
+        }
+        ret = run_pipeline(srcdir, dstdir, nthreads, pipeline_depth);
+        if ( !ret && !stats.files ) {
+            if ( !quiet ) printf("\nthe directories are identical. terminate.\n");
+        }
+        if ( show_info ) {
+            printf("copied %" PRIu64 " files with total size %s\n", stats.files, readable_fs(sizebuf, stats.bytes));
+            print_stats();
+        }
+        tune_finish(tune_path, show_info);
+        if ( stats_json ) write_stats_json(stats_json);
+        free(stats.workers);
+        return ret;
+    }
+
+    memset(&srclist, 0, sizeof(srclist));
+    memset(&dstlist, 0, sizeof(dstlist));
+    memset(&result, 0, sizeof(result));
+    srclist.root = srcdir;
+    dstlist.root = dstdir;
+
+    /* если индекс каталога назначения актуален, сканирую только исходный каталог */
+    if ( index_path && 0 == load_index(&dstlist, index_path) ) {
+        if ( 0 == strcmp(dstlist.root, dstdir) && index_is_fresh(&dstlist) ) {
+            index_loaded = 1;
+        } else {
+            free_filetable(&dstlist);
+        }
+        dstlist.root = dstdir;
+    }
+    if ( show_info && index_path ) {
+        printf("destination index %s\n", index_loaded ? "is up to date" : "is missing or stale, scanning");
+    }
+
+    /* читаю содержимое исходного каталога и каталога назначения одновременно */
+    {
+        filetable* tables[2] = {&srclist, &dstlist};
+        if ( 0 != read_dir_trees(tables, index_loaded ? 1 : 2, nthreads ? nthreads : 1, &stats.phases[PHASE_SCAN_SRC]) ) {
+            return 1;
+        }
     }
 
-    /* читаю содержимое исходного каталога */
-    read_dir_tree(&srclist, srcdir);
-    read_dir_tree(&dstlist, dstdir);
+    /* подписываюсь на изменения до сравнения, чтобы изменения во время
+      копирования попали в первое окно наблюдения */
+    if ( watch ) {
+        int ec = watch_init(&w, &srclist);
+        if ( ec ) {
+            printf("can't watch source directory: %s! terminate.\n", strerror(ec));
+            return 1;
+        }
+    }
 
     // /* получаю кол-во файлов и объем */
     get_dirinfo(&srcdi, &srclist);
@@ -246,17 +1496,42 @@ int main(int argc, char** argv) {
                );
     }
 
+    /* калибрую до копирования, чтобы выбор действовал на все файлы */
+    if ( calibrate ) {
+        int ec = tune_calibrate(&srclist, dstdir, nthreads);
+        if ( ec ) fprintf(stderr, "calibration failed: %s\n", strerror(ec));
+    }
+
     /* получаю список файлов которые необходимо скопировать */
-    get_difference(&result, &srclist, srcdir, &dstlist, dstdir);
+    phase_begin(&pc);
+    get_difference(&result, &srclist, &dstlist, nthreads);
+    phase_end(PHASE_DIFF, &pc);
 
     /* получаю кол-во файлов и суммарный объем */
-    get_dirinfo(&tocopy, &result);
+    get_copyinfo(&tocopy, &result);
 
     /* если кол-во файлов равно нулю, значит каталоги
       идентичны. сообщаю. завершаюсь.
    */
     if ( 0 == tocopy.nfiles ) {
-        printf("\nthe directories are identical. terminate.\n");
+        if ( !quiet ) printf("\nthe directories are identical. terminate.\n");
+        /* индекс сохраняю, чтобы следующий запуск не сканировал каталог
+          назначения. при сверке по хешу в нем появились новые хеши */
+        if ( index_path && (!index_loaded || compare_mode == COMPARE_CHECKSUM) ) {
+            write_index(&dstlist, index_path);
+        }
+        if ( show_info ) print_stats();
+        tune_finish(tune_path, show_info);
+        if ( stats_json ) write_stats_json(stats_json);
+        if ( watch ) {
+            /* изменения, скопированные в режиме наблюдения, индекс не учитывает */
+            if ( index_path ) unlink(index_path);
+            watch_loop(&w, dstdir, nthreads, watch_debounce);
+            watch_free(&w);
+        }
+        free_filetable(&srclist);
+        free_filetable(&dstlist);
+        free_copylist(&result);
         return 0;
     }
 
@@ -268,425 +1543,5839 @@ int main(int argc, char** argv) {
                );
     }
 
-    thdata.dlist = &result;
-    thdata.srcdir= srcdir;
-    thdata.dstdir= dstdir;
-
-    /* сохраняю кол-во потоков для последующего использования
-      в цикле ожидания завершения копирования
-   */
-    threads_count = nthreads;
+    /* во время копирования индекс недействителен: перезапись файла на месте
+      не меняет тайм штамп каталога */
+    if ( index_path ) {
+        unlink(index_path);
+    }
+    /* копирую */
+    copy_files(&result, &srclist, &dstlist, nthreads);
 
-    /* выделяю память для указателей потока */
-    threads = (pthread_t*)malloc(nthreads*sizeof(pthread_t));
+    if ( show_info && atomic_load(&delta_total) ) {
+        printf("delta: rewrote %s", readable_fs(sizebuf, atomic_load(&delta_written)));
+        printf(" of %s\n", readable_fs(sizebuf, atomic_load(&delta_total)));
+    }
+    if ( show_info && atomic_load(&sparse_skipped) ) {
+        printf("sparse: skipped %s of holes and zero blocks\n", readable_fs(sizebuf, atomic_load(&sparse_skipped)));
+    }
+    if ( show_info && atomic_load(&links_created) ) {
+        printf("hard links: created %" PRIu64 " names as links\n", (u_int64_t)atomic_load(&links_created));
+    }
+    tune_finish(tune_path, show_info);
 
-    /* создаю необходимое кол-во потоков */
-    for ( idx = 0; idx < nthreads; idx++ ) {
-        pthread_create(&threads[idx], NULL, thread_proc, &thdata);
+    /* сверяю содержимое скопированных файлов */
+    u_int64_t mismatches = 0;
+    u_int64_t* copiedhashes = NULL;
+    if ( verify ) {
+        copiedhashes = (u_int64_t*)calloc(result.count, sizeof(u_int64_t));
+        mismatches = verify_copied(&result, srcdir, dstdir, nthreads, copiedhashes);
+        if ( show_info ) {
+            printf("verified %" PRIu64 " files, %" PRIu64 " mismatches\n", tocopy.nfiles, mismatches);
+        }
     }
 
-    /* повторяю цикл, до тех пор, пока кол-во рабочих потоков не равно нулю */
-    while ( threads_count ) {
-        usleep(1000);
+    /* после успешного запуска сохраняю индекс каталога назначения */
+    if ( index_path && !mismatches && !atomic_load(&copy_errors) ) {
+        filetable synced;
+        memset(&synced, 0, sizeof(synced));
+        build_synced_table(&synced, &srclist, &dstlist, &result, copiedhashes);
+        write_index(&synced, index_path);
+        free_filetable(&synced);
     }
+    free(copiedhashes);
 
-    for ( idx = 0; idx < nthreads; ++idx ) {
-        pthread_join(threads[idx], NULL);
+    if ( show_info ) print_stats();
+    if ( stats_json ) {
+        int ec = write_stats_json(stats_json);
+        if ( ec ) fprintf(stderr, "error writing %s: %s\n", stats_json, strerror(ec));
     }
-    free(threads);
+    if ( watch ) {
+        if ( index_path ) unlink(index_path);
+        watch_loop(&w, dstdir, nthreads, watch_debounce);
+        watch_free(&w);
+    }
+    free(stats.workers);
 
-    free_dirlist(&srclist);
-    free_dirlist(&dstlist);
-    free_dirlist(&result);
+    free_filetable(&srclist);
+    free_filetable(&dstlist);
+    free_copylist(&result);
 
-    return 0;
+    return (mismatches || atomic_load(&copy_errors)) ? 1 : 0;
 }
 
 /***************************************************************************/
-/* функция потока которая производит копирование файлов */
-void* thread_proc(void* p) {
-    int err;
-    char printbuf[32] = {0};
-    /* получаю идентификатор потока */
-    pthread_t pid = pthread_self();
-    /* сообщаю */
-    printf("process ID %s created\n", readable_pthread_t(printbuf, pid));
-    /* нормализую указатель на данные потока */
-    thread_data* data = (thread_data*)p;
-    /* получаю список файлов необходимых к копированию */
-    dirlist* list = data->dlist;
-    /* указатель на один элемент. используется далее */
-    dirlist* node = NULL;
+/* создает недостающие каталоги и копирует файлы списка в nthreads потоков */
+void copy_files(copylist* result, const filetable* srclist, const filetable* dstlist, unsigned nthreads) {
+    /* структура данных потоков */
+    thread_data thdata;
+    /* указатель на потоки копирования */
+    pthread_t* threads;
+    /* поток вывода прогресса */
+    pthread_t progress;
+    progress_data pd;
+    phase_clock pc;
+    dirinfo tocopy;
+    /* группы заданий по устройствам */
+    device_group* groups;
+    unsigned ngroups, total, idx, g;
+    struct stat dst;
+    /* копируемые файлы без имен, создаваемых жесткими ссылками */
+    copylist work;
+    hardlinks links;
+
+    atomic_init(&copy_errors, 0);
+    atomic_init(&delta_total, 0);
+    atomic_init(&delta_written, 0);
+    atomic_init(&sparse_skipped, 0);
+    atomic_init(&links_created, 0);
+
+    /* создаю недостающие каталоги заранее, потоки копирования их не касаются */
+    phase_begin(&pc);
+    if ( 0 != create_dst_skeleton(srclist, dstlist, dstlist->root, nthreads) ) {
+        atomic_fetch_add(&copy_errors, 1);
+    }
+    phase_end(PHASE_MKDIR, &pc);
+    phase_begin(&pc);
+
+    /* упорядочиваю файлы. из имен одного inode копируется только первое */
+    sort_copylist(result, copy_order);
+    build_hardlinks(&links, &work, result, dstlist->root);
+    get_copyinfo(&tocopy, &work);
+    stats.files = tocopy.nfiles;
+    stats.bytes = tocopy.size;
+
+    thdata.files = &work;
+    thdata.links = links.ngroups ? &links : NULL;
+    thdata.srcdir= srclist->root;
+    thdata.dstdir= dstlist->root;
+    thdata.stats = NULL;
+    atomic_init(&thdata.cursor, 0);
+    atomic_init(&thdata.nextstat, 0);
+
+    /* большие файлы делю на части */
+    build_tasks(&thdata);
+    prepare_chunked(&thdata);
+
+    /* раскладываю задания по устройствам */
+    ngroups = build_device_groups(&thdata, stat(dstlist->root, &dst) ? 0 : dst.st_dev, nthreads, &groups);
+    for ( g = 0, total = 0; g < ngroups; ++g ) total += groups[g].nthreads;
+
+    /* счетчики потоков предыдущего копирования больше не нужны */
+    free(stats.workers);
+    stats.workers = (worker_stat*)aligned_alloc(64, total*sizeof(worker_stat));
+    memset(stats.workers, 0, total*sizeof(worker_stat));
+    stats.nworkers = total;
+    for ( g = 0, idx = 0; g < ngroups; ++g ) {
+        groups[g].data.stats = stats.workers+idx;
+        idx += groups[g].nthreads;
+        if ( !quiet && (ngroups > 1 || ndevice_limits || pin_workers) ) {
+            printf("device %u:%u -> %u:%u: %" PRIu64 " tasks, %u threads", major(groups[g].srcdev), minor(groups[g].srcdev),
+                   major(groups[g].dstdev), minor(groups[g].dstdev), groups[g].count, groups[g].nthreads);
+            if ( groups[g].node >= 0 ) printf(", numa node %d", groups[g].node);
+            printf("\n");
+        }
+    }
+
+    /* если io_uring недоступен, копирую обычным способом */
+    if ( use_uring && !uring_available() ) {
+        fprintf(stderr, "io_uring is not available, using synchronous copy\n");
+        use_uring = 0;
+    }
+
+    /* выделяю память для указателей потока */
+    threads = (pthread_t*)malloc(total*sizeof(pthread_t));
+
+    /* создаю потоки каждой группы */
+    for ( g = 0, idx = 0; g < ngroups; ++g ) {
+        unsigned i;
+        for ( i = 0; i < groups[g].nthreads; ++i, ++idx ) {
+            pthread_create(&threads[idx], NULL, use_uring ? uring_thread_proc : thread_proc, &groups[g].data);
+            if ( pin_workers ) device_pin(&groups[g], threads[idx], i);
+        }
+    }
+    if ( progress_interval ) {
+        progress_start(&pd, &progress);
+    }
+
+    /* жду завершения всех потоков */
+    for ( idx = 0; idx < total; ++idx ) {
+        pthread_join(threads[idx], NULL);
+    }
+    if ( progress_interval ) {
+        progress_stop(&pd, progress);
+    }
+    phase_end(PHASE_COPY, &pc);
+    /* простой потоков: от завершения потока до завершения последнего */
+    {
+        struct timespec last = stats.workers[0].finished;
+        for ( idx = 1; idx < total; ++idx ) {
+            const struct timespec* f = &stats.workers[idx].finished;
+            if ( f->tv_sec > last.tv_sec || (f->tv_sec == last.tv_sec && f->tv_nsec > last.tv_nsec) ) last = *f;
+        }
+        for ( idx = 0; idx < total; ++idx ) {
+            const struct timespec* f = &stats.workers[idx].finished;
+            stats.workers[idx].idle = (last.tv_sec-f->tv_sec) + (last.tv_nsec-f->tv_nsec)/1e9;
+        }
+    }
+    free(threads);
+    free(groups);
+    free(thdata.tasks);
+    free(thdata.chunks);
+    free_hardlinks(&links);
+    free_copylist(&work);
+    nocache_pool_free();
+    tune_pool_free();
+    atomic_finish(dstlist->root);
+}
+/* функция потока которая производит копирование файлов */
+void* thread_proc(void* p) {
+    char printbuf[32] = {0};
+    /* получаю идентификатор потока */
+    pthread_t pid = pthread_self();
+    /* сообщаю */
+    readable_pthread_t(printbuf, pid);
+    if ( !quiet ) printf("process ID %s created\n", printbuf);
+    /* нормализую указатель на данные потока */
+    thread_data* data = (thread_data*)p;
+    /* счетчики этого потока */
+    worker_stat* ws = &data->stats[atomic_fetch_add(&data->nextstat, 1)];
+    /* указатель на одно задание. используется далее */
+    const copytask* task = NULL;
     /* бесконечный цикл */
     while ( 1 ) {
-        /* блокирую остальные потоки */
-        pthread_mutex_lock(&mutex);
-        /* получаю следующий элемент */
-        node = get_next(list);
-        /* если равен NULL, значит все файлы скопированы */
-        if ( !node ) {
-            /* снимаю блокировку */
-            pthread_mutex_unlock(&mutex);
+        /* получаю следующее задание. каждое задание достается ровно одному потоку */
+        task = get_next(data);
+        /* если равно NULL, значит все задания розданы */
+        if ( !task ) {
             /* завершаю поток */
             break;
         }
-        /* устанавливаю флаг выполненого элемента */
-        node->done = 1;
-        /* создаю полное имя для создания файла назначения */
-        char* name = create_dst_filename(data->srcdir, node->name, data->dstdir);
-        /* извлекаю путь */
-        char* path = extract_path(name);
-        /* создаю структуру каталогов */
-        create_dir_tree(path);
-        free(path);
-        /* снимаю блокировку */
-        pthread_mutex_unlock(&mutex);
+        /* копирую */
+        copy_task(data, task, printbuf, ws);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ws->finished);
+    /* выхожу */
+    return NULL;
+}
+/* выполняет задание: копирует файл целиком или его часть. после
+  последней части файла выставляет ему тайм штамп */
+void copy_task(thread_data* data, const copytask* task, const char* who, worker_stat* ws) {
+    int err;
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    copylist* list = data->files;
+    const fileentry* node = &list->src->files[list->idx[task->file]];
+    /* создаю полные имена исходного файла и файла назначения */
+    const char* relname = file_name(list->src, node);
+    char* srcname = make_filename(data->srcdir, relname);
+    char* name = make_filename(data->dstdir, relname);
+    if ( !task->chunk ) {
         /* сообщаю о копировании */
-        printf("process ID %s copying: %s\n", readable_pthread_t(printbuf, pid), node->name);
+        if ( !quiet ) printf("process ID %s copying: %s\n", who, srcname);
         /* копирую */
-        if ( 0 != (err=copy_file(node->name, name, node->date)) ) {
+        if ( 0 != (err=copy_file(srcname, name, node->date)) ) {
             fprintf(stderr, "error: %s\n", strerror(err));
+            atomic_fetch_add(&copy_errors, 1);
+            atomic_store_explicit(&ws->errors, atomic_load_explicit(&ws->errors, memory_order_relaxed)+1, memory_order_relaxed);
+        } else {
+            stat_copied(ws, node->size, &started, 1);
+        }
+        link_copied(data, task->file, !err, ws);
+    } else {
+        chunkstate* cs = task->chunk;
+        if ( !quiet ) printf("process ID %s copying: %s [%" PRIu64 "+%" PRIu64 "]\n", who, srcname, task->offset, task->length);
+        int copied = 0;
+        /* если файл уже не удалось скопировать, остальные части пропускаю */
+        if ( cs->cloned ) {
+            copied = 1;
+        } else if ( !atomic_load(&cs->failed) ) {
+            if ( 0 != (err=copy_chunk(srcname, name, task->offset, task->length, cs->delta)) ) {
+                fprintf(stderr, "error: %s\n", strerror(err));
+                atomic_store(&cs->failed, 1);
+            } else {
+                copied = 1;
+            }
+        }
+        int last = 1 == atomic_fetch_sub(&cs->remaining, 1);
+        /* файл засчитывается последней частью */
+        if ( copied ) {
+            stat_copied(ws, task->length, &started, last && !atomic_load(&cs->failed));
+        }
+        if ( last ) {
+            if ( atomic_load(&cs->failed) ) {
+                atomic_fetch_add(&copy_errors, 1);
+                atomic_store_explicit(&ws->errors, atomic_load_explicit(&ws->errors, memory_order_relaxed)+1, memory_order_relaxed);
+            } else {
+                struct timespec ts[2] = {
+                     {0, UTIME_OMIT}
+                    ,{node->date, node->date_ns}
+                };
+                utimensat(AT_FDCWD, name, ts, 0);
+            }
+            link_copied(data, task->file, !atomic_load(&cs->failed), ws);
         }
-        free(name);
     }
-    /* декрементирую счетчик запущеных потоков перед выходом */
-    threads_count--;
-    /* выхожу */
-    return NULL;
+    free(srcname);
+    free(name);
 }
 
 /***************************************************************************/
-/* читает содержимое каталога */
-dirlist* read_dir_tree(dirlist* dlist, const char* path) {
-    char curname[1024] = "\0";
-    struct stat st;
-    struct dirent* dirent;
-    /* открываю каталог для чтения его содержимого */
-    DIR* dir = opendir(path);
-    /* если не открылся, завершаюсь */
-    if ( !dir ) {
-        fprintf(stderr, "error opening directory: %s\n", strerror(errno));
-        return dlist;
-    }
-    /* повторяется пока есть элементы в каталоге */
-    while ( (dirent = readdir(dir)) != NULL ) {
-        /* если имя каталога "." или ".." читаю следующий */
-        if ( !strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, "..") )
-            continue;
-        if ( strlen(path)+strlen("/")+strlen(dirent->d_name) >= sizeof(curname) ) {
-            fprintf(stderr, "file name is too long: \"%s\"\n", curname);
-            exit(1);
-        }
-        strcpy(curname, path);
-        strcat(curname, "/");
-        strcat(curname, dirent->d_name);
-        /* если прочитано имя каталога, перехожу в него */
-        if ( dirent->d_type & DT_DIR ) {
-            dlist = read_dir_tree(dlist, curname);
-            /* если прочитано имя файла, получаю информацию о нем */
-        } else if ( dirent->d_type & DT_REG ) {
-            if ( -1 == stat(curname, &st) ) {
-                fprintf(stderr, "error: stat(%s)\n", curname);
-                exit(1);
-            }
-            /* заношу информацию о файле в нод */
-            dlist->name = strdup(curname);
-            dlist->date = st.st_mtime;
-            dlist->size = st.st_size;
-            dlist->next = alloc_next();
-            dlist = dlist->next;
-        }
-    }
-    /* закрываю каталог */
-    closedir(dir);
-    return dlist;
-}
-/* выделяет память для нода */
-dirlist* alloc_next() {
-    dirlist* next = (dirlist*)malloc(sizeof(dirlist));
-    memset(next, 0, sizeof(dirlist));
-    return next;
-}
-/* создает полное имя файла назначения из компонент */
-char* create_dst_filename(const char* srcdir, const char* srcname, const char* dstdir) {
-    const char* name = srcname+strlen(srcdir);
-    char* result = (char*)malloc(strlen(name)+strlen(dstdir)+1);
-    strcpy(result, dstdir);
-    strcat(result, name);
-    return result;
+/* жесткие ссылки */
+static int cmp_link_cand(const void* a, const void* b) {
+    const link_cand* x = (const link_cand*)a;
+    const link_cand* y = (const link_cand*)b;
+    if ( x->dev != y->dev ) return x->dev < y->dev ? -1 : 1;
+    if ( x->ino != y->ino ) return x->ino < y->ino ? -1 : 1;
+    /* имя, уже лежащее в каталоге назначения, идет первым */
+    if ( x->incopy != y->incopy ) return x->incopy - y->incopy;
+    return x->pos < y->pos ? -1 : x->pos > y->pos;
 }
-/* создает полное имя исходного файла из компонент */
-char* create_src_filename(const char* dstdir, const char* dstname, const char* srcdir) {
-    const char* name = dstname+strlen(dstdir);
-    char* result = (char*)malloc(strlen(name)+strlen(srcdir)+1);
-    strcpy(result, srcdir);
-    strcat(result, name);
-    return result;
+/* создает в каталоге назначения имя name жесткой ссылкой на target */
+static int link_dst(const char* dstdir, const char* target, const char* name) {
+    char* from = make_filename(dstdir, target);
+    char* to = make_filename(dstdir, name);
+    int ec = 0;
+    if ( unlink(to) && errno != ENOENT ) ec = errno;
+    else if ( link(from, to) ) ec = errno;
+    free(from);
+    free(to);
+    return ec;
 }
-/* находит нод по имени файла */
-const dirlist* find_by_filename(const dirlist* dlist, const char* fname) {
-    while ( dlist->name ) {
-        if ( 0 == strcmp(dlist->name, fname) ) return dlist;
-        dlist = dlist->next;
+void build_hardlinks(hardlinks* hl, copylist* work, const copylist* cl, const char* dstdir) {
+    const filetable* src = cl->src;
+    unsigned char* skip = (unsigned char*)calloc(cl->count ? cl->count : 1, 1);
+    unsigned char* incopy = (unsigned char*)calloc(src->nfiles ? src->nfiles : 1, 1);
+    link_cand* cand = NULL;
+    u_int64_t ncand = 0, i, j, nnames = 0;
+    memset(hl, 0, sizeof(*hl));
+    memset(work, 0, sizeof(*work));
+    work->src = cl->src;
+    for ( i = 0; i < cl->count; ++i ) incopy[cl->idx[i]] = 1;
+    /* кандидаты - копируемые файлы с несколькими именами и их имена,
+      которые уже есть в каталоге назначения */
+    for ( i = 0; i < cl->count; ++i ) {
+        if ( src->files[cl->idx[i]].ino ) ncand++;
     }
-    return NULL;
-}
-/* возвращает разницу в виде списка файлов готовых к копированию */
-dirlist* get_difference(
-    dirlist* result,
-    const dirlist* srclist, const char* srcdir,
-    const dirlist* dstlist, const char* dstdir)
-{
-    const dirlist* src_ptr = srclist;
-    const dirlist* dst_ptr = dstlist;
-    dirlist* res_ptr = result;
-    dirinfo dst_files = {0,0};
-    dirinfo src_files = {0,0};
-    get_dirinfo(&dst_files, dstlist);
-    get_dirinfo(&src_files, srclist);
-    /* если каталог назначения пуст, просто копирую весь список файлов */
-    if ( 0 == dst_files.nfiles ) {
-        while ( src_ptr->name ) {
-            res_ptr = link_nodes(res_ptr, src_ptr);
-            src_ptr = src_ptr->next;
-        }
-        /* если кол-во файлов в обоих каталогах равно, сверяю их дату */
-    } else if ( src_files.nfiles == dst_files.nfiles ) {
-        while ( src_ptr->name ) {
-            char* test_name = create_dst_filename(srcdir, src_ptr->name, dstdir);
-            /* если в каталоге назначения файл есть, и его дата позднее
-            исходного файла, пропускаю этот файл */
-            if ( 0 == access(test_name, F_OK) && src_ptr->date <= dst_ptr->date ) {
-                free(test_name);
-                src_ptr = src_ptr->next;
-                dst_ptr = dst_ptr->next;
-                continue;
-            }
-            free(test_name);
-            /* добавляю к списку копируемых файлов */
-            res_ptr = link_nodes(res_ptr, src_ptr);
-            src_ptr = src_ptr->next;
-            dst_ptr = dst_ptr->next;
+    if ( ncand ) {
+        for ( i = 0; i < src->nfiles; ++i ) {
+            if ( src->files[i].ino && !incopy[i] ) ncand++;
         }
-        /* если исходный каталог не пуст, и кол-во файлов в обоих каталогах не
-      равно, проверяю все файлы на несоответствие даты */
-    } else {
-        /* сверяю все файлы из каталога назначения с файлами в исходном каталоге */
-        while ( dst_ptr->name ) {
-            /* создаю полное имя исходного файла */
-            char* test_name = create_src_filename(dstdir, dst_ptr->name, srcdir);
-            /* ищу в исходном каталоге файл с таким именем */
-            const dirlist* node = find_by_filename(srclist, test_name);
-            /* освобождаю память */
-            free(test_name);
-            /* если в исходном каталоге нет такого файла, продолжаю поиск следующего */
-            if ( !node ) {
-                dst_ptr = dst_ptr->next;
-                continue;
-            }
-            /* если есть, сверяю дату */
-            if ( dst_ptr->date < node->date ) {
-                /* если в исходном каталоге файл новее, добавляю его к списку копируемых */
-                res_ptr = link_nodes(res_ptr, node);
-            }
-            /* беру следующий файл */
-            dst_ptr = dst_ptr->next;
-        }
-        src_ptr = srclist;
-        /* сверяю все файлы из исходного каталога с файлами в каталоге назначения */
-        while ( src_ptr->name ) {
-            /* создаю полное имя файла назначения */
-            char* test_name = create_dst_filename(srcdir, src_ptr->name, dstdir);
-            /* ищу в каталоге назначения файл с этим именем */
-            const dirlist* node = find_by_filename(dstlist, test_name);
-            /* освобождаю память */
-            free(test_name);
-            /* если есть, ищу следующий */
-            if ( node ) {
-                src_ptr = src_ptr->next;
-                continue;
-            }
-            /* добавляю в список копируемых */
-            res_ptr = link_nodes(res_ptr, src_ptr);
-            /* беру следующий файл */
-            src_ptr = src_ptr->next;
+        cand = (link_cand*)malloc(ncand*sizeof(link_cand));
+        ncand = 0;
+        for ( i = 0; i < cl->count; ++i ) {
+            const fileentry* e = &src->files[cl->idx[i]];
+            if ( !e->ino ) continue;
+            link_cand c = {e->dev, e->ino, cl->idx[i], i, 1};
+            cand[ncand++] = c;
         }
-    }
-    return result;
-}
-/* возвращает следующий готовый к копированию элемент */
-dirlist* get_next(dirlist* dlist) {
-    while ( dlist->name ) {
-        if ( !dlist->done ) {
-            return dlist;
+        for ( i = 0; i < src->nfiles; ++i ) {
+            const fileentry* e = &src->files[i];
+            if ( !e->ino || incopy[i] ) continue;
+            link_cand c = {e->dev, e->ino, i, 0, 0};
+            cand[ncand++] = c;
         }
-        dlist = dlist->next;
+        qsort(cand, ncand, sizeof(link_cand), cmp_link_cand);
     }
-    return NULL;
-}
-/* извлекает имя каталога из полного имени файла */
-char* extract_path(const char* filename) {
-    const char* p = strrchr(filename, '/');
-    if ( !p ) return NULL;
-    char* buff = (char*)malloc(p-filename+1);
-    strncpy(buff, filename, p-filename);
-    buff[p-filename] = 0;
-    return buff;
-}
-/* создает структуру каталогов */
-int create_dir_tree(const char* dirname) {
-    char temp[1024] = "\0";
-    char* pname = &temp[0];
-    char* end = (char*)strchr(dirname+1, '/');
-    while ( 1 ) {
-        strncpy(pname, dirname, end-dirname);
-        if ( 0 == access(pname, F_OK) ) {
-            if ( 0 == strcmp(pname, dirname) ) break;
-            end = strchr(end+1, '/');
-            if ( !end ) {
-                end = (char*)dirname+strlen(dirname);
+    free(incopy);
+    hl->group = (u_int64_t*)calloc(cl->count ? cl->count : 1, sizeof(u_int64_t));
+    hl->first = (u_int64_t*)malloc((ncand/2+2)*sizeof(u_int64_t));
+    hl->names = (u_int64_t*)malloc((ncand ? ncand : 1)*sizeof(u_int64_t));
+    hl->first[0] = 0;
+    for ( i = 0; i < ncand; i = j ) {
+        for ( j = i+1; j < ncand && cand[j].dev == cand[i].dev && cand[j].ino == cand[i].ino; ++j );
+        if ( j-i < 2 ) continue;
+        if ( !cand[i].incopy ) {
+            /* одно из имен в каталоге назначения не изменилось - остальные
+              сразу становятся ссылками на него */
+            const char* target = file_name(src, &src->files[cand[i].idx]);
+            u_int64_t k;
+            for ( k = i+1; k < j; ++k ) {
+                if ( !cand[k].incopy ) continue;
+                if ( 0 == link_dst(dstdir, target, file_name(src, &src->files[cand[k].idx])) ) {
+                    skip[cand[k].pos] = 1;
+                    atomic_fetch_add(&links_created, 1);
+                }
             }
             continue;
         }
-        if ( 0 != mkdir(pname, S_IRWXU|S_IRWXG|S_IRWXO) ) {
-            fprintf(stderr, "error: %s\n", strerror(errno));
+        /* первое по порядку копирования имя копируется, остальные
+          создаются ссылками после него */
+        u_int64_t k;
+        hl->group[cand[i].pos] = hl->ngroups+1;
+        for ( k = i+1; k < j; ++k ) {
+            skip[cand[k].pos] = 1;
+            hl->names[nnames++] = cand[k].idx;
+        }
+        hl->first[++hl->ngroups] = nnames;
+    }
+    free(cand);
+    /* копируются только первые имена групп */
+    for ( i = 0; i < cl->count; ++i ) {
+        if ( skip[i] ) continue;
+        if ( hl->group[i] ) hl->group[work->count] = hl->group[i];
+        else hl->group[work->count] = 0;
+        copylist_add(work, cl->idx[i]);
+    }
+    free(skip);
+}
+void free_hardlinks(hardlinks* hl) {
+    free(hl->group);
+    free(hl->first);
+    free(hl->names);
+    memset(hl, 0, sizeof(*hl));
+}
+/* после копирования файла создает остальные его имена. если файл не
+  скопирован или ссылку создать нельзя, имя копируется как отдельный файл */
+void link_copied(thread_data* data, u_int64_t pos, int copied, worker_stat* ws) {
+    const hardlinks* hl = data->links;
+    const filetable* src = data->files->src;
+    u_int64_t g, i;
+    int err;
+    if ( !hl || !hl->group[pos] ) return;
+    g = hl->group[pos]-1;
+    const char* target = file_name(src, &src->files[data->files->idx[pos]]);
+    for ( i = hl->first[g]; i < hl->first[g+1]; ++i ) {
+        const fileentry* node = &src->files[hl->names[i]];
+        const char* relname = file_name(src, node);
+        if ( copied && 0 == link_dst(data->dstdir, target, relname) ) {
+            if ( !quiet ) printf("linked: %s -> %s\n", relname, target);
+            atomic_fetch_add(&links_created, 1);
+            continue;
         }
-        if ( 0 == strcmp(pname, dirname) ) break;
-        end = strchr(end+1, '/');
-        if ( !end ) {
-            end = (char*)dirname+strlen(dirname);
+        char* srcname = make_filename(data->srcdir, relname);
+        char* name = make_filename(data->dstdir, relname);
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        if ( 0 != (err=copy_file(srcname, name, node->date)) ) {
+            fprintf(stderr, "error: %s\n", strerror(err));
+            atomic_fetch_add(&copy_errors, 1);
+            atomic_store_explicit(&ws->errors, atomic_load_explicit(&ws->errors, memory_order_relaxed)+1, memory_order_relaxed);
+        } else {
+            stat_copied(ws, node->size, &started, 1);
         }
+        free(srcname);
+        free(name);
     }
+}
+
+/***************************************************************************/
+/* файлы больше этого размера копируются обычным способом */
+#define URING_BUF_SIZE (64*1024)
+/* кол-во операций в цепочке копирования одного файла */
+#define URING_CHAIN_LEN 7
 
+static int uring_setup(uring* r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if ( r->fd < 0 ) return errno;
+    r->sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+        if ( r->cq_size > r->sq_size ) r->sq_size = r->cq_size;
+        r->cq_size = r->sq_size;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if ( r->sq_ptr == MAP_FAILED ) goto error;
+    if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if ( r->cq_ptr == MAP_FAILED ) goto error;
+    }
+    r->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if ( r->sqes == MAP_FAILED ) goto error;
+    r->sq_head = (unsigned*)((char*)r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned*)((char*)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned*)((char*)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)((char*)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned*)((char*)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned*)((char*)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned*)((char*)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)((char*)r->cq_ptr + p.cq_off.cqes);
     return 0;
+error:
+    {
+        int ec = errno;
+        if ( r->sq_ptr && r->sq_ptr != MAP_FAILED ) munmap(r->sq_ptr, r->sq_size);
+        if ( r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr ) munmap(r->cq_ptr, r->cq_size);
+        close(r->fd);
+        return ec;
+    }
 }
-/* копирует файл */
-int copy_file(const char* srcname, const char* dstname, time_t srctime) {
-    struct utimbuf time;
-    time.modtime = srctime;
-    time.actime  = 0;
-    /**  */
-    int fdin = open(srcname, O_RDONLY);
-    if ( fdin == -1 ) {
-        return errno;
+static void uring_free(uring* r) {
+    munmap(r->sqes, r->sqes_size);
+    if ( r->cq_ptr != r->sq_ptr ) munmap(r->cq_ptr, r->cq_size);
+    munmap(r->sq_ptr, r->sq_size);
+    close(r->fd);
+}
+/* возвращает свободное задание. кольцо рассчитано на все цепочки сразу */
+static struct io_uring_sqe* uring_get_sqe(uring* r) {
+    unsigned tail = *r->sq_tail + r->to_submit;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->to_submit++;
+    return sqe;
+}
+/* отправляет подготовленные задания и ждет хотя бы одного завершения.
+  задания, которые ядро не взяло, остаются в кольце между sq_head и
+  sq_tail и уходят следующим вызовом */
+static int uring_submit_and_wait(uring* r) {
+    unsigned tail = *r->sq_tail + r->to_submit;
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+    r->to_submit = 0;
+    while ( 1 ) {
+        unsigned unsent = tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        int ret = (int)syscall(__NR_io_uring_enter, r->fd, unsent, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if ( ret < 0 ) {
+            if ( errno == EINTR ) continue;
+            return errno;
+        }
+        return 0;
     }
-
-    int fdout= open(dstname, O_WRONLY|O_CREAT|O_TRUNC, 0666);
-    if ( fdout == -1 ) {
-        close(fdin);
-        return errno;
+}
+/* открывает каталог в прямой дескриптор. ядра до 5.15 поле file_index
+  не знают и возвращают обычный дескриптор вместо 0 */
+static int uring_direct_open_works(uring* r) {
+    int files[1] = {-1};
+    int ok = 0;
+    struct io_uring_sqe* sqe;
+    if ( syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, files, 1) ) return 0;
+    sqe = uring_get_sqe(r);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (u_int64_t)(uintptr_t)"/";
+    sqe->open_flags = O_RDONLY|O_DIRECTORY;
+    sqe->file_index = 1;
+    if ( 0 == uring_submit_and_wait(r) ) {
+        unsigned head = *r->cq_head;
+        if ( head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) ) {
+            int res = r->cqes[head & *r->cq_mask].res;
+            ok = res == 0;
+            if ( res > 0 ) close(res);
+            __atomic_store_n(r->cq_head, head+1, __ATOMIC_RELEASE);
+        }
     }
+    return ok;
+}
+/* проверяет поддержку операций, из которых строится цепочка копирования,
+  и открытия в прямой дескриптор */
+int uring_available() {
+    uring r;
+    struct io_uring_probe* probe;
+    size_t len = sizeof(*probe) + IORING_OP_LAST*sizeof(struct io_uring_probe_op);
+    int ok = 0;
+    if ( uring_setup(&r, 8) ) return 0;
+    probe = (struct io_uring_probe*)calloc(1, len);
+    if ( 0 == syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) ) {
+        static const int ops[] = {IORING_OP_OPENAT, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_CLOSE, IORING_OP_STATX};
+        unsigned i;
+        ok = 1;
+        for ( i = 0; i < sizeof(ops)/sizeof(ops[0]); ++i ) {
+            if ( ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) ) ok = 0;
+        }
+    }
+    free(probe);
+    if ( ok ) ok = uring_direct_open_works(&r);
+    uring_free(&r);
+    return ok;
+}
+/* ставит в очередь цепочку: открыть исходный, прочитать, получить
+  statx, закрыть, открыть файл назначения, записать, закрыть. дескрипторы -
+  прямые (fixed files), буфер - зарегистрированный. ошибка любой операции,
+  в том числе неполное чтение, отменяет остаток цепочки. statx после
+  чтения показывает, не вырос ли файл со времени сканирования */
+static void uring_queue_copy(uring* r, unsigned slot, const char* srcname, const char* dstname, u_int64_t size, char* buf, struct statx* stx) {
+    struct io_uring_sqe* sqe;
+    unsigned srcfile = slot*2, dstfile = slot*2+1;
 
-    struct stat st;
-    if ( fstat(fdin, &st) ) {
-        int ec = errno;
-
-        close(fdin);
-        close(fdout);
+    sqe = uring_get_sqe(r);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (u_int64_t)(uintptr_t)srcname;
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = srcfile+1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = slot;
 
-        return ec;
-    }
+    sqe = uring_get_sqe(r);
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = srcfile;
+    sqe->addr = (u_int64_t)(uintptr_t)buf;
+    sqe->len = (unsigned)size;
+    sqe->off = 0;
+    sqe->buf_index = slot;
+    sqe->flags = IOSQE_FIXED_FILE|IOSQE_IO_LINK;
+    sqe->user_data = slot;
 
-    // sendfile will not send more than this amount of data in one call
-    const size_t max_send_size = 0x7ffff000u;
-    off_t size = st.st_size;
-    off_t offset = 0;
+    sqe = uring_get_sqe(r);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (u_int64_t)(uintptr_t)srcname;
+    sqe->len = STATX_SIZE|STATX_MTIME;
+    sqe->off = (u_int64_t)(uintptr_t)stx;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = slot;
 
-    while ( offset < size ) {
-        off_t size_left = size - offset;
-        size_t size_to_copy = max_send_size;
+    sqe = uring_get_sqe(r);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = srcfile+1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = slot;
 
-        if ( size_left < (off_t)(max_send_size) )
-            size_to_copy = (size_t)(size_left);
+    sqe = uring_get_sqe(r);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (u_int64_t)(uintptr_t)dstname;
+    sqe->open_flags = O_WRONLY|O_CREAT|O_TRUNC;
+    sqe->len = 0666;
+    sqe->file_index = dstfile+1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = slot;
 
-        ssize_t sz = sendfile(fdout, fdin, NULL, size_to_copy);
-        if ( sz < 0 ) {
-            int err = errno;
-            if (err == EINTR)
-                continue;
+    sqe = uring_get_sqe(r);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = dstfile;
+    sqe->addr = (u_int64_t)(uintptr_t)buf;
+    sqe->len = (unsigned)size;
+    sqe->off = 0;
+    sqe->buf_index = slot;
+    sqe->flags = IOSQE_FIXED_FILE|IOSQE_IO_LINK;
+    sqe->user_data = slot;
 
-            return err;
+    sqe = uring_get_sqe(r);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = dstfile+1;
+    sqe->user_data = slot;
+}
+/* завершает копирование файла: выставляет дату. при ошибке, а также если
+  исходный файл изменился после сканирования, повторяет копирование обычным
+  способом: он получит точную ошибку или скопирует файл целиком */
+static void uring_finish(thread_data* data, uring_slot* sl, worker_stat* ws) {
+    int err = 0;
+    if ( !sl->failed && (sl->stx.stx_size != sl->size || sl->stx.stx_mtime.tv_sec != sl->date
+        || sl->stx.stx_mtime.tv_nsec != sl->date_ns) ) {
+        sl->failed = 1;
+    }
+    if ( !sl->failed ) {
+        struct timespec ts[2] = {
+             {0, UTIME_OMIT}
+            ,{sl->date, sl->date_ns}
+        };
+        utimensat(AT_FDCWD, sl->dstname, ts, 0);
+        stat_copied(ws, sl->size, &sl->started, 1);
+    } else if ( 0 != (err=copy_file(sl->srcname, sl->dstname, sl->date)) ) {
+        fprintf(stderr, "error: %s\n", strerror(err));
+        atomic_fetch_add(&copy_errors, 1);
+        atomic_store_explicit(&ws->errors, atomic_load_explicit(&ws->errors, memory_order_relaxed)+1, memory_order_relaxed);
+    } else {
+        stat_copied(ws, sl->size, &sl->started, 1);
+    }
+    link_copied(data, sl->file, !err, ws);
+    free(sl->srcname);
+    free(sl->dstname);
+    sl->srcname = sl->dstname = NULL;
+}
+/* разбирает завершенные операции. файл, чья цепочка завершилась целиком,
+  доделывается, а его слот освобождается */
+static void uring_reap(thread_data* data, uring* r, uring_slot* slots, unsigned* freeslots, unsigned* nfree, unsigned* inflight, worker_stat* ws) {
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for ( ; head != tail; ++head ) {
+        struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+        uring_slot* sl = &slots[cqe->user_data];
+        if ( cqe->res < 0 ) sl->failed = 1;
+        if ( 0 == --sl->pending ) {
+            uring_finish(data, sl, ws);
+            freeslots[(*nfree)++] = (unsigned)cqe->user_data;
+            (*inflight)--;
         }
-
-        offset += sz;
     }
-
-    struct timespec ts[2] = {
-         {st.st_atime, 0}
-        ,{st.st_mtime, 0}
-    };
-    futimens(fdout, ts);
-
-    close(fdin);
-    close(fdout);
-
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+/* после отказа io_uring_enter снимает с кольца неотправленные задания и
+  дожидается завершения отправленных: пока они не завершились, ядро еще
+  может писать в буферы и файлы назначения. возвращает 0, если все
+  цепочки завершились */
+static int uring_drain(thread_data* data, uring* r, uring_slot* slots, unsigned nslots, unsigned* freeslots, unsigned* nfree, unsigned* inflight, worker_stat* ws) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *r->sq_tail + r->to_submit;
+    for ( ; head != tail; ++head ) {
+        uring_slot* sl = &slots[r->sqes[r->sq_array[head & *r->sq_mask]].user_data];
+        sl->failed = 1;
+        sl->pending--;
+    }
+    __atomic_store_n(r->sq_tail, __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    r->to_submit = 0;
+    /* цепочки, у которых ядро не взяло ни одного задания, уже завершены */
+    for ( unsigned i = 0; i < nslots; ++i ) {
+        if ( slots[i].srcname && !slots[i].pending ) {
+            uring_finish(data, &slots[i], ws);
+            freeslots[(*nfree)++] = i;
+            (*inflight)--;
+        }
+    }
+    while ( *inflight ) {
+        int ret = (int)syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if ( ret < 0 && errno != EINTR ) return errno;
+        uring_reap(data, r, slots, freeslots, nfree, inflight, ws);
+    }
     return 0;
 }
-/* связывает ноды */
-dirlist* link_nodes(dirlist* left, const dirlist* right) {
-    left->name = strdup(right->name);
-    left->date = right->date;
-    left->size = right->size;
-    left->next = alloc_next();
-    return left->next;
+/* регистрирует буферы и прямые дескрипторы nslots слотов */
+static int uring_register_slots(uring* r, struct iovec* iov, int* files, unsigned nslots) {
+    int ec;
+    if ( syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, nslots) ) return errno;
+    if ( syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, files, nslots*2) ) {
+        ec = errno;
+        syscall(__NR_io_uring_register, r->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        return ec;
+    }
+    return 0;
 }
+/* функция потока, копирующая мелкие файлы через io_uring. каждый поток
+  держит в работе до uring_slots файлов, большие файлы копирует обычным
+  способом */
+void* uring_thread_proc(void* p) {
+    int err;
+    char printbuf[32] = {0};
+    pthread_t pid = pthread_self();
+    thread_data* data = (thread_data*)p;
+    copylist* list = data->files;
+    fileentry* node = NULL;
+    uring r;
+    unsigned nslots = (unsigned)uring_slots;
+    uring_slot* slots = (uring_slot*)calloc(nslots, sizeof(uring_slot));
+    unsigned* freeslots = (unsigned*)malloc(nslots*sizeof(unsigned));
+    int* files = (int*)malloc(nslots*2*sizeof(int));
+    struct iovec* iov = (struct iovec*)malloc(nslots*sizeof(struct iovec));
+    unsigned nfree = nslots, inflight = 0, i;
+    char* bufs = (char*)aligned_alloc(4096, (size_t)nslots*URING_BUF_SIZE);
+    int exhausted = 0;
 
-void get_dirinfo(dirinfo *di, const dirlist* dlist) {
-    u_int64_t count = 0;
-    u_int64_t size = 0;
-    while ( dlist->name ) {
-        count++;
-        size += dlist->size;
-
-        dlist = dlist->next;
+    /* не удалось подготовить кольцо - копирую обычным способом */
+    if ( !slots || !freeslots || !files || !iov || !bufs || uring_setup(&r, nslots*URING_CHAIN_LEN) ) {
+        free(slots);
+        free(freeslots);
+        free(files);
+        free(iov);
+        free(bufs);
+        return thread_proc(p);
+    }
+    for ( i = 0; i < nslots; ++i ) {
+        iov[i].iov_base = bufs + (size_t)i*URING_BUF_SIZE;
+        iov[i].iov_len = URING_BUF_SIZE;
+    }
+    for ( i = 0; i < nslots*2; ++i ) {
+        files[i] = -1;
+    }
+    /* зарегистрированные буферы упираются в RLIMIT_MEMLOCK, тогда
+      слотов становится меньше */
+    while ( ENOMEM == (err=uring_register_slots(&r, iov, files, nslots)) && nslots > 16 ) nslots /= 2;
+    for ( i = 0; i < nslots; ++i ) {
+        freeslots[i] = nslots-1-i;
+    }
+    nfree = nslots;
+    if ( err ) {
+        fprintf(stderr, "error: io_uring_register: %s, copying synchronously\n", strerror(err));
+        uring_free(&r);
+        free(slots);
+        free(freeslots);
+        free(files);
+        free(iov);
+        free(bufs);
+        return thread_proc(p);
     }
 
-    di->nfiles = count;
-    di->size = size;
+    worker_stat* ws = &data->stats[atomic_fetch_add(&data->nextstat, 1)];
+    readable_pthread_t(printbuf, pid);
+    if ( !quiet ) printf("process ID %s created\n", printbuf);
+    while ( 1 ) {
+        /* заполняю свободные слоты */
+        while ( nfree && !exhausted ) {
+            const copytask* task = get_next(data);
+            if ( !task ) {
+                exhausted = 1;
+                break;
+            }
+            node = &list->src->files[list->idx[task->file]];
+            /* большие файлы и части копирую обычным способом */
+            if ( task->chunk || node->size > URING_BUF_SIZE ) {
+                copy_task(data, task, printbuf, ws);
+                continue;
+            }
+            const char* relname = file_name(list->src, node);
+            char* srcname = make_filename(data->srcdir, relname);
+            char* name = make_filename(data->dstdir, relname);
+            if ( !quiet ) printf("process ID %s copying: %s\n", printbuf, srcname);
+            unsigned slot = freeslots[--nfree];
+            slots[slot].srcname = srcname;
+            slots[slot].dstname = name;
+            slots[slot].date = node->date;
+            slots[slot].date_ns = node->date_ns;
+            slots[slot].pending = URING_CHAIN_LEN;
+            slots[slot].failed = 0;
+            slots[slot].size = node->size;
+            slots[slot].file = task->file;
+            clock_gettime(CLOCK_MONOTONIC, &slots[slot].started);
+            throttle_take(node->size);
+            uring_queue_copy(&r, slot, srcname, name, node->size, (char*)iov[slot].iov_base, &slots[slot].stx);
+            inflight++;
+        }
+        if ( !inflight ) break;
+        if ( 0 != (err=uring_submit_and_wait(&r)) ) {
+            fprintf(stderr, "error: io_uring_enter: %s, copying synchronously\n", strerror(err));
+            break;
+        }
+        uring_reap(data, &r, slots, freeslots, &nfree, &inflight, ws);
+    }
+    /* кольцо отказало: дожидаюсь отправленных цепочек, их файлы уже
+      скопированы заново обычным способом, как и оставшиеся задания */
+    if ( inflight && 0 != (err=uring_drain(data, &r, slots, nslots, freeslots, &nfree, &inflight, ws)) ) {
+        /* ядро еще может читать имена и писать в слоты, буферы и файлы:
+          их не трогаю и не освобождаю, файлы незавершенных цепочек
+          считаю ошибками */
+        fprintf(stderr, "error: io_uring_enter: %s, %u files left unfinished\n", strerror(err), inflight);
+        for ( i = 0; i < nslots; ++i ) {
+            if ( !slots[i].srcname ) continue;
+            fprintf(stderr, "error: %s: not copied\n", slots[i].srcname);
+            atomic_fetch_add(&copy_errors, 1);
+            atomic_store_explicit(&ws->errors, atomic_load_explicit(&ws->errors, memory_order_relaxed)+1, memory_order_relaxed);
+        }
+        slots = NULL;
+        bufs = NULL;
+    }
+    uring_free(&r);
+    while ( !exhausted ) {
+        const copytask* task = get_next(data);
+        if ( !task ) break;
+        copy_task(data, task, printbuf, ws);
+    }
+    free(slots);
+    free(freeslots);
+    free(files);
+    free(iov);
+    free(bufs);
+    clock_gettime(CLOCK_MONOTONIC, &ws->finished);
+    return NULL;
 }
 
-const char* readable_fs(char *buf, u_int64_t fsize) {
-    double size = (double)fsize;
-    unsigned i = 0;
-    static const char* units[] = {"B", "kB", "MB", "GB", "TB", "PB", "EB", "ZB", "YB"};
-    while (size > 1024u) {
-        size /= 1024u;
-        i++;
-    }
+/***************************************************************************/
+/* максимальное кол-во открытых дескрипторов каталогов, ожидающих в очередях.
+  при превышении подкаталог открывается позже по пути от корня */
+#define SCAN_MAX_QUEUED_FDS 512
+/* размер буфера для getdents64 */
+#define SCAN_DENTS_BUF_SIZE (64*1024)
 
-    sprintf(buf, "%.*f %s", i, size, units[i]);
+struct linux_dirent64 {
+    u_int64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
 
-    return buf;
+/* кладет задание в конец своей очереди */
+static void scan_push(scan_worker* w, const scan_job* job) {
+    scanner* sc = w->sc;
+    scan_deque* dq = &w->dq;
+    atomic_fetch_add(&sc->pending, 1);
+    atomic_fetch_add(&sc->trees[job->tree].pending, 1);
+    pthread_mutex_lock(&dq->lock);
+    if ( dq->count == dq->cap ) {
+        size_t cap = dq->cap ? dq->cap*2 : 64;
+        scan_job* jobs = (scan_job*)malloc(cap*sizeof(scan_job));
+        for ( size_t i = 0; i < dq->count; ++i )
+            jobs[i] = dq->jobs[(dq->head+i) % dq->cap];
+        free(dq->jobs);
+        dq->jobs = jobs;
+        dq->head = 0;
+        dq->cap = cap;
+    }
+    dq->jobs[(dq->head+dq->count) % dq->cap] = *job;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+    /* бужу ожидающие потоки, если такие есть */
+    if ( atomic_load(&sc->nidle) ) {
+        pthread_mutex_lock(&sc->idle_lock);
+        pthread_cond_signal(&sc->idle_cond);
+        pthread_mutex_unlock(&sc->idle_lock);
+    }
 }
-
-const char* readable_pthread_t(char *buf, pthread_t pt) {
-    char *p = buf;
-    unsigned char *ptc = (unsigned char*)(void*)(&pt);
-    int n = sprintf(p, "0x");
-    p += n;
-    for ( size_t i = 0; i < sizeof(pt); i++ ) {
-        n = sprintf(p, "%02x", (unsigned)(ptc[i]));
-        p += n;
+/* берет задание из очереди: свое - с конца, чужое - с начала */
+static int scan_take(scan_deque* dq, scan_job* job, int own) {
+    int ok = 0;
+    pthread_mutex_lock(&dq->lock);
+    if ( dq->count ) {
+        if ( own ) {
+            *job = dq->jobs[(dq->head+dq->count-1) % dq->cap];
+        } else {
+            *job = dq->jobs[dq->head];
+            dq->head = (dq->head+1) % dq->cap;
+        }
+        dq->count--;
+        ok = 1;
     }
-    *p = 0;
-    return buf;
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
 }
-
-void free_dirlist(dirlist *list) {
-    dirlist *next = NULL, *last = NULL;
-    for ( ; list != NULL; list = next ) {
-        next = list->next;
-        list->next = last;
-        last = list;
+/* запись, удаленная между чтением каталога и stat, просто пропускается:
+  при повторном сканировании живого дерева это обычное дело. остальные
+  ошибки выводятся и считаются, но сканирование не прерывают */
+static void scan_error(scanner* sc, const char* what, const char* root, const char* name, int err) {
+    if ( err == ENOENT ) return;
+    fprintf(stderr, "error %s \"%s%s\": %s\n", what, root, name, strerror(err));
+    atomic_fetch_add(&sc->errors, 1);
+}
+/* читает один каталог, подкаталоги отдает в очередь */
+static void scan_dir(scan_worker* w, scan_job* job) {
+    scanner* sc = w->sc;
+    const scan_tree* tree = &sc->trees[job->tree];
+    size_t rellen = strlen(job->rel);
+    size_t namecap = rellen+256;
+    char* name = (char*)malloc(namecap);
+    int fd = job->fd;
+    if ( fd == -1 ) {
+        fd = openat(tree->rootfd, rellen ? job->rel+1 : ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    } else {
+        atomic_fetch_sub(&sc->openfds, 1);
     }
-    for ( ; last != NULL; last = next ) {
-        next = last->next;
-        last->next = list;
-        list = last;
-        free(list->name);
-        list->name = NULL;
-
-        free(list->next);
-        list->next = NULL;
+    if ( fd == -1 ) {
+        scan_error(sc, "opening directory", tree->root, job->rel, errno);
+        free(name);
+        return;
+    }
+    /* запоминаю каталог вместе с его тайм штампом */
+    {
+        struct stat st;
+        if ( 0 == fstat(fd, &st) ) {
+            filetable_add_dir(&w->tables[job->tree], job->rel, &st);
+        }
+    }
+    memcpy(name, job->rel, rellen);
+    name[rellen] = '/';
+    while ( 1 ) {
+        long n = syscall(SYS_getdents64, fd, w->buf, SCAN_DENTS_BUF_SIZE);
+        if ( n < 0 ) {
+            scan_error(sc, "reading directory", tree->root, job->rel, errno);
+            break;
+        }
+        if ( n == 0 ) break;
+        for ( long off = 0; off < n; ) {
+            struct linux_dirent64* de = (struct linux_dirent64*)(w->buf+off);
+            off += de->d_reclen;
+            /* если имя каталога "." или ".." читаю следующий */
+            if ( de->d_name[0] == '.' && (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2])) )
+                continue;
+            size_t len = strlen(de->d_name);
+            if ( rellen+1+len+1 > namecap ) {
+                namecap = (rellen+1+len+1)*2;
+                name = (char*)realloc(name, namecap);
+            }
+            memcpy(name+rellen+1, de->d_name, len+1);
+            struct stat st;
+            unsigned char type = de->d_type;
+            /* файловая система не сообщает тип, узнаю его */
+            if ( type == DT_UNKNOWN ) {
+                if ( -1 == fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) ) {
+                    scan_error(sc, "reading", tree->root, name, errno);
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+                if ( type == DT_REG ) {
+                    filetable_add(&w->tables[job->tree], name, &st);
+                    continue;
+                }
+            }
+            /* если прочитано имя каталога, отдаю его в очередь */
+            if ( type == DT_DIR ) {
+                scan_job child = {-1, job->tree, strdup(name)};
+                if ( atomic_fetch_add(&sc->openfds, 1) < SCAN_MAX_QUEUED_FDS ) {
+                    child.fd = openat(fd, de->d_name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+                }
+                if ( child.fd == -1 ) {
+                    atomic_fetch_sub(&sc->openfds, 1);
+                }
+                scan_push(w, &child);
+                /* если прочитано имя файла, получаю информацию о нем */
+            } else if ( type == DT_REG ) {
+                if ( -1 == fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) ) {
+                    scan_error(sc, "reading", tree->root, name, errno);
+                    continue;
+                }
+                filetable_add(&w->tables[job->tree], name, &st);
+            }
+        }
+    }
+    close(fd);
+    free(name);
+}
+/* функция потока сканера */
+static void* scan_thread_proc(void* p) {
+    scan_worker* w = (scan_worker*)p;
+    scanner* sc = w->sc;
+    scan_job job;
+    while ( 1 ) {
+        int found = scan_take(&w->dq, &job, 1);
+        /* своя очередь пуста, ворую у других */
+        for ( unsigned i = 1; !found && i < sc->nworkers; ++i ) {
+            found = scan_take(&sc->workers[(w->id+i) % sc->nworkers].dq, &job, 0);
+        }
+        if ( found ) {
+            struct timespec c0, c1;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c0);
+            scan_dir(w, &job);
+            free(job.rel);
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c1);
+            w->cpu_ns[job.tree] += (c1.tv_sec-c0.tv_sec)*1000000000ull + c1.tv_nsec - c0.tv_nsec;
+            /* дерево просканировано целиком */
+            if ( 1 == atomic_fetch_sub(&sc->trees[job.tree].pending, 1) ) {
+                clock_gettime(CLOCK_MONOTONIC, &sc->trees[job.tree].finished);
+            }
+            /* последнее задание выполнено - бужу всех для завершения */
+            if ( 1 == atomic_fetch_sub(&sc->pending, 1) ) {
+                pthread_mutex_lock(&sc->idle_lock);
+                pthread_cond_broadcast(&sc->idle_cond);
+                pthread_mutex_unlock(&sc->idle_lock);
+            }
+            continue;
+        }
+        if ( 0 == atomic_load(&sc->pending) ) break;
+        /* задания есть, но в работе у других потоков. жду появления новых */
+        pthread_mutex_lock(&sc->idle_lock);
+        atomic_fetch_add(&sc->nidle, 1);
+        if ( atomic_load(&sc->pending) ) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 1000000;
+            if ( ts.tv_nsec >= 1000000000 ) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&sc->idle_cond, &sc->idle_lock, &ts);
+        }
+        atomic_fetch_sub(&sc->nidle, 1);
+        pthread_mutex_unlock(&sc->idle_lock);
+    }
+    return NULL;
+}
+/* читает содержимое каталогов. все деревья сканируются одновременно
+  общим пулом потоков. если times не NULL, в него пишется время
+  сканирования каждого дерева */
+int read_dir_trees(filetable** tables, unsigned ntrees, unsigned nthreads, phase_stat* times) {
+    scanner sc;
+    unsigned i, t;
+    int ret = 0;
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    memset(&sc, 0, sizeof(sc));
+    sc.ntrees = ntrees;
+    sc.nworkers = nthreads;
+    sc.trees = (scan_tree*)calloc(ntrees, sizeof(scan_tree));
+    sc.workers = (scan_worker*)calloc(nthreads, sizeof(scan_worker));
+    atomic_init(&sc.pending, 0);
+    atomic_init(&sc.openfds, 0);
+    atomic_init(&sc.nidle, 0);
+    atomic_init(&sc.errors, 0);
+    pthread_mutex_init(&sc.idle_lock, NULL);
+    pthread_cond_init(&sc.idle_cond, NULL);
+    for ( i = 0; i < nthreads; ++i ) {
+        scan_worker* w = &sc.workers[i];
+        w->sc = &sc;
+        w->id = i;
+        pthread_mutex_init(&w->dq.lock, NULL);
+        w->tables = (filetable*)calloc(ntrees, sizeof(filetable));
+        w->cpu_ns = (u_int64_t*)calloc(ntrees, sizeof(u_int64_t));
+        w->buf = (char*)malloc(SCAN_DENTS_BUF_SIZE);
+    }
+    /* корневые каталоги раздаю разным потокам */
+    for ( t = 0; t < ntrees; ++t ) {
+        sc.trees[t].root = tables[t]->root;
+        sc.trees[t].table = tables[t];
+        atomic_init(&sc.trees[t].pending, 0);
+        sc.trees[t].finished = started;
+        sc.trees[t].rootfd = open(tables[t]->root, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if ( sc.trees[t].rootfd == -1 ) {
+            ret = errno;
+            fprintf(stderr, "error opening directory \"%s\": %s\n", tables[t]->root, strerror(ret));
+            continue;
+        }
+        scan_job job = {-1, t, strdup("")};
+        scan_push(&sc.workers[t % nthreads], &job);
+    }
+    for ( i = 1; i < nthreads; ++i ) {
+        pthread_create(&sc.workers[i].thread, NULL, scan_thread_proc, &sc.workers[i]);
+    }
+    scan_thread_proc(&sc.workers[0]);
+    for ( i = 1; i < nthreads; ++i ) {
+        pthread_join(sc.workers[i].thread, NULL);
+    }
+    /* переношу таблицы потоков в результирующие таблицы */
+    for ( t = 0; t < ntrees; ++t ) {
+        if ( times ) {
+            times[t].wall = (sc.trees[t].finished.tv_sec-started.tv_sec) + (sc.trees[t].finished.tv_nsec-started.tv_nsec)/1e9;
+            times[t].cpu = 0;
+            times[t].done = 1;
+        }
+        for ( i = 0; i < nthreads; ++i ) {
+            if ( times ) times[t].cpu += sc.workers[i].cpu_ns[t]/1e9;
+            filetable_append(tables[t], &sc.workers[i].tables[t]);
+            free_filetable(&sc.workers[i].tables[t]);
+        }
+        if ( sc.trees[t].rootfd != -1 ) close(sc.trees[t].rootfd);
+    }
+    for ( i = 0; i < nthreads; ++i ) {
+        scan_worker* w = &sc.workers[i];
+        pthread_mutex_destroy(&w->dq.lock);
+        free(w->dq.jobs);
+        free(w->tables);
+        free(w->cpu_ns);
+        free(w->buf);
+    }
+    if ( atomic_load(&sc.errors) ) {
+        fprintf(stderr, "%" PRIu64 " entries could not be read and were skipped\n", (u_int64_t)atomic_load(&sc.errors));
+    }
+    pthread_mutex_destroy(&sc.idle_lock);
+    pthread_cond_destroy(&sc.idle_cond);
+    free(sc.workers);
+    free(sc.trees);
+    return ret;
+}
+/* копирует имя в пул строк, возвращает его смещение */
+static u_int64_t filetable_add_name(filetable* ft, const char* relname) {
+    size_t len = strlen(relname)+1;
+    u_int64_t off = ft->poolsize;
+    if ( ft->poolsize+len > ft->poolcap ) {
+        while ( ft->poolsize+len > ft->poolcap )
+            ft->poolcap = ft->poolcap ? ft->poolcap*2 : 64*1024;
+        ft->pool = (char*)realloc(ft->pool, ft->poolcap);
+    }
+    memcpy(ft->pool+ft->poolsize, relname, len);
+    ft->poolsize += len;
+    return off;
+}
+/* добавляет описание файла в таблицу. имя копируется в пул строк */
+u_int64_t filetable_add_entry(filetable* ft, const char* relname, const fileentry* e) {
+    if ( ft->nfiles == ft->cap ) {
+        ft->cap = ft->cap ? ft->cap*2 : 1024;
+        ft->files = (fileentry*)realloc(ft->files, ft->cap*sizeof(fileentry));
+    }
+    ft->files[ft->nfiles] = *e;
+    ft->files[ft->nfiles].name = filetable_add_name(ft, relname);
+    return ft->nfiles++;
+}
+/* добавляет файл в таблицу */
+u_int64_t filetable_add(filetable* ft, const char* relname, const struct stat* st) {
+    fileentry e;
+    memset(&e, 0, sizeof(e));
+    e.size = st->st_size;
+    e.date = st->st_mtime;
+    e.date_ns = (u_int32_t)st->st_mtim.tv_nsec;
+    e.dev = dev_pack(st->st_dev);
+    e.ino = st->st_nlink > 1 ? st->st_ino : 0;
+    return filetable_add_entry(ft, relname, &e);
+}
+/* добавляет каталог в таблицу */
+void filetable_add_dir(filetable* ft, const char* relname, const struct stat* st) {
+    if ( ft->ndirs == ft->dircap ) {
+        ft->dircap = ft->dircap ? ft->dircap*2 : 256;
+        ft->dirs = (direntry*)realloc(ft->dirs, ft->dircap*sizeof(direntry));
+    }
+    direntry* d = &ft->dirs[ft->ndirs++];
+    memset(d, 0, sizeof(*d));
+    d->name = filetable_add_name(ft, relname);
+    d->date = st->st_mtime;
+    d->date_ns = (u_int32_t)st->st_mtim.tv_nsec;
+}
+/* переносит описания и имена файлов в конец таблицы */
+void filetable_append(filetable* ft, const filetable* from) {
+    u_int64_t i;
+    if ( !from->poolsize ) return;
+    if ( ft->nfiles+from->nfiles > ft->cap ) {
+        ft->cap = ft->nfiles+from->nfiles;
+        ft->files = (fileentry*)realloc(ft->files, ft->cap*sizeof(fileentry));
+    }
+    if ( ft->ndirs+from->ndirs > ft->dircap ) {
+        ft->dircap = ft->ndirs+from->ndirs;
+        ft->dirs = (direntry*)realloc(ft->dirs, ft->dircap*sizeof(direntry));
+    }
+    if ( ft->poolsize+from->poolsize > ft->poolcap ) {
+        ft->poolcap = ft->poolsize+from->poolsize;
+        ft->pool = (char*)realloc(ft->pool, ft->poolcap);
+    }
+    memcpy(ft->pool+ft->poolsize, from->pool, from->poolsize);
+    for ( i = 0; i < from->nfiles; ++i ) {
+        ft->files[ft->nfiles+i] = from->files[i];
+        ft->files[ft->nfiles+i].name += ft->poolsize;
+    }
+    for ( i = 0; i < from->ndirs; ++i ) {
+        ft->dirs[ft->ndirs+i] = from->dirs[i];
+        ft->dirs[ft->ndirs+i].name += ft->poolsize;
+    }
+    ft->nfiles += from->nfiles;
+    ft->ndirs += from->ndirs;
+    ft->poolsize += from->poolsize;
+}
+/* добавляет индекс файла в список копируемых */
+void copylist_add(copylist* cl, u_int64_t idx) {
+    if ( cl->count == cl->cap ) {
+        cl->cap = cl->cap ? cl->cap*2 : 1024;
+        cl->idx = (u_int64_t*)realloc(cl->idx, cl->cap*sizeof(u_int64_t));
+    }
+    cl->idx[cl->count++] = idx;
+}
+/* создает полное имя файла из компонент */
+char* make_filename(const char* dir, const char* relname) {
+    size_t dirlen = strlen(dir), rellen = strlen(relname);
+    char* result = (char*)malloc(dirlen+rellen+1);
+    memcpy(result, dir, dirlen);
+    memcpy(result+dirlen, relname, rellen+1);
+    return result;
+}
+/* FNV-1a хеш строки */
+static u_int64_t path_hash(const char* s) {
+    u_int64_t h = 0xcbf29ce484222325ull;
+    for ( ; *s; ++s ) {
+        h ^= (unsigned char)*s;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+static inline const char* pathindex_name(const pathindex* idx, u_int64_t i) {
+    return idx->pool + *(const u_int64_t*)(idx->entries + i*idx->stride);
+}
+/* строит индекс. таблица заполнена не более чем наполовину */
+static void pathindex_build(pathindex* idx, const char* pool, const void* entries, size_t stride, u_int64_t count) {
+    u_int64_t i;
+    size_t cap = 16;
+    while ( cap < count*2 ) cap <<= 1;
+    idx->pool = pool;
+    idx->entries = (const char*)entries;
+    idx->stride = stride;
+    idx->slots = (u_int64_t*)calloc(cap, sizeof(*idx->slots));
+    idx->hashes = (u_int64_t*)malloc(cap*sizeof(*idx->hashes));
+    idx->mask = cap-1;
+    idx->mapped = 0;
+    for ( i = 0; i < count; ++i ) {
+        u_int64_t h = path_hash(pathindex_name(idx, i));
+        size_t pos = h & idx->mask;
+        while ( idx->slots[pos] ) pos = (pos+1) & idx->mask;
+        idx->slots[pos] = i+1;
+        idx->hashes[pos] = h;
+    }
+}
+/* индекс файлов. если таблица загружена из файла индекса, берет готовый */
+void build_pathindex(pathindex* idx, const filetable* ft) {
+    if ( ft->islots ) {
+        idx->pool = ft->pool;
+        idx->entries = (const char*)ft->files;
+        idx->stride = sizeof(fileentry);
+        idx->slots = ft->islots;
+        idx->hashes = ft->ihashes;
+        idx->mask = ft->nslots-1;
+        idx->mapped = 1;
+        return;
+    }
+    pathindex_build(idx, ft->pool, ft->files, sizeof(fileentry), ft->nfiles);
+}
+void build_dirindex(pathindex* idx, const filetable* ft) {
+    pathindex_build(idx, ft->pool, ft->dirs, sizeof(direntry), ft->ndirs);
+}
+/* находит запись по имени относительно корня, линейное пробирование */
+int64_t pathindex_find(const pathindex* idx, const char* relname) {
+    u_int64_t h = path_hash(relname);
+    size_t pos = h & idx->mask;
+    for ( ; idx->slots[pos]; pos = (pos+1) & idx->mask ) {
+        u_int64_t i = idx->slots[pos]-1;
+        if ( idx->hashes[pos] == h && 0 == strcmp(pathindex_name(idx, i), relname) )
+            return (int64_t)i;
+    }
+    return -1;
+}
+const fileentry* find_by_relname(const pathindex* idx, const char* relname) {
+    int64_t i = pathindex_find(idx, relname);
+    return i < 0 ? NULL : (const fileentry*)(idx->entries + i*idx->stride);
+}
+void free_pathindex(pathindex* idx) {
+    if ( !idx->mapped ) {
+        free(idx->slots);
+        free(idx->hashes);
+    }
+    idx->slots = NULL;
+    idx->hashes = NULL;
+}
+/* сравнивает описания файлов, возвращает не ноль если файл нужно копировать.
+  в режиме checksum совпадение размеров требует сверки содержимого */
+static int file_changed(const fileentry* src, const fileentry* dst) {
+    switch ( compare_mode ) {
+    case COMPARE_SIZE_MTIME:
+        return src->size != dst->size || src->date != dst->date || src->date_ns != dst->date_ns;
+    case COMPARE_CHECKSUM:
+        return src->size != dst->size;
+    default:
+        return src->date > dst->date;
+    }
+}
+copylist* get_difference(copylist* result, filetable* srclist, filetable* dstlist, unsigned nthreads) {
+    u_int64_t i;
+    pathindex dstidx;
+    copylist candidates; /* файлы, содержимое которых нужно сверить */
+    copylist dstmatch; /* соответствующие им файлы в каталоге назначения */
+    result->src = srclist;
+    /* если каталог назначения пуст, просто копирую весь список файлов */
+    if ( !dstlist->nfiles ) {
+        for ( i = 0; i < srclist->nfiles; ++i ) {
+            copylist_add(result, i);
+        }
+        return result;
+    }
+    /* индекс каталога назначения строится один раз. файлы, которые есть
+      только в каталоге назначения, копировать не нужно, поэтому обе стороны
+      сверки сводятся к одному проходу по исходному списку */
+    build_pathindex(&dstidx, dstlist);
+    memset(&candidates, 0, sizeof(candidates));
+    memset(&dstmatch, 0, sizeof(dstmatch));
+    for ( i = 0; i < srclist->nfiles; ++i ) {
+        const fileentry* src = &srclist->files[i];
+        const fileentry* node = find_by_relname(&dstidx, file_name(srclist, src));
+        /* если в каталоге назначения файл есть, и он не изменился,
+          пропускаю этот файл */
+        if ( node && !file_changed(src, node) ) {
+            if ( compare_mode == COMPARE_CHECKSUM ) {
+                copylist_add(&candidates, i);
+                copylist_add(&dstmatch, node-dstlist->files);
+            }
+            continue;
+        }
+        /* добавляю к списку копируемых файлов */
+        copylist_add(result, i);
+    }
+    free_pathindex(&dstidx);
+    /* сверяю содержимое файлов одинакового размера */
+    if ( candidates.count ) {
+        hash_job job;
+        job.srcdir = srclist->root;
+        job.dstdir = dstlist->root;
+        job.src = srclist;
+        job.idx = candidates.idx;
+        job.count = candidates.count;
+        job.differs = (unsigned char*)calloc(candidates.count, 1);
+        job.hashes = (u_int64_t*)calloc(candidates.count, sizeof(u_int64_t));
+        /* хеши файлов назначения могли сохраниться в индексе */
+        u_int64_t* known = NULL;
+        if ( dstlist->hashes ) {
+            known = (u_int64_t*)malloc(candidates.count*sizeof(u_int64_t));
+            for ( i = 0; i < candidates.count; ++i ) known[i] = dstlist->hashes[dstmatch.idx[i]];
+        } else {
+            dstlist->hashes = (u_int64_t*)calloc(dstlist->nfiles ? dstlist->nfiles : 1, sizeof(u_int64_t));
+        }
+        job.known = known;
+        compare_contents(&job, nthreads);
+        for ( i = 0; i < candidates.count; ++i ) {
+            if ( job.differs[i] ) copylist_add(result, candidates.idx[i]);
+            else dstlist->hashes[dstmatch.idx[i]] = job.hashes[i];
+        }
+        free(known);
+        free(job.hashes);
+        free(job.differs);
+    }
+    free_copylist(&candidates);
+    free_copylist(&dstmatch);
+    return result;
+}
+/* возвращает следующее задание копирования.
+  курсор общий для всех потоков и сдвигается атомарно, без блокировок */
+const copytask* get_next(thread_data* data) {
+    u_int64_t i = atomic_fetch_add_explicit(&data->cursor, 1, memory_order_relaxed);
+    if ( i >= data->ntasks ) {
+        return NULL;
+    }
+    return &data->tasks[i];
+}
+static int cmp_by_path(const void* a, const void* b, void* arg) {
+    const filetable* ft = (const filetable*)arg;
+    return strcmp(file_name(ft, &ft->files[*(const u_int64_t*)a]), file_name(ft, &ft->files[*(const u_int64_t*)b]));
+}
+static int cmp_by_size(const void* a, const void* b, void* arg) {
+    const filetable* ft = (const filetable*)arg;
+    u_int64_t sa = ft->files[*(const u_int64_t*)a].size, sb = ft->files[*(const u_int64_t*)b].size;
+    return sa < sb ? -1 : sa > sb ? 1 : cmp_by_path(a, b, arg);
+}
+static int cmp_by_size_desc(const void* a, const void* b, void* arg) {
+    return cmp_by_size(b, a, arg);
+}
+/* упорядочивает список копируемых файлов по размерам, собранным при сканировании */
+void sort_copylist(copylist* cl, int order) {
+    if ( cl->count < 2 ) return;
+    qsort_r(cl->idx, cl->count, sizeof(u_int64_t),
+        order == ORDER_LARGEST_FIRST ? cmp_by_size_desc
+            : order == ORDER_SMALLEST_FIRST ? cmp_by_size : cmp_by_path,
+        cl->src);
+}
+/* строит задания. файл не меньше двух частей делится на части по
+  chunk_size, которые разбирают разные потоки */
+void build_tasks(thread_data* data) {
+    const copylist* cl = data->files;
+    u_int64_t i, n = 0, nchunked = 0;
+    for ( i = 0; i < cl->count; ++i ) {
+        u_int64_t size = cl->src->files[cl->idx[i]].size;
+        if ( chunk_size && size >= 2*chunk_size ) {
+            n += (size+chunk_size-1)/chunk_size;
+            nchunked++;
+        } else {
+            n++;
+        }
+    }
+    data->tasks = (copytask*)malloc((n ? n : 1)*sizeof(copytask));
+    data->chunks = (chunkstate*)calloc(nchunked ? nchunked : 1, sizeof(chunkstate));
+    data->ntasks = n;
+    data->nchunked = nchunked;
+    n = nchunked = 0;
+    for ( i = 0; i < cl->count; ++i ) {
+        u_int64_t size = cl->src->files[cl->idx[i]].size;
+        if ( chunk_size && size >= 2*chunk_size ) {
+            chunkstate* cs = &data->chunks[nchunked++];
+            u_int64_t off;
+            atomic_init(&cs->remaining, (size+chunk_size-1)/chunk_size);
+            atomic_init(&cs->failed, 0);
+            for ( off = 0; off < size; off += chunk_size ) {
+                copytask* t = &data->tasks[n++];
+                t->file = i;
+                t->offset = off;
+                t->length = size-off < chunk_size ? size-off : chunk_size;
+                t->chunk = cs;
+            }
+        } else {
+            copytask* t = &data->tasks[n++];
+            t->file = i;
+            t->offset = 0;
+            t->length = size;
+            t->chunk = NULL;
+        }
+    }
+}
+/* до запуска потоков создает файлы, копируемые по частям, и выделяет им
+  место. существующий файл при поблочном обновлении только подрезается
+  до нового размера */
+void prepare_chunked(thread_data* data) {
+    const copylist* cl = data->files;
+    u_int64_t i;
+    for ( i = 0; i < data->ntasks; ++i ) {
+        const copytask* t = &data->tasks[i];
+        if ( !t->chunk || t->offset ) continue;
+        const fileentry* node = &cl->src->files[cl->idx[t->file]];
+        char* name = make_filename(data->dstdir, file_name(cl->src, node));
+        int fd = -1, ec = 0;
+        if ( delta_threshold && node->size >= delta_threshold ) {
+            fd = open(name, O_RDWR);
+            t->chunk->delta = fd != -1;
+        }
+        if ( t->chunk->delta ) {
+            struct stat st;
+            if ( fstat(fd, &st) || ((u_int64_t)st.st_size != node->size && ftruncate(fd, node->size)) ) ec = errno;
+            atomic_fetch_add(&delta_total, node->size);
+        } else {
+            struct stat st;
+            char* srcname = make_filename(data->srcdir, file_name(cl->src, node));
+            int fdin = open(srcname, O_RDONLY);
+            int known = fdin != -1 && 0 == fstat(fdin, &st);
+            free(srcname);
+            fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+            if ( fd == -1 ) {
+                ec = errno;
+            } else if ( known && 0 == clone_whole(fdin, fd, &st) ) {
+                /* клон делит экстенты с источником, части копировать не нужно */
+                t->chunk->cloned = 1;
+            } else if ( ((known && is_sparse_copy(&st)) || fallocate(fd, 0, 0, node->size)) && ftruncate(fd, node->size) ) {
+                /* файлу с дырами место не выделяю, чтобы дыры сохранились */
+                ec = errno;
+            }
+            if ( fdin != -1 ) close(fdin);
+        }
+        if ( fd != -1 ) close(fd);
+        if ( ec ) {
+            fprintf(stderr, "error: %s: %s\n", name, strerror(ec));
+            atomic_store(&t->chunk->failed, 1);
+        }
+        free(name);
+    }
+}
+/* упаковывает номер устройства в 32 бита: 12 бит major, 20 бит minor */
+u_int32_t dev_pack(dev_t dev) {
+    return (u_int32_t)((major(dev) & 0xfff) << 20 | (minor(dev) & 0xfffff));
+}
+static dev_t dev_unpack(u_int32_t dev) {
+    return makedev(dev >> 20, dev & 0xfffff);
+}
+/* кол-во потоков для устройства: заданное пользователем или по умолчанию */
+static unsigned device_threads(dev_t dev, unsigned deflt) {
+    unsigned i;
+    for ( i = 0; i < ndevice_limits; ++i ) {
+        if ( device_limits[i].dev == dev ) return device_limits[i].threads;
+    }
+    return deflt;
+}
+/* разбирает PATH=N: N потоков для устройства, на котором лежит PATH */
+int parse_device_threads(const char* spec) {
+    char path[PATH_MAX];
+    const char* eq = strrchr(spec, '=');
+    struct stat st;
+    char* end = NULL;
+    unsigned long n;
+    if ( !eq || eq == spec || (size_t)(eq-spec) >= sizeof(path) ) return EINVAL;
+    n = strtoul(eq+1, &end, 10);
+    if ( end == eq+1 || *end || !n ) return EINVAL;
+    memcpy(path, spec, eq-spec);
+    path[eq-spec] = 0;
+    if ( stat(path, &st) ) return errno;
+    if ( ndevice_limits == DEVICE_LIMITS_MAX ) return E2BIG;
+    device_limits[ndevice_limits].dev = st.st_dev;
+    device_limits[ndevice_limits].threads = (unsigned)n;
+    ndevice_limits++;
+    return 0;
+}
+/* NUMA узел блочного устройства из sysfs, -1 если неизвестен. у раздела
+  узел указан у родительского устройства */
+static int device_numa_node(dev_t dev) {
+    static const char* fmts[] = {
+        "/sys/dev/block/%u:%u/device/numa_node",
+        "/sys/dev/block/%u:%u/../device/numa_node"
+    };
+    char name[128];
+    unsigned i;
+    for ( i = 0; i < sizeof(fmts)/sizeof(fmts[0]); ++i ) {
+        int node = -1;
+        snprintf(name, sizeof(name), fmts[i], major(dev), minor(dev));
+        FILE* f = fopen(name, "r");
+        if ( !f ) continue;
+        if ( 1 != fscanf(f, "%d", &node) ) node = -1;
+        fclose(f);
+        if ( node >= 0 ) return node;
+    }
+    return -1;
+}
+/* процессоры узла NUMA, или все доступные процессу, если узел неизвестен */
+static void device_cpus(int node, cpu_set_t* set) {
+    char name[64];
+    FILE* f;
+    CPU_ZERO(set);
+    if ( node >= 0 ) {
+        snprintf(name, sizeof(name), "/sys/devices/system/node/node%d/cpulist", node);
+        if ( NULL != (f=fopen(name, "r")) ) {
+            unsigned lo, hi;
+            int c;
+            /* формат: 0-3,8-11 */
+            while ( 1 == fscanf(f, "%u", &lo) ) {
+                hi = lo;
+                if ( (c=fgetc(f)) == '-' ) {
+                    if ( 1 != fscanf(f, "%u", &hi) ) break;
+                    c = fgetc(f);
+                }
+                for ( ; lo <= hi && lo < CPU_SETSIZE; ++lo ) CPU_SET(lo, set);
+                if ( c != ',' ) break;
+            }
+            fclose(f);
+        }
+    }
+    if ( !CPU_COUNT(set) ) sched_getaffinity(0, sizeof(*set), set);
+}
+/* привязывает index-й поток группы к одному из процессоров узла ее
+  исходного устройства */
+void device_pin(const device_group* g, pthread_t thread, unsigned index) {
+    cpu_set_t all, one;
+    int count, cpu;
+    device_cpus(g->node, &all);
+    count = CPU_COUNT(&all);
+    if ( !count ) return;
+    index %= (unsigned)count;
+    for ( cpu = 0; cpu < CPU_SETSIZE; ++cpu ) {
+        if ( CPU_ISSET(cpu, &all) && 0 == index-- ) break;
+    }
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    pthread_setaffinity_np(thread, sizeof(one), &one);
+}
+/* делит задания на группы по паре устройств: исходному устройству файла
+  и устройству каталога назначения. порядок заданий внутри группы
+  сохраняется. у каждой группы свой набор потоков, поэтому медленный диск
+  не занимает потоки, которые мог бы использовать быстрый. отдельных
+  потоков чтения и записи нет: reflink, copy_file_range и sendfile
+  переносят данные внутри ядра одним вызовом, поэтому поток копирует файл
+  целиком, а предел чтения группы и предел записи на устройство
+  назначения ограничивают одно и то же кол-во потоков. возвращает кол-во
+  групп */
+unsigned build_device_groups(thread_data* data, dev_t dstdev, unsigned nthreads, device_group** result) {
+    const copylist* cl = data->files;
+    device_group* groups = NULL;
+    unsigned ngroups = 0, cap = 0, g;
+    unsigned* ids = (unsigned*)malloc((data->ntasks ? data->ntasks : 1)*sizeof(unsigned));
+    u_int64_t i;
+    for ( i = 0; i < data->ntasks; ++i ) {
+        dev_t srcdev = dev_unpack(cl->src->files[cl->idx[data->tasks[i].file]].dev);
+        for ( g = 0; g < ngroups && groups[g].srcdev != srcdev; ++g );
+        if ( g == ngroups ) {
+            if ( ngroups == cap ) {
+                cap = cap ? cap*2 : 4;
+                groups = (device_group*)realloc(groups, cap*sizeof(device_group));
+            }
+            memset(&groups[g], 0, sizeof(device_group));
+            groups[g].srcdev = srcdev;
+            groups[g].dstdev = dstdev;
+            ngroups++;
+        }
+        groups[g].count++;
+        ids[i] = g;
+    }
+    if ( ngroups > 1 ) {
+        /* устойчивая раскладка заданий по группам */
+        copytask* tasks = (copytask*)malloc(data->ntasks*sizeof(copytask));
+        u_int64_t* pos = (u_int64_t*)malloc(ngroups*sizeof(u_int64_t));
+        for ( g = 0, i = 0; g < ngroups; ++g ) {
+            groups[g].first = pos[g] = i;
+            i += groups[g].count;
+        }
+        for ( i = 0; i < data->ntasks; ++i ) tasks[pos[ids[i]]++] = data->tasks[i];
+        free(data->tasks);
+        data->tasks = tasks;
+        free(pos);
+    } else if ( !ngroups ) {
+        groups = (device_group*)calloc(1, sizeof(device_group));
+        groups[0].dstdev = dstdev;
+        ngroups = 1;
+    }
+    free(ids);
+    /* все группы пишут на одно устройство назначения, поэтому его предел
+      (по умолчанию nthreads) делится между ними поровну, но не больше, чем
+      группе позволяет исходное устройство. каждая группа получает хотя бы
+      один поток */
+    {
+        unsigned budget = device_threads(dstdev, nthreads), given = 0, grew;
+        unsigned* want = (unsigned*)malloc(ngroups*sizeof(unsigned));
+        for ( g = 0; g < ngroups; ++g ) {
+            want[g] = device_threads(groups[g].srcdev, nthreads);
+            /* лишние потоки маленькой группе не нужны */
+            if ( ngroups > 1 && groups[g].count < want[g] ) want[g] = (unsigned)groups[g].count;
+            if ( !want[g] ) want[g] = 1;
+            groups[g].nthreads = 1;
+            given++;
+        }
+        do {
+            grew = 0;
+            for ( g = 0; g < ngroups && given < budget; ++g ) {
+                if ( groups[g].nthreads < want[g] ) {
+                    groups[g].nthreads++;
+                    given++;
+                    grew = 1;
+                }
+            }
+        } while ( grew && given < budget );
+        free(want);
+    }
+    for ( g = 0; g < ngroups; ++g ) {
+        groups[g].node = pin_workers ? device_numa_node(groups[g].srcdev) : -1;
+        groups[g].data = *data;
+        groups[g].data.tasks = data->tasks + groups[g].first;
+        groups[g].data.ntasks = groups[g].count;
+        atomic_init(&groups[g].data.cursor, 0);
+        atomic_init(&groups[g].data.nextstat, 0);
+    }
+    *result = groups;
+    return ngroups;
+}
+/* сравнивает пути так, что '/' меньше любого другого символа: поддерево
+  каталога идет сразу за ним */
+static int cmp_dir_path(const void* a, const void* b, void* arg) {
+    const filetable* ft = (const filetable*)arg;
+    const unsigned char* p1 = (const unsigned char*)ft->pool + ft->dirs[*(const u_int64_t*)a].name;
+    const unsigned char* p2 = (const unsigned char*)ft->pool + ft->dirs[*(const u_int64_t*)b].name;
+    for ( ; *p1 && *p1 == *p2; ++p1, ++p2 ) {}
+    if ( *p1 == *p2 ) return 0;
+    if ( *p1 == '/' ) return *p2 ? -1 : 1;
+    if ( *p2 == '/' ) return *p1 ? 1 : -1;
+    return *p1 < *p2 ? -1 : 1;
+}
+/* функция потока создания каталогов. каждое поддерево создается одним
+  потоком через mkdirat относительно открытого родителя, поэтому полный
+  путь разбирается ядром только для корня поддерева */
+static void* mkdir_thread_proc(void* p) {
+    mkdir_job* job = (mkdir_job*)p;
+    const filetable* ft = job->src;
+    /* стек открытых каталогов текущей ветки */
+    int* fds = NULL;
+    const char** names = NULL;
+    size_t depth = 0, cap = 0;
+    while ( 1 ) {
+        u_int64_t r = atomic_fetch_add_explicit(&job->cursor, 1, memory_order_relaxed);
+        if ( r >= job->nroots ) break;
+        u_int64_t i = job->roots[r];
+        u_int64_t end = r+1 < job->nroots ? job->roots[r+1] : job->ndirs;
+        const char* root = ft->pool + ft->dirs[job->dirs[i]].name;
+        /* открываю уже существующего родителя корня поддерева */
+        char* parent = make_filename(job->dstdir, root);
+        *strrchr(parent, '/') = 0;
+        int pfd = open(parent, O_PATH|O_DIRECTORY);
+        free(parent);
+        if ( pfd == -1 ) {
+            fprintf(stderr, "error: %s%s: %s\n", job->dstdir, root, strerror(errno));
+            atomic_fetch_add(&job->errors, 1);
+            continue;
+        }
+        for ( ; i < end; ++i ) {
+            const char* name = ft->pool + ft->dirs[job->dirs[i]].name;
+            size_t len = strrchr(name, '/') - name;
+            /* поднимаюсь до родителя */
+            while ( depth && (strlen(names[depth-1]) != len || strncmp(names[depth-1], name, len)) ) {
+                close(fds[--depth]);
+            }
+            /* родителя создать не удалось */
+            if ( !depth && i != job->roots[r] ) continue;
+            int dirfd = depth ? fds[depth-1] : pfd;
+            int fd = -1;
+            if ( (0 != mkdirat(dirfd, name+len+1, S_IRWXU|S_IRWXG|S_IRWXO) && errno != EEXIST)
+                || -1 == (fd=openat(dirfd, name+len+1, O_PATH|O_DIRECTORY|O_NOFOLLOW)) ) {
+                fprintf(stderr, "error: %s%s: %s\n", job->dstdir, name, strerror(errno));
+                atomic_fetch_add(&job->errors, 1);
+                continue;
+            }
+            if ( depth == cap ) {
+                cap = cap ? cap*2 : 16;
+                fds = (int*)realloc(fds, cap*sizeof(int));
+                names = (const char**)realloc(names, cap*sizeof(const char*));
+            }
+            fds[depth] = fd;
+            names[depth++] = name;
+        }
+        while ( depth ) close(fds[--depth]);
+        close(pfd);
+    }
+    free(fds);
+    free(names);
+    return NULL;
+}
+/* создает каталоги исходного дерева, которых нет в каталоге назначения.
+  каталоги упорядочиваются так, что поддерево идет подряд, и раздаются
+  потокам поддеревьями, корень которых лежит в уже существующем каталоге */
+int create_dst_skeleton(const filetable* src, const filetable* dst, const char* dstdir, unsigned nthreads) {
+    pathindex diridx;
+    mkdir_job job;
+    pthread_t* threads;
+    u_int64_t i, n = 0, nroots = 0;
+    u_int64_t* dirs = (u_int64_t*)malloc((src->ndirs ? src->ndirs : 1)*sizeof(u_int64_t));
+    build_dirindex(&diridx, dst);
+    for ( i = 0; i < src->ndirs; ++i ) {
+        const char* name = src->pool + src->dirs[i].name;
+        if ( *name && pathindex_find(&diridx, name) < 0 ) dirs[n++] = i;
+    }
+    free_pathindex(&diridx);
+    if ( !n ) {
+        free(dirs);
+        return 0;
+    }
+    qsort_r(dirs, n, sizeof(u_int64_t), cmp_dir_path, (void*)src);
+    /* корни поддеревьев: каталоги, не вложенные в предыдущий корень */
+    u_int64_t* roots = (u_int64_t*)malloc(n*sizeof(u_int64_t));
+    const char* root = NULL;
+    size_t rootlen = 0;
+    for ( i = 0; i < n; ++i ) {
+        const char* name = src->pool + src->dirs[dirs[i]].name;
+        if ( root && 0 == strncmp(name, root, rootlen) && name[rootlen] == '/' ) continue;
+        roots[nroots++] = i;
+        root = name;
+        rootlen = strlen(name);
+    }
+    job.dstdir = dstdir;
+    job.src = src;
+    job.dirs = dirs;
+    job.ndirs = n;
+    job.roots = roots;
+    job.nroots = nroots;
+    atomic_init(&job.cursor, 0);
+    atomic_init(&job.errors, 0);
+    if ( nthreads < 1 ) nthreads = 1;
+    if ( nthreads > nroots ) nthreads = (unsigned)nroots;
+    threads = (pthread_t*)malloc(nthreads*sizeof(pthread_t));
+    for ( i = 1; i < nthreads; ++i ) {
+        pthread_create(&threads[i], NULL, mkdir_thread_proc, &job);
+    }
+    mkdir_thread_proc(&job);
+    for ( i = 1; i < nthreads; ++i ) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(roots);
+    free(dirs);
+    return atomic_load(&job.errors) ? -1 : 0;
+}
+/* копирует файл */
+/* создает безымянный файл в каталоге назначения через O_TMPFILE, а если
+  файловая система его не поддерживает - скрытый временный файл рядом с
+  dstname. в tmpname возвращается имя временного файла или NULL */
+static int open_replacement(const char* dstname, char** tmpname) {
+    const char* slash = strrchr(dstname, '/');
+    size_t dirlen = slash ? (size_t)(slash-dstname) : 0;
+    char* dir = (char*)malloc(dirlen+2);
+    unsigned tries;
+    int fd;
+    if ( slash ) memcpy(dir, dstname, dirlen ? dirlen : 1);
+    else dir[0] = '.';
+    dir[dirlen ? dirlen : 1] = 0;
+    *tmpname = NULL;
+    fd = open(dir, O_TMPFILE|O_WRONLY|O_CLOEXEC, 0666);
+    free(dir);
+    if ( fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) ) return fd;
+    /* .имя.dsync.XXXXXX рядом с файлом назначения */
+    const char* base = slash ? slash+1 : dstname;
+    char* name = (char*)malloc(strlen(dstname)+32);
+    for ( tries = 0; tries < 100; ++tries ) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        sprintf(name, "%.*s.%s.dsync.%06lx", (int)(base-dstname), dstname, base,
+                (unsigned long)((ts.tv_nsec ^ (uintptr_t)pthread_self() ^ tries) & 0xffffff));
+        fd = open(name, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0666);
+        if ( fd != -1 || errno != EEXIST ) break;
+    }
+    if ( fd == -1 ) {
+        free(name);
+        return -1;
+    }
+    *tmpname = name;
+    return fd;
+}
+/* ставит готовый файл на место dstname одной операцией. безымянный файл
+  сначала получает имя, если dstname уже занято - временное */
+static int publish_replacement(int fd, const char* tmpname, const char* dstname) {
+    char procname[64];
+    char* name;
+    int ec = 0;
+    if ( tmpname ) return rename(tmpname, dstname) ? errno : 0;
+    snprintf(procname, sizeof(procname), "/proc/self/fd/%d", fd);
+    if ( 0 == linkat(AT_FDCWD, procname, AT_FDCWD, dstname, AT_SYMLINK_FOLLOW) ) return 0;
+    if ( errno != EEXIST ) return errno;
+    name = (char*)malloc(strlen(dstname)+32);
+    sprintf(name, "%s.dsync.%d.%lx", dstname, (int)getpid(), (unsigned long)(uintptr_t)pthread_self());
+    if ( linkat(AT_FDCWD, procname, AT_FDCWD, name, AT_SYMLINK_FOLLOW) ) ec = errno;
+    else if ( rename(name, dstname) ) {
+        ec = errno;
+        unlink(name);
+    }
+    free(name);
+    return ec;
+}
+/* после каждых atomic_batch замененных файлов сбрасывает на диск файловую
+  систему, в которой лежит fd. один syncfs заменяет fsync всех файлов пачки */
+static void atomic_checkpoint(int fd) {
+    u_int64_t n = atomic_fetch_add(&atomic_published, 1)+1;
+    if ( n % atomic_batch == 0 ) syncfs(fd);
+}
+/* копирует файл атомарно: читатель и сбой посреди копирования видят либо
+  старый файл, либо новый целиком */
+static int copy_file_atomic(int fdin, const struct stat* st, const char* dstname) {
+    char* tmpname = NULL;
+    struct stat old;
+    int ec = 0;
+    int fdout = open_replacement(dstname, &tmpname);
+    if ( fdout == -1 ) return errno;
+    /* новый файл создан по umask. заменяемый должен сохранить права и
+      владельца, как при копировании на месте. владельца может сменить
+      только root, поэтому EPERM не ошибка. chown сбрасывает setuid,
+      поэтому права выставляются после него */
+    if ( 0 == stat(dstname, &old) ) {
+        if ( fchown(fdout, old.st_uid, old.st_gid) && errno != EPERM ) ec = errno;
+        if ( !ec && fchmod(fdout, old.st_mode & 07777) ) ec = errno;
+    }
+    if ( !ec ) ec = copy_data(fdin, fdout, st);
+    if ( !ec ) {
+        struct timespec ts[2] = {
+             st->st_atim
+            ,st->st_mtim
+        };
+        if ( futimens(fdout, ts) ) ec = errno;
+    }
+    if ( !ec ) ec = publish_replacement(fdout, tmpname, dstname);
+    if ( ec && tmpname ) unlink(tmpname);
+    if ( !ec ) atomic_checkpoint(fdout);
+    close(fdout);
+    free(tmpname);
+    return ec;
+}
+/* сбрасывает на диск последнюю неполную пачку замененных файлов */
+void atomic_finish(const char* dstdir) {
+    int fd;
+    if ( !atomic_batch || !atomic_load(&atomic_published) ) return;
+    fd = open(dstdir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if ( fd == -1 ) return;
+    syncfs(fd);
+    close(fd);
+}
+int copy_file(const char* srcname, const char* dstname, time_t srctime) {
+    struct utimbuf time;
+    time.modtime = srctime;
+    time.actime  = 0;
+    /**  */
+    int fdin = open(srcname, O_RDONLY);
+    if ( fdin == -1 ) {
+        return errno;
+    }
+
+    struct stat st;
+    if ( fstat(fdin, &st) ) {
+        int ec = errno;
+
+        close(fdin);
+
+        return ec;
+    }
+
+    if ( atomic_batch ) {
+        int ec = copy_file_atomic(fdin, &st, dstname);
+        close(fdin);
+        return ec;
+    }
+
+    /* большой файл, уже существующий в каталоге назначения, обновляю поблочно */
+    int delta = 0;
+    int fdout = -1;
+    if ( delta_threshold && (u_int64_t)st.st_size >= delta_threshold ) {
+        fdout = open(dstname, O_RDWR);
+        delta = fdout != -1;
+    }
+    if ( fdout == -1 ) {
+        fdout = open(dstname, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    }
+    if ( fdout == -1 ) {
+        close(fdin);
+        return errno;
+    }
+
+    int ec = delta ? copy_delta(fdin, fdout, &st) : copy_data(fdin, fdout, &st);
+    if ( ec ) {
+        close(fdin);
+        close(fdout);
+
+        return ec;
+    }
+
+    struct timespec ts[2] = {
+         st.st_atim
+        ,st.st_mtim
+    };
+    futimens(fdout, ts);
+
+    close(fdin);
+    close(fdout);
+
+    return 0;
+}
+static const char* engine_names[ENGINE_COUNT] = {
+    "reflink", "copy_file_range", "sendfile", "readwrite"
+};
+/* возвращает способ копирования по имени, ENGINE_COUNT если имя неизвестно */
+int parse_copy_engine(const char* name) {
+    int i;
+    if ( 0 == strcmp(name, "auto") ) return ENGINE_AUTO;
+    for ( i = 0; i < ENGINE_COUNT; ++i ) {
+        if ( 0 == strcmp(name, engine_names[i]) ) return i;
+    }
+    return ENGINE_COUNT;
+}
+/* возвращает первый способ, который стоит пробовать для пары устройств */
+static int engine_cache_get(dev_t srcdev, dev_t dstdev) {
+    int engine = ENGINE_REFLINK;
+    unsigned i;
+    pthread_rwlock_rdlock(&engine_cache_lock);
+    for ( i = 0; i < engine_cache_count; ++i ) {
+        if ( engine_cache[i].srcdev == srcdev && engine_cache[i].dstdev == dstdev ) {
+            engine = engine_cache[i].engine;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&engine_cache_lock);
+    return engine;
+}
+/* запоминает, что для пары устройств способ не работает */
+static void engine_cache_demote(dev_t srcdev, dev_t dstdev, int failed) {
+    unsigned i;
+    pthread_rwlock_wrlock(&engine_cache_lock);
+    for ( i = 0; i < engine_cache_count; ++i ) {
+        if ( engine_cache[i].srcdev == srcdev && engine_cache[i].dstdev == dstdev ) {
+            if ( engine_cache[i].engine <= failed ) engine_cache[i].engine = failed+1;
+            break;
+        }
+    }
+    if ( i == engine_cache_count && i < ENGINE_CACHE_SIZE ) {
+        engine_cache[i].srcdev = srcdev;
+        engine_cache[i].dstdev = dstdev;
+        engine_cache[i].engine = failed+1;
+        engine_cache_count++;
+    }
+    pthread_rwlock_unlock(&engine_cache_lock);
+}
+/* ошибки, означающие что способ не поддерживается для этих файлов */
+static int engine_unsupported(int err) {
+    return err == EOPNOTSUPP || err == ENOTSUP || err == EXDEV || err == EINVAL
+        || err == ENOSYS || err == ENOTTY || err == EBADF;
+}
+/* клонирует экстенты файла. либо все, либо ничего */
+static int copy_reflink(int fdin, int fdout, off_t size, off_t* offset) {
+    if ( *offset != 0 ) return EINVAL;
+    throttle_take(0);
+    if ( -1 == ioctl(fdout, FICLONE, fdin) ) return errno;
+    *offset = size;
+    return 0;
+}
+/* copy_file_range и sendfile копируют не более этого объема за один вызов */
+#define MAX_SEND_SIZE 0x7ffff000u
+/* копирует через copy_file_range. позиции файлов сдвигаются */
+static int copy_range(int fdin, int fdout, off_t size, off_t* offset) {
+    while ( *offset < size ) {
+        off_t size_left = size - *offset;
+        size_t size_to_copy = throttle_take(size_left < (off_t)MAX_SEND_SIZE ? (size_t)size_left : MAX_SEND_SIZE);
+        ssize_t sz = copy_file_range(fdin, NULL, fdout, NULL, size_to_copy, 0);
+        if ( sz < 0 ) {
+            if ( errno == EINTR ) continue;
+            return errno;
+        }
+        /* файл укоротился во время копирования */
+        if ( sz == 0 ) break;
+        *offset += sz;
+    }
+    return 0;
+}
+/* копирует через sendfile. позиции файлов сдвигаются */
+static int copy_sendfile(int fdin, int fdout, off_t size, off_t* offset) {
+    while ( *offset < size ) {
+        off_t size_left = size - *offset;
+        size_t size_to_copy = throttle_take(size_left < (off_t)MAX_SEND_SIZE ? (size_t)size_left : MAX_SEND_SIZE);
+        ssize_t sz = sendfile(fdout, fdin, NULL, size_to_copy);
+        if ( sz < 0 ) {
+            if ( errno == EINTR ) continue;
+            return errno;
+        }
+        if ( sz == 0 ) break;
+        *offset += sz;
+    }
+    return 0;
+}
+#define READWRITE_BUF_SIZE (256*1024)
+/* копирует через буфер buf размером bufsize. позиции файлов сдвигаются */
+static int copy_readwrite_buf(int fdin, int fdout, off_t size, off_t* offset, char* buf, size_t bufsize) {
+    int ec = 0;
+    while ( *offset < size ) {
+        size_t want = throttle_take(size-*offset < (off_t)bufsize ? (size_t)(size-*offset) : bufsize);
+        ssize_t rd = read(fdin, buf, want);
+        if ( rd < 0 ) {
+            if ( errno == EINTR ) continue;
+            ec = errno;
+            break;
+        }
+        if ( rd == 0 ) break;
+        ssize_t done = 0;
+        while ( done < rd ) {
+            ssize_t wr = write(fdout, buf+done, rd-done);
+            if ( wr < 0 ) {
+                if ( errno == EINTR ) continue;
+                ec = errno;
+                break;
+            }
+            done += wr;
+        }
+        if ( ec ) break;
+        *offset += rd;
+    }
+    return ec;
+}
+/* копирует через буфер. позиции файлов сдвигаются */
+static int copy_readwrite(int fdin, int fdout, off_t size, off_t* offset) {
+    char* buf = (char*)malloc(READWRITE_BUF_SIZE);
+    int ec = copy_readwrite_buf(fdin, fdout, size, offset, buf, READWRITE_BUF_SIZE);
+    free(buf);
+    return ec;
+}
+typedef int (*copy_engine_proc)(int fdin, int fdout, off_t size, off_t* offset);
+static const copy_engine_proc engine_procs[ENGINE_COUNT] = {
+    copy_reflink, copy_range, copy_sendfile, copy_readwrite
+};
+/* копирует до позиции end, начиная со способа first. неподдерживаемый
+  способ запоминается для пары устройств */
+static int copy_engines(int fdin, int fdout, dev_t srcdev, dev_t dstdev, int first, off_t end, off_t* offset) {
+    int engine, ec = 0;
+    if ( copy_engine != ENGINE_AUTO ) {
+        return engine_procs[copy_engine](fdin, fdout, end, offset);
+    }
+    for ( engine = first; engine < ENGINE_COUNT; ++engine ) {
+        ec = engine_procs[engine](fdin, fdout, end, offset);
+        if ( !ec ) return 0;
+        if ( !engine_unsupported(ec) || engine == ENGINE_READWRITE ) return ec;
+        engine_cache_demote(srcdev, dstdev, engine);
+    }
+    return ec;
+}
+int clone_whole(int fdin, int fdout, const struct stat* st) {
+    struct stat dst;
+    off_t offset = 0;
+    int ec;
+    if ( copy_engine != ENGINE_AUTO || nocache_mode || !st->st_size || is_sparse_copy(st) ) return EOPNOTSUPP;
+    if ( fstat(fdout, &dst) ) return errno;
+    if ( engine_cache_get(st->st_dev, dst.st_dev) != ENGINE_REFLINK ) return EOPNOTSUPP;
+    ec = copy_reflink(fdin, fdout, st->st_size, &offset);
+    if ( ec && engine_unsupported(ec) ) engine_cache_demote(st->st_dev, dst.st_dev, ENGINE_REFLINK);
+    return ec;
+}
+/* копирует содержимое. в режиме auto перебирает способы, начиная с
+  запомненного для пары устройств. после частичного копирования следующий
+  способ продолжает с текущей позиции */
+int copy_data(int fdin, int fdout, const struct stat* st) {
+    off_t offset = 0;
+    struct stat dst;
+    if ( st->st_size == 0 ) return 0;
+    if ( is_sparse_copy(st) ) {
+        return copy_sparse(fdin, fdout, st);
+    }
+    if ( nocache_mode ) {
+        return copy_nocache(fdin, fdout, 0, st->st_size, NULL);
+    }
+    if ( copy_engine != ENGINE_AUTO ) {
+        return engine_procs[copy_engine](fdin, fdout, st->st_size, &offset);
+    }
+    if ( fstat(fdout, &dst) ) return errno;
+    if ( autotune ) return copy_tuned(fdin, fdout, st, dst.st_dev);
+    return copy_engines(fdin, fdout, st->st_dev, dst.st_dev, engine_cache_get(st->st_dev, dst.st_dev), st->st_size, &offset);
+}
+
+/***************************************************************************/
+/* автонастройка: для каждой пары ФС и класса размеров файлов выбирается
+  способ копирования и размер буфера по измеренной скорости, а после
+  калибровки - и кол-во одновременно копируемых файлов класса */
+
+/* файл больше этого при измерении копируется не целиком */
+#define TUNE_SAMPLE_LIMIT (64*1024*1024)
+/* способ считается измеренным после стольких файлов или такого объема */
+#define TUNE_SAMPLES 8
+#define TUNE_SAMPLE_BYTES (64*1024*1024)
+/* калибровка берет на класс не больше стольких файлов и такого объема */
+#define TUNE_CAL_FILES 8
+#define TUNE_CAL_BYTES (256*1024*1024)
+
+static const char* tune_bucket_names[TUNE_BUCKETS] = {
+    "< 64K", "< 1M", "< 16M", "< 256M", ">= 256M"
+};
+static const char* tune_strategy_names[TUNE_STRATEGIES] = {
+    "copy_file_range", "sendfile", "readwrite-64K", "readwrite-256K", "readwrite-1M"
+};
+static unsigned tune_bucket_of(u_int64_t size) {
+    if ( size < 64*1024 ) return 0;
+    if ( size < 1024*1024 ) return 1;
+    if ( size < 16*1024*1024 ) return 2;
+    if ( size < 256*1024*1024 ) return 3;
+    return 4;
+}
+static size_t tune_bufsize(int s) {
+    return s == TUNE_RW_64K ? 64*1024 : s == TUNE_RW_256K ? 256*1024 : 1024*1024;
+}
+/* файл меньше 64K целиком читается любым буфером, большие не пробую */
+static int tune_useful(unsigned bucket, int s) {
+    return bucket > 0 || (s != TUNE_RW_256K && s != TUNE_RW_1M);
+}
+/* буфер размером с наибольший из TUNE_RW_*. живет в пуле до конца копирования */
+static char* tune_buf_get() {
+    char* buf;
+    pthread_mutex_lock(&tune_pool_lock);
+    buf = tune_pool;
+    if ( buf ) tune_pool = *(char**)buf;
+    pthread_mutex_unlock(&tune_pool_lock);
+    if ( !buf ) buf = (char*)malloc(1024*1024);
+    return buf;
+}
+static void tune_buf_put(char* buf) {
+    pthread_mutex_lock(&tune_pool_lock);
+    *(char**)buf = tune_pool;
+    tune_pool = buf;
+    pthread_mutex_unlock(&tune_pool_lock);
+}
+void tune_pool_free() {
+    pthread_mutex_lock(&tune_pool_lock);
+    while ( tune_pool ) {
+        char* next = *(char**)tune_pool;
+        free(tune_pool);
+        tune_pool = next;
+    }
+    pthread_mutex_unlock(&tune_pool_lock);
+}
+/* копирует до позиции size выбранным способом. позиции файлов сдвигаются */
+static int tune_run(int s, int fdin, int fdout, off_t size, off_t* offset) {
+    char* buf;
+    int ec;
+    if ( s == TUNE_RANGE ) return copy_range(fdin, fdout, size, offset);
+    if ( s == TUNE_SENDFILE ) return copy_sendfile(fdin, fdout, size, offset);
+    buf = tune_buf_get();
+    ec = copy_readwrite_buf(fdin, fdout, size, offset, buf, tune_bufsize(s));
+    tune_buf_put(buf);
+    return ec;
+}
+/* ключ ФС в файле профилей: тип и fsid, они не меняются между запусками */
+static void tune_fs_key(int fd, char* key, size_t size) {
+    struct statfs sf;
+    if ( fstatfs(fd, &sf) ) snprintf(key, size, "unknown");
+    else snprintf(key, size, "%lx-%08x%08x", (unsigned long)sf.f_type,
+                  (unsigned)sf.f_fsid.__val[0], (unsigned)sf.f_fsid.__val[1]);
+}
+/* возвращает профиль пары устройств, создавая его по первому файлу.
+  сохраненный выбор для той же пары ФС переносится в профиль.
+  NULL - профилей слишком много, автонастройка не используется */
+static tune_profile* tune_get(int fdin, int fdout, dev_t srcdev, dev_t dstdev) {
+    tune_profile* p = NULL;
+    unsigned i, b;
+    pthread_rwlock_rdlock(&tune_lock);
+    for ( i = 0; i < tune_nprofiles && !p; ++i ) {
+        if ( tune_profiles[i]->srcdev == srcdev && tune_profiles[i]->dstdev == dstdev ) p = tune_profiles[i];
+    }
+    pthread_rwlock_unlock(&tune_lock);
+    if ( p ) return p;
+    pthread_rwlock_wrlock(&tune_lock);
+    for ( i = 0; i < tune_nprofiles && !p; ++i ) {
+        if ( tune_profiles[i]->srcdev == srcdev && tune_profiles[i]->dstdev == dstdev ) p = tune_profiles[i];
+    }
+    if ( !p && tune_nprofiles < TUNE_PROFILES_MAX ) {
+        p = (tune_profile*)calloc(1, sizeof(tune_profile));
+        p->srcdev = srcdev;
+        p->dstdev = dstdev;
+        tune_fs_key(fdin, p->srcfs, sizeof(p->srcfs));
+        tune_fs_key(fdout, p->dstfs, sizeof(p->dstfs));
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->cond, NULL);
+        for ( b = 0; b < TUNE_BUCKETS; ++b ) p->buckets[b].best = -1;
+        if ( !calibrate ) {
+            for ( i = 0; i < tune_nsaved; ++i ) {
+                const tune_saved* sv = &tune_saved_list[i];
+                if ( strcmp(sv->srcfs, p->srcfs) || strcmp(sv->dstfs, p->dstfs) ) continue;
+                p->buckets[sv->bucket].best = sv->strategy;
+                p->buckets[sv->bucket].threads = sv->threads;
+                p->buckets[sv->bucket].rate = sv->rate;
+            }
+        }
+        tune_profiles[tune_nprofiles++] = p;
+    }
+    pthread_rwlock_unlock(&tune_lock);
+    return p;
+}
+/* выбирает способ для очередного файла класса: пока способы измеряются -
+  наименее измеренный, затем лучший по скорости. вызывается под p->lock */
+static int tune_pick(tune_bucket* tb, unsigned bucket) {
+    int s, next = -1, best = -1;
+    double rate, bestrate = 0;
+    if ( tb->best >= 0 ) return tb->best;
+    for ( s = 0; s < TUNE_STRATEGIES; ++s ) {
+        if ( !tune_useful(bucket, s) || (tb->disabled & (1u << s)) ) continue;
+        if ( tb->samples[s] >= TUNE_SAMPLES || tb->bytes[s] >= TUNE_SAMPLE_BYTES ) continue;
+        if ( next < 0 || tb->samples[s] < tb->samples[next] ) next = s;
+    }
+    if ( next >= 0 ) return next;
+    for ( s = 0; s < TUNE_STRATEGIES; ++s ) {
+        if ( !tune_useful(bucket, s) || (tb->disabled & (1u << s)) || !tb->ns[s] ) continue;
+        rate = tb->bytes[s]*1e9/tb->ns[s];
+        if ( best < 0 || rate > bestrate ) {
+            best = s;
+            bestrate = rate;
+        }
+    }
+    /* все способы отказали, буфер работает всегда */
+    if ( best < 0 ) best = TUNE_RW_256K;
+    tb->best = best;
+    tb->rate = bestrate;
+    tb->learned = 1;
+    return best;
+}
+/* учитывает результат копирования файла способом s */
+static void tune_account(tune_profile* p, tune_bucket* tb, int s, int ec, off_t bytes, const struct timespec* t0, const struct timespec* t1) {
+    pthread_mutex_lock(&p->lock);
+    tb->active--;
+    if ( tb->threads ) pthread_cond_signal(&p->cond);
+    if ( ec && engine_unsupported(ec) ) {
+        tb->disabled |= 1u << s;
+        if ( tb->best == s ) tb->best = -1;
+    } else if ( !ec && tb->best < 0 ) {
+        tb->samples[s]++;
+        tb->bytes[s] += bytes;
+        tb->ns[s] += (t1->tv_sec-t0->tv_sec)*1000000000ull + t1->tv_nsec - t0->tv_nsec;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+int copy_tuned(int fdin, int fdout, const struct stat* st, dev_t dstdev) {
+    off_t offset = 0;
+    tune_profile* p;
+    tune_bucket* tb;
+    unsigned bucket = tune_bucket_of(st->st_size);
+    struct timespec t0, t1;
+    int s, ec;
+    /* клонирование не переносит данные, с ним нечего сравнивать */
+    if ( engine_cache_get(st->st_dev, dstdev) == ENGINE_REFLINK ) {
+        ec = copy_reflink(fdin, fdout, st->st_size, &offset);
+        if ( !ec || !engine_unsupported(ec) ) return ec;
+        engine_cache_demote(st->st_dev, dstdev, ENGINE_REFLINK);
+    }
+    p = tune_get(fdin, fdout, st->st_dev, dstdev);
+    if ( !p ) return copy_engines(fdin, fdout, st->st_dev, dstdev, engine_cache_get(st->st_dev, dstdev), st->st_size, &offset);
+    tb = &p->buckets[bucket];
+    pthread_mutex_lock(&p->lock);
+    s = tune_pick(tb, bucket);
+    while ( tb->threads && tb->active >= tb->threads ) pthread_cond_wait(&p->cond, &p->lock);
+    tb->active++;
+    pthread_mutex_unlock(&p->lock);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ec = tune_run(s, fdin, fdout, st->st_size, &offset);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    tune_account(p, tb, s, ec, offset, &t0, &t1);
+    /* способ не поддерживается - докопирую обычным перебором с текущей позиции */
+    if ( ec && engine_unsupported(ec) ) {
+        ec = copy_engines(fdin, fdout, st->st_dev, dstdev, ENGINE_COPY_FILE_RANGE, st->st_size, &offset);
+    }
+    return ec;
+}
+void tune_print(const char* prefix) {
+    char sizebuf[32];
+    unsigned i, b;
+    for ( i = 0; i < tune_nprofiles; ++i ) {
+        const tune_profile* p = tune_profiles[i];
+        for ( b = 0; b < TUNE_BUCKETS; ++b ) {
+            const tune_bucket* tb = &p->buckets[b];
+            if ( tb->best < 0 ) continue;
+            printf("%s %u:%u -> %u:%u, files %-7s: %s", prefix, major(p->srcdev), minor(p->srcdev),
+                   major(p->dstdev), minor(p->dstdev), tune_bucket_names[b], tune_strategy_names[tb->best]);
+            if ( tb->threads ) printf(", %u at a time", tb->threads);
+            if ( tb->rate > 0 ) printf(", %s/s", readable_fs(sizebuf, (u_int64_t)tb->rate));
+            printf("\n");
+        }
+    }
+}
+/* файл профилей: строки "srcfs dstfs класс способ потоков скорость".
+  непонятные строки пропускаются, файл пишется только программой */
+int tune_load(const char* path) {
+    char line[256], srcfs[40], dstfs[40], name[32];
+    unsigned bucket, threads;
+    double rate;
+    int s;
+    FILE* f = fopen(path, "r");
+    if ( !f ) return errno;
+    while ( fgets(line, sizeof(line), f) ) {
+        if ( line[0] == '#' ) continue;
+        if ( 6 != sscanf(line, "%39s %39s %u %31s %u %lf", srcfs, dstfs, &bucket, name, &threads, &rate) ) continue;
+        for ( s = 0; s < TUNE_STRATEGIES && strcmp(name, tune_strategy_names[s]); ++s );
+        if ( s == TUNE_STRATEGIES || bucket >= TUNE_BUCKETS ) continue;
+        tune_saved_list = (tune_saved*)realloc(tune_saved_list, (tune_nsaved+1)*sizeof(tune_saved));
+        strcpy(tune_saved_list[tune_nsaved].srcfs, srcfs);
+        strcpy(tune_saved_list[tune_nsaved].dstfs, dstfs);
+        tune_saved_list[tune_nsaved].bucket = bucket;
+        tune_saved_list[tune_nsaved].strategy = s;
+        tune_saved_list[tune_nsaved].threads = threads;
+        tune_saved_list[tune_nsaved].rate = rate;
+        tune_nsaved++;
+    }
+    fclose(f);
+    return 0;
+}
+/* дописывает выбор, сделанный в этом запуске, к загруженным профилям и
+  перезаписывает файл через временный */
+static int tune_save(const char* path) {
+    unsigned i, j, b, changed = 0;
+    char* tmp;
+    FILE* f;
+    int ec = 0;
+    for ( i = 0; i < tune_nprofiles; ++i ) {
+        const tune_profile* p = tune_profiles[i];
+        for ( b = 0; b < TUNE_BUCKETS; ++b ) {
+            const tune_bucket* tb = &p->buckets[b];
+            if ( !tb->learned || tb->best < 0 ) continue;
+            for ( j = 0; j < tune_nsaved; ++j ) {
+                if ( tune_saved_list[j].bucket == b && 0 == strcmp(tune_saved_list[j].srcfs, p->srcfs)
+                    && 0 == strcmp(tune_saved_list[j].dstfs, p->dstfs) ) break;
+            }
+            if ( j == tune_nsaved ) {
+                tune_saved_list = (tune_saved*)realloc(tune_saved_list, (tune_nsaved+1)*sizeof(tune_saved));
+                strcpy(tune_saved_list[j].srcfs, p->srcfs);
+                strcpy(tune_saved_list[j].dstfs, p->dstfs);
+                tune_saved_list[j].bucket = b;
+                tune_nsaved++;
+            }
+            tune_saved_list[j].strategy = tb->best;
+            tune_saved_list[j].threads = tb->threads;
+            tune_saved_list[j].rate = tb->rate;
+            changed++;
+        }
+    }
+    if ( !changed ) return 0;
+    tmp = (char*)malloc(strlen(path)+8);
+    sprintf(tmp, "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if ( !f ) {
+        ec = errno;
+        free(tmp);
+        return ec;
+    }
+    fprintf(f, "# dsync2 autotune: srcfs dstfs bucket strategy threads bytes/s\n");
+    for ( j = 0; j < tune_nsaved; ++j ) {
+        const tune_saved* sv = &tune_saved_list[j];
+        fprintf(f, "%s %s %u %s %u %.0f\n", sv->srcfs, sv->dstfs, sv->bucket,
+                tune_strategy_names[sv->strategy], sv->threads, sv->rate);
+    }
+    if ( fclose(f) ) ec = errno;
+    if ( !ec && rename(tmp, path) ) ec = errno;
+    if ( ec ) unlink(tmp);
+    free(tmp);
+    return ec;
+}
+void tune_finish(const char* path, int show_info) {
+    int ec;
+    if ( !autotune ) return;
+    if ( show_info ) tune_print("autotune");
+    if ( path && (ec = tune_save(path)) ) {
+        fprintf(stderr, "error writing %s: %s\n", path, strerror(ec));
+    }
+}
+
+/* файл, копируемый при калибровке */
+typedef struct tune_sample {
+    char* srcname; /* полное имя исходного файла */
+    off_t size; /* сколько копировать */
+} tune_sample;
+
+/* задание калибровки для нескольких потоков */
+typedef struct tune_job {
+    const tune_sample* samples;
+    unsigned nsamples;
+    unsigned count; /* кол-во копирований */
+    atomic_uint next; /* следующее копирование */
+    const char* tmpdir; /* каталог для копий */
+    int strategy;
+    atomic_uint_fast64_t bytes; /* скопированный объем */
+    atomic_int err; /* первая ошибка */
+} tune_job;
+
+static char* tune_sample_name(const char* tmpdir, unsigned n) {
+    char name[32];
+    snprintf(name, sizeof(name), "/c%u", n);
+    return make_filename(tmpdir, name);
+}
+/* копирует образец в каталог калибровки, исходный файл читается с холодным кешем */
+static int tune_copy_sample(const tune_sample* smp, const char* tmpdir, unsigned n, int s, off_t* copied) {
+    char* dstname = tune_sample_name(tmpdir, n);
+    off_t offset = 0;
+    int fdin, fdout, ec = 0;
+    fdin = open(smp->srcname, O_RDONLY|O_CLOEXEC);
+    fdout = fdin == -1 ? -1 : open(dstname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+    if ( fdin == -1 || fdout == -1 ) ec = errno;
+    else {
+        posix_fadvise(fdin, 0, 0, POSIX_FADV_DONTNEED);
+        ec = tune_run(s, fdin, fdout, smp->size, &offset);
+    }
+    if ( fdout != -1 ) close(fdout);
+    if ( fdin != -1 ) close(fdin);
+    free(dstname);
+    *copied = offset;
+    return ec;
+}
+static void* tune_job_proc(void* arg) {
+    tune_job* job = (tune_job*)arg;
+    unsigned n;
+    while ( (n = atomic_fetch_add(&job->next, 1)) < job->count ) {
+        off_t copied;
+        int ec = tune_copy_sample(&job->samples[n % job->nsamples], job->tmpdir, n, job->strategy, &copied);
+        if ( ec ) {
+            int zero = 0;
+            atomic_compare_exchange_strong(&job->err, &zero, ec);
+            break;
+        }
+        atomic_fetch_add(&job->bytes, copied);
+    }
+    return NULL;
+}
+/* копирует образцы в nthreads потоков, возвращает скорость в байт/с. в
+  замер входит syncfs, иначе измерялась бы скорость памяти. копии удаляются
+  после него: не записанные страницы удаленного файла на диск не попадают */
+static double tune_measure(const tune_sample* samples, unsigned nsamples, const char* tmpdir, int s, unsigned nthreads, int* err) {
+    pthread_t* threads = (pthread_t*)malloc(nthreads*sizeof(pthread_t));
+    struct timespec t0, t1;
+    tune_job job;
+    unsigned i;
+    int fd;
+    double elapsed;
+    job.samples = samples;
+    job.nsamples = nsamples;
+    job.count = nsamples > 2*nthreads ? nsamples : 2*nthreads;
+    job.tmpdir = tmpdir;
+    job.strategy = s;
+    atomic_init(&job.next, 0);
+    atomic_init(&job.bytes, 0);
+    atomic_init(&job.err, 0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for ( i = 0; i < nthreads; ++i ) pthread_create(&threads[i], NULL, tune_job_proc, &job);
+    for ( i = 0; i < nthreads; ++i ) pthread_join(threads[i], NULL);
+    fd = open(tmpdir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if ( fd != -1 ) {
+        syncfs(fd);
+        close(fd);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for ( i = 0; i < job.count; ++i ) {
+        char* name = tune_sample_name(tmpdir, i);
+        unlink(name);
+        free(name);
+    }
+    free(threads);
+    *err = atomic_load(&job.err);
+    elapsed = (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)/1e9;
+    return elapsed > 0 ? atomic_load(&job.bytes)/elapsed : 0;
+}
+/* калибровка пары корневых каталогов: для каждого класса размеров берет
+  несколько файлов исходного каталога, копирует их каждым способом в
+  скрытый каталог назначения, затем лучшим способом в 1, 2, 4... потоков */
+int tune_calibrate(const filetable* src, const char* dstdir, unsigned nthreads) {
+    struct stat sst, dst;
+    tune_profile* p;
+    tune_sample* samples;
+    char name[64];
+    char* tmpdir;
+    unsigned b, n, k;
+    u_int64_t i, total;
+    int fdsrc, fddst, s, ec = 0;
+    u_int32_t srcdev;
+    fdsrc = open(src->root, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    fddst = open(dstdir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if ( fdsrc == -1 || fddst == -1 || fstat(fdsrc, &sst) || fstat(fddst, &dst) ) {
+        ec = errno;
+        if ( fdsrc != -1 ) close(fdsrc);
+        if ( fddst != -1 ) close(fddst);
+        return ec;
+    }
+    p = tune_get(fdsrc, fddst, sst.st_dev, dst.st_dev);
+    close(fdsrc);
+    close(fddst);
+    if ( !p ) return ENOSPC;
+    snprintf(name, sizeof(name), "/.dsync2-calibrate.%d", (int)getpid());
+    tmpdir = make_filename(dstdir, name);
+    if ( mkdir(tmpdir, 0700) ) {
+        ec = errno;
+        free(tmpdir);
+        return ec;
+    }
+    samples = (tune_sample*)malloc(TUNE_CAL_FILES*sizeof(tune_sample));
+    srcdev = dev_pack(sst.st_dev);
+    for ( b = 0; b < TUNE_BUCKETS && !ec; ++b ) {
+        tune_bucket* tb = &p->buckets[b];
+        double bestrate = 0, rate;
+        int best = -1;
+        /* образцы - файлы класса на исходном устройстве */
+        for ( i = 0, n = 0, total = 0; i < src->nfiles && n < TUNE_CAL_FILES && total < TUNE_CAL_BYTES; ++i ) {
+            const fileentry* e = &src->files[i];
+            if ( e->dev != srcdev || tune_bucket_of(e->size) != b || !e->size ) continue;
+            samples[n].srcname = make_filename(src->root, file_name(src, e));
+            samples[n].size = e->size < TUNE_SAMPLE_LIMIT ? (off_t)e->size : TUNE_SAMPLE_LIMIT;
+            total += samples[n].size;
+            n++;
+        }
+        if ( !n ) continue;
+        for ( s = 0; s < TUNE_STRATEGIES; ++s ) {
+            int err;
+            if ( !tune_useful(b, s) ) continue;
+            rate = tune_measure(samples, n, tmpdir, s, 1, &err);
+            if ( err && engine_unsupported(err) ) {
+                tb->disabled |= 1u << s;
+                continue;
+            }
+            if ( err ) {
+                ec = err;
+                break;
+            }
+            if ( best < 0 || rate > bestrate ) {
+                best = s;
+                bestrate = rate;
+            }
+        }
+        if ( best >= 0 ) {
+            /* больше потоков оставляю, только если это заметно быстрее */
+            unsigned bestk = 1;
+            for ( k = 2; k < 2*nthreads && !ec; k *= 2 ) {
+                int err;
+                unsigned threads = k < nthreads ? k : nthreads;
+                rate = tune_measure(samples, n, tmpdir, best, threads, &err);
+                if ( err ) ec = err;
+                else if ( rate > bestrate*1.05 ) {
+                    bestk = threads;
+                    bestrate = rate;
+                }
+                if ( threads == nthreads ) break;
+            }
+            tb->best = best;
+            tb->rate = bestrate;
+            tb->threads = bestk < nthreads ? bestk : 0;
+            tb->learned = 1;
+        }
+        while ( n ) free(samples[--n].srcname);
+    }
+    free(samples);
+    rmdir(tmpdir);
+    free(tmpdir);
+    return ec;
+}
+
+/***************************************************************************/
+/* хеш содержимого. схема xxh3: 8 64-битных полос, каждая 64-байтная
+  полоса данных смешивается с ключом и перемножается 32x32->64, что
+  хорошо ложится на SSE2/AVX2. результат не совместим с xxh3 */
+#define HASH_STRIPE 64
+#define HASH_BLOCK_STRIPES 16
+/* размер буфера чтения при хешировании */
+#define HASH_BUF_SIZE (1024*1024)
+
+static const u_int64_t hash_secret[HASH_BLOCK_STRIPES+16] = {
+    0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull, 0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull,
+    0x78e5c0cc4ee679cbull, 0x2172ffcc7dd05a82ull, 0x8e2443f7744608b8ull, 0x4c263a81e69035e0ull,
+    0xcb00c391bb52283cull, 0xa32e531b8b65d088ull, 0x4ef90da297486471ull, 0xd8acdea946ef1938ull,
+    0x3f349ce33f76faa8ull, 0x1d4f0bc7c7bbdcf9ull, 0x3159b4cd4be0518aull, 0x647378d9c97e9fc8ull,
+    0xc3ebd33483acc5eaull, 0xeb6313faffa081c5ull, 0x49daf0b751dd0d17ull, 0x9e68d429265516d3ull,
+    0xfca1477d58be162bull, 0xce31d07ad1b8f88full, 0x280416958f3acb45ull, 0x7e404bbbcafbd7afull,
+    0x81bc6e4c1d5b4ba6ull, 0x2a9a2b4b0e77d5b1ull, 0x5bd6e3aa8d21f2c8ull, 0x6fa7f5e3c41e2d97ull,
+    0x13c8b2f1d6a0e953ull, 0xd41a6b9c02f8e7a5ull, 0x97e0f5c3b1846d2aull, 0x3ad58e14c7b96f01ull
+};
+#define HASH_PRIME32_1 0x9e3779b1u
+#define HASH_PRIME64_1 0x9e3779b185ebca87ull
+#define HASH_PRIME64_2 0xc2b2ae3d27d4eb4full
+
+static inline u_int64_t hash_read64(const unsigned char* p) {
+    u_int64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+#if !defined(__x86_64__)
+/* обрабатывает n полос, начиная с полосы first текущего блока */
+static void hash_stripes_scalar(u_int64_t* acc, const unsigned char* p, size_t n, size_t first) {
+    size_t s, i;
+    for ( s = 0; s < n; ++s, p += HASH_STRIPE ) {
+        for ( i = 0; i < 8; ++i ) {
+            u_int64_t dv = hash_read64(p+8*i);
+            u_int64_t dk = dv ^ hash_secret[first+s+i];
+            acc[i^1] += dv;
+            acc[i] += (dk & 0xffffffffu) * (dk >> 32);
+        }
+    }
+}
+#else
+static void hash_stripes_sse2(u_int64_t* acc, const unsigned char* p, size_t n, size_t first) {
+    __m128i a[4];
+    size_t s, j;
+    for ( j = 0; j < 4; ++j ) a[j] = _mm_loadu_si128((const __m128i*)(acc+2*j));
+    for ( s = 0; s < n; ++s, p += HASH_STRIPE ) {
+        const unsigned char* key = (const unsigned char*)(hash_secret+first+s);
+        for ( j = 0; j < 4; ++j ) {
+            __m128i d = _mm_loadu_si128((const __m128i*)(p+16*j));
+            __m128i dk = _mm_xor_si128(d, _mm_loadu_si128((const __m128i*)(key+16*j)));
+            __m128i prod = _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+            a[j] = _mm_add_epi64(a[j], _mm_add_epi64(prod, _mm_shuffle_epi32(d, _MM_SHUFFLE(1,0,3,2))));
+        }
+    }
+    for ( j = 0; j < 4; ++j ) _mm_storeu_si128((__m128i*)(acc+2*j), a[j]);
+}
+__attribute__((target("avx2")))
+static void hash_stripes_avx2(u_int64_t* acc, const unsigned char* p, size_t n, size_t first) {
+    __m256i a[2];
+    size_t s, j;
+    for ( j = 0; j < 2; ++j ) a[j] = _mm256_loadu_si256((const __m256i*)(acc+4*j));
+    for ( s = 0; s < n; ++s, p += HASH_STRIPE ) {
+        const unsigned char* key = (const unsigned char*)(hash_secret+first+s);
+        for ( j = 0; j < 2; ++j ) {
+            __m256i d = _mm256_loadu_si256((const __m256i*)(p+32*j));
+            __m256i dk = _mm256_xor_si256(d, _mm256_loadu_si256((const __m256i*)(key+32*j)));
+            __m256i prod = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+            a[j] = _mm256_add_epi64(a[j], _mm256_add_epi64(prod, _mm256_shuffle_epi32(d, _MM_SHUFFLE(1,0,3,2))));
+        }
+    }
+    for ( j = 0; j < 2; ++j ) _mm256_storeu_si256((__m256i*)(acc+4*j), a[j]);
+}
+#endif
+typedef void (*hash_stripes_proc)(u_int64_t* acc, const unsigned char* p, size_t n, size_t first);
+/* выбирает реализацию под возможности процессора */
+static hash_stripes_proc hash_stripes_impl() {
+    static hash_stripes_proc impl = NULL;
+    if ( !impl ) {
+#if defined(__x86_64__)
+        impl = __builtin_cpu_supports("avx2") ? hash_stripes_avx2 : hash_stripes_sse2;
+#else
+        impl = hash_stripes_scalar;
+#endif
+    }
+    return impl;
+}
+static void hash_scramble(u_int64_t* acc) {
+    size_t i;
+    for ( i = 0; i < 8; ++i ) {
+        u_int64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= hash_secret[HASH_BLOCK_STRIPES+i];
+        acc[i] = a * HASH_PRIME32_1;
+    }
+}
+static void hash_init(hash_state* h) {
+    h->acc[0] = HASH_PRIME32_1; h->acc[1] = HASH_PRIME64_1;
+    h->acc[2] = HASH_PRIME64_2; h->acc[3] = 0x165667b19e3779f9ull;
+    h->acc[4] = 0x85ebca77c2b2ae63ull; h->acc[5] = 0x85ebca6bu;
+    h->acc[6] = HASH_PRIME64_2; h->acc[7] = HASH_PRIME32_1;
+    h->stripes = 0;
+    h->total = 0;
+}
+/* обрабатывает целые полосы. len должен быть кратен HASH_STRIPE */
+static void hash_update(hash_state* h, const unsigned char* p, size_t len) {
+    hash_stripes_proc impl = hash_stripes_impl();
+    size_t n = len / HASH_STRIPE;
+    h->total += len;
+    while ( n ) {
+        size_t chunk = HASH_BLOCK_STRIPES - h->stripes;
+        if ( chunk > n ) chunk = n;
+        impl(h->acc, p, chunk, h->stripes);
+        p += chunk*HASH_STRIPE;
+        n -= chunk;
+        h->stripes += chunk;
+        if ( h->stripes == HASH_BLOCK_STRIPES ) {
+            hash_scramble(h->acc);
+            h->stripes = 0;
+        }
+    }
+}
+static inline u_int64_t hash_mix(u_int64_t a, u_int64_t b) {
+    unsigned __int128 m = (unsigned __int128)a * b;
+    return (u_int64_t)m ^ (u_int64_t)(m >> 64);
+}
+/* завершает хеш, дописывая неполную полосу */
+static u_int64_t hash_final(hash_state* h, const unsigned char* tail, size_t len) {
+    unsigned char last[HASH_STRIPE] = {0};
+    u_int64_t r;
+    size_t i;
+    if ( len ) {
+        memcpy(last, tail, len);
+        hash_update(h, last, HASH_STRIPE);
+        h->total -= HASH_STRIPE - len;
+    }
+    r = h->total * HASH_PRIME64_1;
+    for ( i = 0; i < 4; ++i ) {
+        r += hash_mix(h->acc[2*i] ^ hash_secret[2*i], h->acc[2*i+1] ^ hash_secret[2*i+1]);
+    }
+    r ^= r >> 37;
+    r *= 0x165667919e3779f9ull;
+    r ^= r >> 32;
+    return r;
+}
+/* хеширует файл, читая его буфером HASH_BUF_SIZE. возвращает errno */
+int hash_file(const char* name, u_int64_t* digest, unsigned char* buf) {
+    hash_state h;
+    int fd = open(name, O_RDONLY|O_CLOEXEC);
+    if ( fd == -1 ) return errno;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    hash_init(&h);
+    while ( 1 ) {
+        size_t got = 0;
+        /* заполняю буфер целиком, чтобы неполная полоса была только в конце */
+        while ( got < HASH_BUF_SIZE ) {
+            ssize_t rd = read(fd, buf+got, HASH_BUF_SIZE-got);
+            if ( rd < 0 ) {
+                if ( errno == EINTR ) continue;
+                int ec = errno;
+                close(fd);
+                return ec;
+            }
+            if ( rd == 0 ) break;
+            got += rd;
+        }
+        if ( got < HASH_BUF_SIZE ) {
+            size_t full = got - got % HASH_STRIPE;
+            hash_update(&h, buf, full);
+            *digest = hash_final(&h, buf+full, got-full);
+            break;
+        }
+        hash_update(&h, buf, got);
+    }
+    close(fd);
+    return 0;
+}
+/* функция потока сравнения содержимого */
+static void* hash_thread_proc(void* p) {
+    hash_job* job = (hash_job*)p;
+    unsigned char* buf = (unsigned char*)malloc(HASH_BUF_SIZE);
+    while ( 1 ) {
+        u_int64_t i = atomic_fetch_add_explicit(&job->cursor, 1, memory_order_relaxed);
+        if ( i >= job->count ) break;
+        const char* relname = file_name(job->src, &job->src->files[job->idx[i]]);
+        char* srcname = make_filename(job->srcdir, relname);
+        char* dstname = make_filename(job->dstdir, relname);
+        u_int64_t h1 = 0, h2 = job->known ? job->known[i] : 0;
+        int err = hash_file(srcname, &h1, buf);
+        if ( !err && !h2 ) err = hash_file(dstname, &h2, buf);
+        if ( err ) {
+            fprintf(stderr, "error hashing \"%s\": %s\n", relname, strerror(err));
+            job->differs[i] = 2;
+        } else {
+            job->differs[i] = h1 != h2;
+            if ( job->hashes && h1 == h2 ) job->hashes[i] = h1;
+        }
+        free(srcname);
+        free(dstname);
+    }
+    free(buf);
+    return NULL;
+}
+/* сравнивает содержимое файлов. файлы раздаются потокам через атомарный курсор */
+void compare_contents(hash_job* job, unsigned nthreads) {
+    pthread_t* threads;
+    unsigned i;
+    atomic_init(&job->cursor, 0);
+    if ( nthreads < 1 ) nthreads = 1;
+    if ( nthreads > job->count ) nthreads = (unsigned)job->count;
+    threads = (pthread_t*)malloc(nthreads*sizeof(pthread_t));
+    for ( i = 1; i < nthreads; ++i ) {
+        pthread_create(&threads[i], NULL, hash_thread_proc, job);
+    }
+    hash_thread_proc(job);
+    for ( i = 1; i < nthreads; ++i ) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+/* сверяет содержимое скопированных файлов с исходными */
+u_int64_t verify_copied(const copylist* cl, const char* srcdir, const char* dstdir, unsigned nthreads, u_int64_t* hashes) {
+    hash_job job;
+    u_int64_t i, bad = 0;
+    if ( !cl->count ) return 0;
+    job.srcdir = srcdir;
+    job.dstdir = dstdir;
+    job.src = cl->src;
+    job.idx = cl->idx;
+    job.count = cl->count;
+    job.known = NULL;
+    job.hashes = hashes;
+    job.differs = (unsigned char*)calloc(cl->count, 1);
+    compare_contents(&job, nthreads);
+    for ( i = 0; i < cl->count; ++i ) {
+        if ( job.differs[i] == 1 ) {
+            fprintf(stderr, "verify failed: %s\n", file_name(cl->src, &cl->src->files[cl->idx[i]]));
+        }
+        if ( job.differs[i] ) bad++;
+    }
+    free(job.differs);
+    return bad;
+}
+
+/***************************************************************************/
+/* индекс каталога назначения */
+#define INDEX_MAGIC "DSYNCIDX"
+#define INDEX_VERSION 1
+
+static u_int64_t index_align(u_int64_t off) {
+    return (off+7) & ~(u_int64_t)7;
+}
+/* раздел из count элементов по size байт лежит внутри файла */
+static int index_section(const index_header* h, u_int64_t off, u_int64_t count, u_int64_t size, int aligned) {
+    if ( off > h->size || (aligned && (off & 7)) ) return 0;
+    return count <= (h->size-off)/size;
+}
+/* проверяет заголовок и все смещения внутри отображения: испорченный индекс
+  должен приводить к сканированию каталога, а не к падению */
+static int index_valid(const index_header* h, const char* map) {
+    const fileentry* files = (const fileentry*)(map + h->files_off);
+    const direntry* dirs = (const direntry*)(map + h->dirs_off);
+    const u_int64_t* slots = (const u_int64_t*)(map + h->slots_off);
+    const char* pool = map + h->pool_off;
+    u_int64_t i;
+    /* размер хеш-индекса такой же, как строит pathindex_build: степень
+      двойки не меньше 16 и не меньше удвоенного кол-ва файлов */
+    if ( h->nslots < 16 || (h->nslots & (h->nslots-1)) || h->nfiles > h->nslots/2 ) return 0;
+    if ( !index_section(h, h->files_off, h->nfiles, sizeof(fileentry), 1)
+        || !index_section(h, h->dirs_off, h->ndirs, sizeof(direntry), 1)
+        || !index_section(h, h->slots_off, h->nslots, sizeof(u_int64_t), 1)
+        || !index_section(h, h->shash_off, h->nslots, sizeof(u_int64_t), 1)
+        || !index_section(h, h->hashes_off, h->nfiles, sizeof(u_int64_t), 1)
+        || !index_section(h, h->pool_off, h->poolsize, 1, 0)
+        || h->root_off >= h->size || !memchr(map + h->root_off, 0, h->size - h->root_off) ) return 0;
+    /* все имена завершаются нулем внутри пула */
+    if ( h->poolsize && pool[h->poolsize-1] ) return 0;
+    for ( i = 0; i < h->nfiles; ++i ) {
+        if ( files[i].name >= h->poolsize ) return 0;
+    }
+    for ( i = 0; i < h->ndirs; ++i ) {
+        if ( dirs[i].name >= h->poolsize ) return 0;
+    }
+    /* каждый файл занимает ровно один слот. при nslots >= 2*nfiles остаются
+      пустые слоты, на которых останавливается поиск в pathindex_find */
+    unsigned char* used = (unsigned char*)calloc(h->nfiles/8+1, 1);
+    u_int64_t nused = 0;
+    if ( !used ) return 0;
+    for ( i = 0; i < h->nslots; ++i ) {
+        u_int64_t v = slots[i];
+        if ( !v ) continue;
+        if ( v > h->nfiles || (used[(v-1)/8] & (1u << ((v-1)%8))) ) break;
+        used[(v-1)/8] |= 1u << ((v-1)%8);
+        nused++;
+    }
+    free(used);
+    return i == h->nslots && nused == h->nfiles;
+}
+/* отображает файл индекса в память. массивы таблицы указывают прямо в
+  отображение, хеш-индекс имен тоже берется готовым. отображение частное,
+  поэтому хеши содержимого можно дополнять на месте */
+int load_index(filetable* ft, const char* path) {
+    struct stat st;
+    const index_header* h;
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if ( fd == -1 ) return errno;
+    if ( fstat(fd, &st) || (size_t)st.st_size < sizeof(index_header) ) {
+        close(fd);
+        return EINVAL;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( map == MAP_FAILED ) return errno;
+    h = (const index_header*)map;
+    if ( memcmp(h->magic, INDEX_MAGIC, 8) || h->version != INDEX_VERSION
+        || h->entrysize != sizeof(fileentry) || h->size != (u_int64_t)st.st_size
+        || !index_valid(h, (const char*)map) ) {
+        munmap(map, st.st_size);
+        fprintf(stderr, "destination index \"%s\" is invalid, ignoring it\n", path);
+        return EINVAL;
+    }
+    ft->map = map;
+    ft->mapsize = st.st_size;
+    ft->root = (const char*)map + h->root_off;
+    ft->files = (fileentry*)((char*)map + h->files_off);
+    ft->nfiles = ft->cap = h->nfiles;
+    ft->dirs = (direntry*)((char*)map + h->dirs_off);
+    ft->ndirs = ft->dircap = h->ndirs;
+    ft->pool = (char*)map + h->pool_off;
+    ft->poolsize = ft->poolcap = h->poolsize;
+    ft->hashes = (u_int64_t*)((char*)map + h->hashes_off);
+    ft->islots = (u_int64_t*)((char*)map + h->slots_off);
+    ft->ihashes = (u_int64_t*)((char*)map + h->shash_off);
+    ft->nslots = h->nslots;
+    return 0;
+}
+/* индекс актуален, если ни один каталог не изменил тайм штамп:
+  создание, удаление и переименование файлов его меняют */
+int index_is_fresh(const filetable* ft) {
+    u_int64_t i;
+    int fresh = ft->ndirs != 0;
+    int rootfd = open(ft->root, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if ( rootfd == -1 ) return 0;
+    for ( i = 0; fresh && i < ft->ndirs; ++i ) {
+        const direntry* d = &ft->dirs[i];
+        const char* name = ft->pool + d->name;
+        struct stat st;
+        if ( fstatat(rootfd, *name ? name+1 : ".", &st, AT_SYMLINK_NOFOLLOW)
+            || !S_ISDIR(st.st_mode) || st.st_mtime != d->date
+            || (u_int32_t)st.st_mtim.tv_nsec != d->date_ns ) {
+            fresh = 0;
+        }
+    }
+    close(rootfd);
+    return fresh;
+}
+/* строит таблицу каталога назначения: прежние файлы, кроме замененных,
+  плюс скопированные, с описаниями, прочитанными заново. каталоги - все
+  существующие каталоги обоих деревьев, с текущими тайм штампами */
+void build_synced_table(filetable* out, const filetable* src, const filetable* dst, const copylist* copied, const u_int64_t* copiedhashes) {
+    pathindex dstidx, diridx;
+    u_int64_t i, n = 0;
+    unsigned char* replaced = (unsigned char*)calloc(dst->nfiles ? dst->nfiles : 1, 1);
+    u_int64_t* hashes = (u_int64_t*)malloc((dst->nfiles+copied->count+1)*sizeof(u_int64_t));
+    int rootfd = open(dst->root, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    struct stat st;
+    out->root = dst->root;
+    build_pathindex(&dstidx, dst);
+    for ( i = 0; i < copied->count; ++i ) {
+        const fileentry* e = find_by_relname(&dstidx, file_name(src, &src->files[copied->idx[i]]));
+        if ( e ) replaced[e-dst->files] = 1;
+    }
+    free_pathindex(&dstidx);
+    for ( i = 0; i < dst->nfiles; ++i ) {
+        if ( replaced[i] ) continue;
+        filetable_add_entry(out, file_name(dst, &dst->files[i]), &dst->files[i]);
+        hashes[n++] = dst->hashes ? dst->hashes[i] : 0;
+    }
+    for ( i = 0; i < copied->count; ++i ) {
+        const char* name = file_name(src, &src->files[copied->idx[i]]);
+        if ( fstatat(rootfd, name+1, &st, AT_SYMLINK_NOFOLLOW) || !S_ISREG(st.st_mode) ) continue;
+        filetable_add(out, name, &st);
+        hashes[n++] = copiedhashes ? copiedhashes[i] : 0;
+    }
+    out->hashes = hashes;
+    build_dirindex(&diridx, dst);
+    for ( i = 0; i < dst->ndirs+src->ndirs; ++i ) {
+        const char* name = i < dst->ndirs
+            ? dst->pool + dst->dirs[i].name
+            : src->pool + src->dirs[i-dst->ndirs].name;
+        if ( i >= dst->ndirs && pathindex_find(&diridx, name) >= 0 ) continue;
+        if ( fstatat(rootfd, *name ? name+1 : ".", &st, AT_SYMLINK_NOFOLLOW) || !S_ISDIR(st.st_mode) ) continue;
+        filetable_add_dir(out, name, &st);
+    }
+    free_pathindex(&diridx);
+    if ( rootfd != -1 ) close(rootfd);
+    free(replaced);
+}
+static int write_all(int fd, const void* data, u_int64_t size, u_int64_t* off) {
+    const char* p = (const char*)data;
+    static const char zeros[8] = {0};
+    while ( size ) {
+        ssize_t wr = write(fd, p, size);
+        if ( wr < 0 ) {
+            if ( errno == EINTR ) continue;
+            return errno;
+        }
+        p += wr;
+        size -= wr;
+        *off += wr;
+    }
+    /* выравниваю следующий раздел */
+    if ( index_align(*off) != *off ) {
+        u_int64_t pad = index_align(*off) - *off;
+        if ( write(fd, zeros, pad) != (ssize_t)pad ) return errno ? errno : EIO;
+        *off += pad;
+    }
+    return 0;
+}
+/* записывает индекс во временный файл и атомарно переименовывает */
+int write_index(const filetable* ft, const char* path) {
+    index_header h;
+    pathindex idx;
+    u_int64_t off = 0;
+    int ec = 0;
+    size_t rootlen = strlen(ft->root)+1;
+    char* tmpname = (char*)malloc(strlen(path)+8);
+    sprintf(tmpname, "%s.tmp", path);
+    int fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if ( fd == -1 ) {
+        ec = errno;
+        fprintf(stderr, "error writing destination index \"%s\": %s\n", tmpname, strerror(ec));
+        free(tmpname);
+        return ec;
+    }
+    pathindex_build(&idx, ft->pool, ft->files, sizeof(fileentry), ft->nfiles);
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, 8);
+    h.version = INDEX_VERSION;
+    h.entrysize = sizeof(fileentry);
+    h.nfiles = ft->nfiles;
+    h.ndirs = ft->ndirs;
+    h.nslots = idx.mask+1;
+    h.poolsize = ft->poolsize;
+    h.files_off = index_align(sizeof(h));
+    h.dirs_off = index_align(h.files_off + h.nfiles*sizeof(fileentry));
+    h.slots_off = index_align(h.dirs_off + h.ndirs*sizeof(direntry));
+    h.shash_off = h.slots_off + h.nslots*sizeof(u_int64_t);
+    h.hashes_off = h.shash_off + h.nslots*sizeof(u_int64_t);
+    h.pool_off = h.hashes_off + h.nfiles*sizeof(u_int64_t);
+    h.root_off = index_align(h.pool_off + h.poolsize);
+    h.size = index_align(h.root_off + rootlen);
+    u_int64_t* zerohashes = ft->hashes ? NULL : (u_int64_t*)calloc(h.nfiles ? h.nfiles : 1, sizeof(u_int64_t));
+    if ( !ec ) ec = write_all(fd, &h, sizeof(h), &off);
+    if ( !ec ) ec = write_all(fd, ft->files, h.nfiles*sizeof(fileentry), &off);
+    if ( !ec ) ec = write_all(fd, ft->dirs, h.ndirs*sizeof(direntry), &off);
+    if ( !ec ) ec = write_all(fd, idx.slots, h.nslots*sizeof(u_int64_t), &off);
+    if ( !ec ) ec = write_all(fd, idx.hashes, h.nslots*sizeof(u_int64_t), &off);
+    if ( !ec ) ec = write_all(fd, ft->hashes ? ft->hashes : zerohashes, h.nfiles*sizeof(u_int64_t), &off);
+    if ( !ec ) ec = write_all(fd, ft->pool, h.poolsize, &off);
+    if ( !ec ) ec = write_all(fd, ft->root, rootlen, &off);
+    free(zerohashes);
+    free_pathindex(&idx);
+    if ( close(fd) && !ec ) ec = errno;
+    if ( !ec && rename(tmpname, path) ) ec = errno;
+    if ( ec ) {
+        fprintf(stderr, "error writing destination index \"%s\": %s\n", path, strerror(ec));
+        unlink(tmpname);
+    }
+    free(tmpname);
+    return ec;
+}
+
+/* читает блок целиком, возвращает кол-во прочитанных байт или -1 */
+static ssize_t pread_full(int fd, char* buf, size_t size, off_t off) {
+    size_t got = 0;
+    while ( got < size ) {
+        ssize_t rd = pread(fd, buf+got, size-got, off+got);
+        if ( rd < 0 ) {
+            if ( errno == EINTR ) continue;
+            return -1;
+        }
+        if ( rd == 0 ) break;
+        got += rd;
+    }
+    return got;
+}
+/* пишет буфер целиком по смещению. возвращает errno */
+static int pwrite_full(int fd, const char* buf, size_t size, off_t off) {
+    size_t done = 0;
+    while ( done < size ) {
+        ssize_t wr = pwrite(fd, buf+done, size-done, off+done);
+        if ( wr < 0 ) {
+            if ( errno == EINTR ) continue;
+            return errno;
+        }
+        done += wr;
+    }
+    return 0;
+}
+/* сравнивает файлы блоками по delta_block байт и перезаписывает через
+  pwrite только отличающиеся. хвост за концом исходного файла отрезается.
+  для локальных файлов прямое сравнение дешевле контрольных сумм: оба
+  блока все равно читаются */
+int copy_delta(int fdin, int fdout, const struct stat* st) {
+    struct stat dst;
+    u_int64_t written = 0;
+    int ec;
+    if ( fstat(fdout, &dst) ) return errno;
+    posix_fadvise(fdin, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fdout, 0, 0, POSIX_FADV_SEQUENTIAL);
+    ec = copy_delta_range(fdin, fdout, 0, st->st_size, dst.st_size, &written);
+    if ( !ec && dst.st_size > st->st_size && ftruncate(fdout, st->st_size) ) {
+        ec = errno;
+    }
+    atomic_fetch_add(&delta_total, st->st_size);
+    atomic_fetch_add(&delta_written, written);
+    return ec;
+}
+/* сравнивает и перезаписывает блоки диапазона. dstsize - размер файла
+  назначения, за ним сравнивать нечего */
+int copy_delta_range(int fdin, int fdout, off_t start, off_t end, off_t dstsize, u_int64_t* written) {
+    off_t off;
+    int ec = 0;
+    char* sbuf = (char*)malloc(delta_block);
+    char* dbuf = (char*)malloc(delta_block);
+    for ( off = start; off < end; off += delta_block ) {
+        size_t want = end-off < (off_t)delta_block ? (size_t)(end-off) : delta_block;
+        /* блок сравнивается целиком, поэтому списывается весь */
+        throttle_take(want);
+        ssize_t srd = pread_full(fdin, sbuf, want, off);
+        if ( srd < 0 ) {
+            ec = errno;
+            break;
+        }
+        /* файл укоротился во время копирования */
+        if ( srd == 0 ) break;
+        ssize_t drd = 0;
+        if ( off < dstsize ) {
+            drd = pread_full(fdout, dbuf, srd, off);
+            if ( drd < 0 ) {
+                ec = errno;
+                break;
+            }
+        }
+        if ( drd == srd && 0 == memcmp(sbuf, dbuf, srd) ) continue;
+        ssize_t done = 0;
+        while ( done < srd ) {
+            ssize_t wr = pwrite(fdout, sbuf+done, srd-done, off+done);
+            if ( wr < 0 ) {
+                if ( errno == EINTR ) continue;
+                ec = errno;
+                break;
+            }
+            done += wr;
+        }
+        if ( ec ) break;
+        *written += srd;
+    }
+    free(sbuf);
+    free(dbuf);
+    return ec;
+}
+/* копирует диапазон [start, end) по явным смещениям: copy_file_range, при
+  его отсутствии pread/pwrite */
+static int copy_range_at(int fdin, int fdout, off_t start, off_t end, void* arg) {
+    loff_t in = start, out = start;
+    int ec = 0;
+    (void)arg;
+    while ( in < end ) {
+        ssize_t sz = copy_file_range(fdin, &in, fdout, &out, throttle_take(end-in), 0);
+        if ( sz < 0 ) {
+            if ( errno == EINTR ) continue;
+            if ( !engine_unsupported(errno) ) return errno;
+            /* copy_file_range не поддерживается, копирую через буфер */
+            char* buf = (char*)malloc(READWRITE_BUF_SIZE);
+            while ( !ec && in < end ) {
+                size_t want = throttle_take(end-in < READWRITE_BUF_SIZE ? (size_t)(end-in) : READWRITE_BUF_SIZE);
+                ssize_t rd = pread_full(fdin, buf, want, in);
+                if ( rd <= 0 ) {
+                    if ( rd < 0 ) ec = errno;
+                    break;
+                }
+                ec = pwrite_full(fdout, buf, rd, out);
+                in += rd;
+                out += rd;
+            }
+            free(buf);
+            break;
+        }
+        /* файл укоротился во время копирования */
+        if ( sz == 0 ) break;
+    }
+    return ec;
+}
+/* проверяет блок на нули */
+#if !defined(__x86_64__)
+static int is_zero_scalar(const unsigned char* p, size_t n) {
+    size_t i;
+    u_int64_t acc = 0;
+    for ( i = 0; i+8 <= n; i += 8 ) acc |= hash_read64(p+i);
+    for ( ; i < n; ++i ) acc |= p[i];
+    return acc == 0;
+}
+#else
+static int is_zero_sse2(const unsigned char* p, size_t n) {
+    __m128i acc = _mm_setzero_si128();
+    size_t i;
+    for ( i = 0; i+64 <= n; i += 64 ) {
+        acc = _mm_or_si128(acc, _mm_or_si128(
+             _mm_or_si128(_mm_loadu_si128((const __m128i*)(p+i)), _mm_loadu_si128((const __m128i*)(p+i+16)))
+            ,_mm_or_si128(_mm_loadu_si128((const __m128i*)(p+i+32)), _mm_loadu_si128((const __m128i*)(p+i+48)))));
+    }
+    if ( _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff ) return 0;
+    for ( ; i < n; ++i ) if ( p[i] ) return 0;
+    return 1;
+}
+__attribute__((target("avx2")))
+static int is_zero_avx2(const unsigned char* p, size_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i;
+    for ( i = 0; i+128 <= n; i += 128 ) {
+        acc = _mm256_or_si256(acc, _mm256_or_si256(
+             _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p+i)), _mm256_loadu_si256((const __m256i*)(p+i+32)))
+            ,_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p+i+64)), _mm256_loadu_si256((const __m256i*)(p+i+96)))));
+    }
+    if ( !_mm256_testz_si256(acc, acc) ) return 0;
+    for ( ; i < n; ++i ) if ( p[i] ) return 0;
+    return 1;
+}
+#endif
+typedef int (*is_zero_proc)(const unsigned char* p, size_t n);
+/* выбирает реализацию под возможности процессора */
+static is_zero_proc is_zero_impl() {
+    static is_zero_proc impl = NULL;
+    if ( !impl ) {
+#if defined(__x86_64__)
+        impl = __builtin_cpu_supports("avx2") ? is_zero_avx2 : is_zero_sse2;
+#else
+        impl = is_zero_scalar;
+#endif
+    }
+    return impl;
+}
+/* копирует диапазон через буфер, пропуская нулевые блоки. файл назначения
+  новый, поэтому пропущенный блок остается дырой */
+static int copy_nonzero(int fdin, int fdout, off_t start, off_t end, void* arg) {
+    is_zero_proc is_zero = is_zero_impl();
+    char* buf = (char*)malloc(READWRITE_BUF_SIZE);
+    off_t off = start;
+    u_int64_t skipped = 0;
+    int ec = 0;
+    (void)arg;
+    while ( !ec && off < end ) {
+        size_t want = throttle_take(end-off < READWRITE_BUF_SIZE ? (size_t)(end-off) : READWRITE_BUF_SIZE);
+        ssize_t rd = pread_full(fdin, buf, want, off);
+        if ( rd < 0 ) {
+            ec = errno;
+            break;
+        }
+        if ( rd == 0 ) break;
+        /* подряд идущие ненулевые блоки пишу одним вызовом */
+        size_t pos = 0;
+        while ( !ec && pos < (size_t)rd ) {
+            size_t run = pos;
+            while ( run < (size_t)rd ) {
+                size_t blk = (size_t)rd-run < SPARSE_BLOCK ? (size_t)rd-run : SPARSE_BLOCK;
+                if ( is_zero((const unsigned char*)buf+run, blk) ) break;
+                run += blk;
+            }
+            if ( run > pos ) {
+                ec = pwrite_full(fdout, buf+pos, run-pos, off+pos);
+                pos = run;
+                continue;
+            }
+            size_t blk = (size_t)rd-pos < SPARSE_BLOCK ? (size_t)rd-pos : SPARSE_BLOCK;
+            skipped += blk;
+            pos += blk;
+        }
+        off += rd;
+    }
+    free(buf);
+    atomic_fetch_add(&sparse_skipped, skipped);
+    return ec;
+}
+/* берет пару выровненных буферов из пула */
+static char* nocache_buf_get() {
+    char* buf;
+    pthread_mutex_lock(&nocache_lock);
+    buf = nocache_pool;
+    if ( buf ) nocache_pool = *(char**)buf;
+    pthread_mutex_unlock(&nocache_lock);
+    if ( !buf ) buf = (char*)aligned_alloc(NOCACHE_ALIGN, 2*NOCACHE_BUF_SIZE);
+    return buf;
+}
+/* возвращает буферы в пул. список свободных хранится в самих буферах */
+static void nocache_buf_put(char* buf) {
+    pthread_mutex_lock(&nocache_lock);
+    *(char**)buf = nocache_pool;
+    nocache_pool = buf;
+    pthread_mutex_unlock(&nocache_lock);
+}
+void nocache_pool_free() {
+    pthread_mutex_lock(&nocache_lock);
+    while ( nocache_pool ) {
+        char* next = *(char**)nocache_pool;
+        free(nocache_pool);
+        nocache_pool = next;
+    }
+    pthread_mutex_unlock(&nocache_lock);
+}
+/* копирует через буфер и не оставляет страниц в кеше: прочитанное сразу
+  выбрасывается, записанное отдается на запись окнами по NOCACHE_WINDOW.
+  предыдущее окно дожидается записи и выбрасывается, пока пишется текущее */
+static int copy_dropcache(int fdin, int fdout, off_t start, off_t end, void* arg) {
+    char* buf = nocache_buf_get();
+    off_t off = start, flushed = start, synced = start;
+    int ec = 0;
+    (void)arg;
+    while ( !ec && off < end ) {
+        size_t want = throttle_take(end-off < NOCACHE_BUF_SIZE ? (size_t)(end-off) : NOCACHE_BUF_SIZE);
+        ssize_t rd = pread_full(fdin, buf, want, off);
+        if ( rd < 0 ) {
+            ec = errno;
+            break;
+        }
+        /* файл укоротился во время копирования */
+        if ( rd == 0 ) break;
+        ec = pwrite_full(fdout, buf, rd, off);
+        posix_fadvise(fdin, off, rd, POSIX_FADV_DONTNEED);
+        off += rd;
+        if ( off-flushed >= NOCACHE_WINDOW ) {
+            sync_file_range(fdout, flushed, off-flushed, SYNC_FILE_RANGE_WRITE);
+            if ( flushed > synced ) {
+                sync_file_range(fdout, synced, flushed-synced,
+                    SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+                posix_fadvise(fdout, synced, flushed-synced, POSIX_FADV_DONTNEED);
+                synced = flushed;
+            }
+            flushed = off;
+        }
+    }
+    if ( off > synced ) {
+        sync_file_range(fdout, synced, off-synced,
+            SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fdout, synced, off-synced, POSIX_FADV_DONTNEED);
+    }
+    nocache_buf_put(buf);
+    return ec;
+}
+/* поток записи при копировании с O_DIRECT */
+static void* direct_write_proc(void* p) {
+    direct_writer* w = (direct_writer*)p;
+    unsigned i = 0;
+    pthread_mutex_lock(&w->lock);
+    while ( 1 ) {
+        while ( !w->full[i] && !w->done ) pthread_cond_wait(&w->cond, &w->lock);
+        if ( !w->full[i] ) break;
+        pthread_mutex_unlock(&w->lock);
+        int ec = w->ec ? 0 : pwrite_full(w->fd, w->buf[i], w->len[i], w->off[i]);
+        pthread_mutex_lock(&w->lock);
+        if ( ec ) w->ec = ec;
+        w->full[i] = 0;
+        pthread_cond_broadcast(&w->cond);
+        i ^= 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+/* копирует выровненный диапазон [start, end) с O_DIRECT через два буфера:
+  пока один пишется отдельным потоком, в другой читается следующий блок.
+  возвращает конец скопированного, меньше end если файл укоротился */
+static int copy_direct_aligned(int fdin, int fdout, off_t start, off_t end, off_t* copied) {
+    direct_writer w;
+    pthread_t writer;
+    char* buf = nocache_buf_get();
+    off_t off = start;
+    unsigned i = 0;
+    int ec = 0, threaded = end-start > NOCACHE_BUF_SIZE;
+    memset(&w, 0, sizeof(w));
+    w.fd = fdout;
+    w.buf[0] = buf;
+    w.buf[1] = buf+NOCACHE_BUF_SIZE;
+    if ( threaded ) {
+        pthread_mutex_init(&w.lock, NULL);
+        pthread_cond_init(&w.cond, NULL);
+        pthread_create(&writer, NULL, direct_write_proc, &w);
+    }
+    while ( off < end ) {
+        if ( threaded ) {
+            pthread_mutex_lock(&w.lock);
+            while ( w.full[i] ) pthread_cond_wait(&w.cond, &w.lock);
+            ec = w.ec;
+            pthread_mutex_unlock(&w.lock);
+            if ( ec ) break;
+        }
+        size_t want = throttle_take(end-off < NOCACHE_BUF_SIZE ? (size_t)(end-off) : NOCACHE_BUF_SIZE);
+        ssize_t rd = pread_full(fdin, w.buf[i], want, off);
+        if ( rd < 0 ) {
+            ec = errno;
+            break;
+        }
+        /* блок, на котором файл закончился, допишет буферизованный путь */
+        size_t len = (size_t)rd & ~(size_t)(NOCACHE_ALIGN-1);
+        if ( len ) {
+            if ( threaded ) {
+                pthread_mutex_lock(&w.lock);
+                w.len[i] = len;
+                w.off[i] = off;
+                w.full[i] = 1;
+                pthread_cond_broadcast(&w.cond);
+                pthread_mutex_unlock(&w.lock);
+            } else if ( 0 != (ec=pwrite_full(fdout, w.buf[i], len, off)) ) {
+                break;
+            }
+            off += len;
+        }
+        if ( (size_t)rd < want ) break;
+        i ^= 1;
+    }
+    if ( threaded ) {
+        pthread_mutex_lock(&w.lock);
+        w.done = 1;
+        pthread_cond_broadcast(&w.cond);
+        pthread_mutex_unlock(&w.lock);
+        pthread_join(writer, NULL);
+        if ( !ec ) ec = w.ec;
+        pthread_mutex_destroy(&w.lock);
+        pthread_cond_destroy(&w.cond);
+    }
+    nocache_buf_put(buf);
+    *copied = off;
+    return ec;
+}
+/* копирует диапазон в обход кеша. выровненная середина идет с O_DIRECT,
+  невыровненные начало и хвост - через copy_dropcache(). если файловая
+  система не поддерживает O_DIRECT, весь диапазон копируется так же */
+int copy_nocache(int fdin, int fdout, off_t start, off_t end, void* arg) {
+    off_t head = (start+NOCACHE_ALIGN-1) & ~(off_t)(NOCACHE_ALIGN-1);
+    off_t tail = end & ~(off_t)(NOCACHE_ALIGN-1);
+    int inflags, outflags, ec = 0;
+    if ( nocache_mode != NOCACHE_DIRECT || head >= tail ) {
+        return copy_dropcache(fdin, fdout, start, end, arg);
+    }
+    inflags = fcntl(fdin, F_GETFL);
+    outflags = fcntl(fdout, F_GETFL);
+    if ( inflags == -1 || outflags == -1
+        || fcntl(fdin, F_SETFL, inflags|O_DIRECT) || fcntl(fdout, F_SETFL, outflags|O_DIRECT) ) {
+        if ( inflags != -1 ) fcntl(fdin, F_SETFL, inflags);
+        return copy_dropcache(fdin, fdout, start, end, arg);
+    }
+    if ( start < head ) {
+        /* начало до границы блока пишу без O_DIRECT */
+        fcntl(fdin, F_SETFL, inflags);
+        fcntl(fdout, F_SETFL, outflags);
+        ec = copy_dropcache(fdin, fdout, start, head, arg);
+        fcntl(fdin, F_SETFL, inflags|O_DIRECT);
+        fcntl(fdout, F_SETFL, outflags|O_DIRECT);
+    }
+    if ( !ec ) ec = copy_direct_aligned(fdin, fdout, head, tail, &tail);
+    fcntl(fdin, F_SETFL, inflags);
+    fcntl(fdout, F_SETFL, outflags);
+    /* O_DIRECT не поддерживается для этих файлов */
+    if ( ec == EINVAL && tail == head ) {
+        return copy_dropcache(fdin, fdout, head, end, arg);
+    }
+    if ( !ec && tail < end ) ec = copy_dropcache(fdin, fdout, tail, end, arg);
+    return ec;
+}
+/* копирует часть файла. файл с дырами - только экстенты данных */
+int copy_chunk(const char* srcname, const char* dstname, u_int64_t offset, u_int64_t length, int delta) {
+    struct stat st;
+    int ec = 0;
+    int fdin = open(srcname, O_RDONLY);
+    if ( fdin == -1 ) return errno;
+    int fdout = open(dstname, delta ? O_RDWR : O_WRONLY);
+    if ( fdout == -1 || fstat(fdin, &st) ) {
+        ec = errno;
+        close(fdin);
+        if ( fdout != -1 ) close(fdout);
+        return ec;
+    }
+    if ( delta ) {
+        u_int64_t written = 0;
+        ec = copy_delta_range(fdin, fdout, offset, offset+length, offset+length, &written);
+        atomic_fetch_add(&delta_written, written);
+    } else if ( is_sparse_copy(&st) ) {
+        /* файл назначения создан нужного размера без выделения места */
+        ec = copy_extents(fdin, fdout, offset, offset+length,
+            sparse_mode == SPARSE_ALWAYS ? copy_nonzero : nocache_mode ? copy_nocache : copy_range_at, NULL);
+    } else {
+        ec = (nocache_mode ? copy_nocache : copy_range_at)(fdin, fdout, offset, offset+length, NULL);
+    }
+    close(fdin);
+    close(fdout);
+    return ec;
+}
+/* копирует диапазон способами копирования с текущей позиции файлов */
+static int copy_span_engines(int fdin, int fdout, off_t start, off_t end, void* arg) {
+    const dev_t* devs = (const dev_t*)arg;
+    off_t offset = start;
+    int first = ENGINE_COPY_FILE_RANGE;
+    if ( copy_engine == ENGINE_AUTO ) {
+        first = engine_cache_get(devs[0], devs[1]);
+        /* клонировать можно только весь файл */
+        if ( first == ENGINE_REFLINK ) first = ENGINE_COPY_FILE_RANGE;
+    }
+    if ( -1 == lseek(fdin, start, SEEK_SET) || -1 == lseek(fdout, start, SEEK_SET) ) return errno;
+    return copy_engines(fdin, fdout, devs[0], devs[1], first, end, &offset);
+}
+/* обходит экстенты данных исходного файла в диапазоне [start, end) и
+  копирует только их. дыры не пишутся */
+int copy_extents(int fdin, int fdout, off_t start, off_t end, copy_span_proc proc, void* arg) {
+    off_t data = start, hole;
+    u_int64_t copied = 0;
+    int ec = 0;
+    while ( data < end ) {
+        off_t next = lseek(fdin, data, SEEK_DATA);
+        if ( next == -1 ) {
+            /* за data только дыра */
+            if ( errno == ENXIO ) break;
+            /* поиск данных не поддерживается, считаю остаток данными */
+            next = data;
+            hole = end;
+        } else {
+            if ( next >= end ) break;
+            hole = lseek(fdin, next, SEEK_HOLE);
+            if ( hole == -1 || hole > end ) hole = end;
+        }
+        if ( (ec=proc(fdin, fdout, next, hole, arg)) ) return ec;
+        copied += hole-next;
+        data = hole;
+    }
+    atomic_fetch_add(&sparse_skipped, (u_int64_t)(end-start)-copied);
+    return 0;
+}
+/* копирует файл с дырами. клон сохраняет дыры сам, иначе копируются
+  только экстенты данных, а размер выставляется ftruncate */
+int copy_sparse(int fdin, int fdout, const struct stat* st) {
+    struct stat dst;
+    dev_t devs[2];
+    off_t offset = 0;
+    int ec;
+    if ( fstat(fdout, &dst) ) return errno;
+    devs[0] = st->st_dev;
+    devs[1] = dst.st_dev;
+    if ( copy_engine == ENGINE_REFLINK
+        || (copy_engine == ENGINE_AUTO && engine_cache_get(devs[0], devs[1]) == ENGINE_REFLINK) ) {
+        ec = copy_reflink(fdin, fdout, st->st_size, &offset);
+        if ( !ec || copy_engine == ENGINE_REFLINK ) return ec;
+        if ( !engine_unsupported(ec) ) return ec;
+        engine_cache_demote(devs[0], devs[1], ENGINE_REFLINK);
+    }
+    ec = copy_extents(fdin, fdout, 0, st->st_size,
+        sparse_mode == SPARSE_ALWAYS ? copy_nonzero : nocache_mode ? copy_nocache : copy_span_engines, devs);
+    if ( !ec && ftruncate(fdout, st->st_size) ) ec = errno;
+    return ec;
+}
+/* файл копируется с учетом дыр: в режиме auto - если занимает меньше
+  блоков, чем его размер, в режиме always - всегда */
+int is_sparse_copy(const struct stat* st) {
+    if ( sparse_mode == SPARSE_NEVER || st->st_size == 0 ) return 0;
+    return sparse_mode == SPARSE_ALWAYS || (u_int64_t)st->st_blocks*512 < (u_int64_t)st->st_size;
+}
+/* разбирает размер: число с необязательным двоичным суффиксом */
+int parse_size(const char* str, u_int64_t* size) {
+    char* end = NULL;
+    unsigned long long v;
+    errno = 0;
+    v = strtoull(str, &end, 10);
+    if ( errno || end == str ) return EINVAL;
+    switch ( *end ) {
+    case 'T': case 't': v <<= 10; /* fallthrough */
+    case 'G': case 'g': v <<= 10; /* fallthrough */
+    case 'M': case 'm': v <<= 10; /* fallthrough */
+    case 'K': case 'k': v <<= 10; ++end; break;
+    case 0: break;
+    default: return EINVAL;
+    }
+    if ( *end ) return EINVAL;
+    *size = v;
+    return 0;
+}
+/* перечитывает файл ограничений, если получен SIGHUP */
+static void throttle_reload() {
+    pthread_mutex_lock(&throttle.lock);
+    if ( limits_reload ) {
+        limits_reload = 0;
+        if ( limits_file && load_limits(limits_file) ) {
+            fprintf(stderr, "error reading limits file \"%s\": %s\n", limits_file, strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&throttle.lock);
+}
+size_t throttle_take(size_t want) {
+    u_int64_t bw, iops;
+    struct timespec now;
+    double elapsed, wait = 0;
+    if ( limits_reload ) throttle_reload();
+    bw = atomic_load_explicit(&throttle.bwlimit, memory_order_relaxed);
+    iops = atomic_load_explicit(&throttle.iopslimit, memory_order_relaxed);
+    if ( !bw && !iops ) return want;
+    if ( bw && want > THROTTLE_CHUNK ) want = THROTTLE_CHUNK;
+    pthread_mutex_lock(&throttle.lock);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec-throttle.last.tv_sec) + (now.tv_nsec-throttle.last.tv_nsec)/1e9;
+    throttle.last = now;
+    /* запас накапливается не больше чем на 100 мс, чтобы после простоя
+      не было всплеска */
+    if ( bw ) {
+        double burst = bw/10 > THROTTLE_CHUNK ? bw/10 : THROTTLE_CHUNK;
+        throttle.bytes += elapsed*bw;
+        if ( throttle.bytes > burst ) throttle.bytes = burst;
+        throttle.bytes -= want;
+        if ( throttle.bytes < 0 ) wait = -throttle.bytes/bw;
+    }
+    if ( iops ) {
+        double burst = iops/10 > 1 ? iops/10 : 1;
+        throttle.ops += elapsed*iops;
+        if ( throttle.ops > burst ) throttle.ops = burst;
+        throttle.ops -= 1;
+        if ( throttle.ops < 0 && -throttle.ops/iops > wait ) wait = -throttle.ops/iops;
+    }
+    pthread_mutex_unlock(&throttle.lock);
+    /* долг уже записан на ведро, поэтому следующие потоки ждут дольше */
+    if ( wait > 0 ) {
+        struct timespec ts = {(time_t)wait, (long)((wait-(time_t)wait)*1e9)};
+        while ( nanosleep(&ts, &ts) && errno == EINTR );
+    }
+    return want;
+}
+/* файл ограничений - строки вида bwlimit=10M и iops-limit=200.
+  отсутствующий параметр снимает ограничение */
+int load_limits(const char* path) {
+    char line[256];
+    u_int64_t bw = 0, iops = 0;
+    FILE* f = fopen(path, "r");
+    if ( !f ) return errno;
+    while ( fgets(line, sizeof(line), f) ) {
+        char* val = strchr(line, '=');
+        line[strcspn(line, "\r\n")] = 0;
+        if ( !line[0] || line[0] == '#' ) continue;
+        if ( !val ) {
+            fclose(f);
+            return EINVAL;
+        }
+        *val++ = 0;
+        if ( 0 == strcmp(line, "bwlimit") ? parse_size(val, &bw)
+            : 0 == strcmp(line, "iops-limit") ? parse_size(val, &iops)
+            : EINVAL ) {
+            fclose(f);
+            return EINVAL;
+        }
+    }
+    fclose(f);
+    atomic_store(&throttle.bwlimit, bw);
+    atomic_store(&throttle.iopslimit, iops);
+    return 0;
+}
+void limits_signal(int sig) {
+    (void)sig;
+    limits_reload = 1;
+}
+
+void get_dirinfo(dirinfo *di, const filetable* ft) {
+    u_int64_t size = 0;
+    u_int64_t i;
+    for ( i = 0; i < ft->nfiles; ++i ) {
+        size += ft->files[i].size;
+    }
+
+    di->nfiles = ft->nfiles;
+    di->size = size;
+}
+
+void get_copyinfo(dirinfo *di, const copylist* cl) {
+    u_int64_t size = 0;
+    u_int64_t i;
+    for ( i = 0; i < cl->count; ++i ) {
+        size += cl->src->files[cl->idx[i]].size;
+    }
+
+    di->nfiles = cl->count;
+    di->size = size;
+}
+
+const char* readable_fs(char *buf, u_int64_t fsize) {
+    double size = (double)fsize;
+    unsigned i = 0;
+    static const char* units[] = {"B", "kB", "MB", "GB", "TB", "PB", "EB", "ZB", "YB"};
+    while (size > 1024u) {
+        size /= 1024u;
+        i++;
+    }
+
+    sprintf(buf, "%.*f %s", i, size, units[i]);
+
+    return buf;
+}
+
+const char* readable_pthread_t(char *buf, pthread_t pt) {
+    char *p = buf;
+    unsigned char *ptc = (unsigned char*)(void*)(&pt);
+    int n = sprintf(p, "0x");
+    p += n;
+    for ( size_t i = 0; i < sizeof(pt); i++ ) {
+        n = sprintf(p, "%02x", (unsigned)(ptc[i]));
+        p += n;
+    }
+    *p = 0;
+    return buf;
+}
+
+void free_filetable(filetable* ft) {
+    if ( ft->map ) {
+        munmap(ft->map, ft->mapsize);
+    } else {
+        free(ft->files);
+        free(ft->dirs);
+        free(ft->pool);
+        free(ft->hashes);
+    }
+    ft->files = NULL;
+    ft->dirs = NULL;
+    ft->pool = NULL;
+    ft->hashes = NULL;
+    ft->islots = ft->ihashes = NULL;
+    ft->map = NULL;
+    ft->nfiles = ft->cap = 0;
+    ft->ndirs = ft->dircap = 0;
+    ft->poolsize = ft->poolcap = 0;
+    ft->nslots = ft->mapsize = 0;
+}
+
+void free_copylist(copylist* cl) {
+    free(cl->idx);
+    cl->idx = NULL;
+    cl->count = cl->cap = 0;
+}
+
+/***************************************************************************/
+/* копирование в несколько каталогов назначения */
+/* копирует открытый файл в одно назначение так же, как copy_file */
+static int fanout_copy_one(int fdin, const struct stat* st, const char* dstname) {
+    int fdout, ec;
+    if ( -1 == lseek(fdin, 0, SEEK_SET) ) return errno;
+    if ( atomic_batch ) return copy_file_atomic(fdin, st, dstname);
+    fdout = open(dstname, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if ( fdout == -1 ) return errno;
+    ec = copy_data(fdin, fdout, st);
+    if ( !ec ) {
+        struct timespec ts[2] = {
+             st->st_atim
+            ,st->st_mtim
+        };
+        futimens(fdout, ts);
+    }
+    close(fdout);
+    return ec;
+}
+/* копирует файл во все каталоги назначения из маски, читая его один раз.
+  ошибка одного назначения не мешает остальным, она попадает в errs.
+  тайм штамп источника получают только целые копии */
+static int fanout_copy_file(const char* srcname, char** dstnames, unsigned ndst, u_int32_t mask, int* errs, char* buf) {
+    int fds[MAX_DESTINATIONS];
+    struct stat st;
+    unsigned k, nopen = 0;
+    off_t off = 0;
+    int ec = 0;
+    int fdin = open(srcname, O_RDONLY);
+    if ( fdin == -1 ) return errno;
+    if ( fstat(fdin, &st) ) {
+        ec = errno;
+        close(fdin);
+        return ec;
+    }
+    /* атомарная замена, разреженный файл, --no-cache, выбранный способ
+      копирования и автонастройка пишут каждое назначение своим способом,
+      тогда файл читается для каждого назначения отдельно */
+    if ( atomic_batch || nocache_mode || autotune || copy_engine != ENGINE_AUTO || is_sparse_copy(&st) ) {
+        for ( k = 0; k < ndst; ++k ) {
+            errs[k] = mask & (1u << k) ? fanout_copy_one(fdin, &st, dstnames[k]) : 0;
+        }
+        close(fdin);
+        return 0;
+    }
+    for ( k = 0; k < ndst; ++k ) {
+        fds[k] = -1;
+        errs[k] = 0;
+        if ( !(mask & (1u << k)) ) continue;
+        fds[k] = open(dstnames[k], O_WRONLY|O_CREAT|O_TRUNC, 0666);
+        if ( fds[k] == -1 ) errs[k] = errno;
+        else nopen++;
+    }
+    while ( nopen && off < st.st_size ) {
+        size_t want = throttle_take(st.st_size-off < READWRITE_BUF_SIZE ? (size_t)(st.st_size-off) : READWRITE_BUF_SIZE);
+        ssize_t rd = pread_full(fdin, buf, want, off);
+        if ( rd < 0 ) {
+            ec = errno;
+            break;
+        }
+        /* файл укоротился во время копирования */
+        if ( rd == 0 ) break;
+        for ( k = 0; k < ndst; ++k ) {
+            if ( fds[k] == -1 ) continue;
+            if ( 0 != (errs[k]=pwrite_full(fds[k], buf, rd, off)) ) {
+                close(fds[k]);
+                fds[k] = -1;
+                nopen--;
+            }
+        }
+        off += rd;
+    }
+    /* укоротившийся файл - ошибка, иначе копия выглядела бы актуальной */
+    if ( !ec && nopen && off < st.st_size ) ec = EIO;
+    for ( k = 0; k < ndst; ++k ) {
+        if ( fds[k] == -1 ) continue;
+        if ( !ec ) {
+            struct timespec ts[2] = {
+                 st.st_atim
+                ,st.st_mtim
+            };
+            futimens(fds[k], ts);
+        }
+        close(fds[k]);
+    }
+    close(fdin);
+    return ec;
+}
+/* функция потока копирования в несколько каталогов */
+static void* fanout_thread_proc(void* p) {
+    fanout* f = (fanout*)p;
+    worker_stat* ws = &stats.workers[atomic_fetch_add(&f->nextstat, 1)];
+    char* buf = (char*)malloc(READWRITE_BUF_SIZE);
+    char* dstnames[MAX_DESTINATIONS];
+    int errs[MAX_DESTINATIONS];
+    u_int64_t i;
+    unsigned k;
+    while ( (i=atomic_fetch_add_explicit(&f->cursor, 1, memory_order_relaxed)) < f->files.count ) {
+        const fileentry* node = &f->src->files[f->files.idx[i]];
+        const char* relname = file_name(f->src, node);
+        u_int32_t mask = f->need[f->files.idx[i]];
+        struct timespec started;
+        int err, failed = 0;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        char* srcname = make_filename(f->src->root, relname);
+        for ( k = 0; k < f->ndst; ++k ) {
+            dstnames[k] = mask & (1u << k) ? make_filename(f->dsts[k]->root, relname) : NULL;
+        }
+        if ( !quiet ) printf("copying: %s\n", srcname);
+        if ( 0 != (err=fanout_copy_file(srcname, dstnames, f->ndst, mask, errs, buf)) ) {
+            fprintf(stderr, "error: %s: %s\n", srcname, strerror(err));
+            f->failed[f->files.idx[i]] = mask;
+            failed = 1;
+        }
+        for ( k = 0; k < f->ndst; ++k ) {
+            if ( !dstnames[k] ) continue;
+            if ( !err && errs[k] ) {
+                fprintf(stderr, "error: %s: %s\n", dstnames[k], strerror(errs[k]));
+                f->failed[f->files.idx[i]] |= 1u << k;
+                failed = 1;
+            }
+            free(dstnames[k]);
+        }
+        if ( failed ) {
+            atomic_fetch_add(&copy_errors, 1);
+            atomic_store_explicit(&ws->errors, atomic_load_explicit(&ws->errors, memory_order_relaxed)+1, memory_order_relaxed);
+        } else {
+            stat_copied(ws, node->size, &started, 1);
+        }
+        free(srcname);
+    }
+    free(buf);
+    clock_gettime(CLOCK_MONOTONIC, &ws->finished);
+    return NULL;
+}
+/* синхронизирует исходный каталог с ndst каталогами назначения. исходный
+  каталог сканируется один раз вместе со всеми назначениями, каждое
+  назначение сравнивается с ним отдельно, а каждый изменившийся файл
+  читается один раз и пишется во все назначения, которым он нужен */
+int run_fanout(const char* srcdir, const char** dstdirs, unsigned ndst, unsigned nthreads, int show_info) {
+    filetable** tables = (filetable**)malloc((ndst+1)*sizeof(filetable*));
+    phase_stat* times = (phase_stat*)calloc(ndst+1, sizeof(phase_stat));
+    copylist* results = (copylist*)calloc(ndst, sizeof(copylist));
+    /* копируемые в каждое назначение файлы без имен, создаваемых ссылками */
+    copylist* work = (copylist*)calloc(ndst, sizeof(copylist));
+    hardlinks* links = (hardlinks*)calloc(ndst, sizeof(hardlinks));
+    pthread_t* threads;
+    char sizebuf[32];
+    phase_clock pc;
+    dirinfo tocopy;
+    fanout f;
+    u_int64_t i;
+    unsigned k;
+    int ret = 0;
+
+    memset(&f, 0, sizeof(f));
+    for ( k = 0; k <= ndst; ++k ) {
+        tables[k] = (filetable*)calloc(1, sizeof(filetable));
+        tables[k]->root = k ? dstdirs[k-1] : srcdir;
+    }
+    f.src = tables[0];
+    f.dsts = tables+1;
+    f.ndst = ndst;
+
+    /* все деревья читаются одним сканером */
+    if ( 0 != read_dir_trees(tables, ndst+1, nthreads, times) ) {
+        ret = 1;
+        goto out;
+    }
+    stats.phases[PHASE_SCAN_SRC] = times[0];
+    stats.phases[PHASE_SCAN_DST] = times[1];
+    for ( k = 2; k <= ndst; ++k ) {
+        if ( times[k].wall > stats.phases[PHASE_SCAN_DST].wall ) stats.phases[PHASE_SCAN_DST].wall = times[k].wall;
+        stats.phases[PHASE_SCAN_DST].cpu += times[k].cpu;
+    }
+
+    /* сравниваю каждое назначение с исходным каталогом */
+    phase_begin(&pc);
+    for ( k = 0, i = 0; k < ndst; ++k ) {
+        get_difference(&results[k], f.src, f.dsts[k], nthreads);
+        i += results[k].count;
+        if ( show_info ) {
+            get_copyinfo(&tocopy, &results[k]);
+            printf("%s: need to copy %" PRIu64 " files with total size %s\n",
+                   dstdirs[k], tocopy.nfiles, readable_fs(sizebuf, tocopy.size));
+        }
+    }
+    phase_end(PHASE_DIFF, &pc);
+    if ( !i ) {
+        if ( !quiet ) printf("\nthe directories are identical. terminate.\n");
+        goto out;
+    }
+
+    atomic_init(&copy_errors, 0);
+    atomic_init(&sparse_skipped, 0);
+    atomic_init(&links_created, 0);
+    phase_begin(&pc);
+    for ( k = 0; k < ndst; ++k ) {
+        if ( 0 != create_dst_skeleton(f.src, f.dsts[k], dstdirs[k], nthreads) ) {
+            atomic_fetch_add(&copy_errors, 1);
+        }
+    }
+    phase_end(PHASE_MKDIR, &pc);
+
+    /* жесткие ссылки разбираются для каждого назначения отдельно, маски
+      собираются по файлам, которые действительно нужно копировать */
+    phase_begin(&pc);
+    f.need = (u_int32_t*)calloc(f.src->nfiles ? f.src->nfiles : 1, sizeof(u_int32_t));
+    f.failed = (u_int32_t*)calloc(f.src->nfiles ? f.src->nfiles : 1, sizeof(u_int32_t));
+    for ( k = 0; k < ndst; ++k ) {
+        sort_copylist(&results[k], copy_order);
+        build_hardlinks(&links[k], &work[k], &results[k], dstdirs[k]);
+        for ( i = 0; i < work[k].count; ++i ) f.need[work[k].idx[i]] |= 1u << k;
+    }
+    f.files.src = f.src;
+    for ( i = 0; i < f.src->nfiles; ++i ) {
+        if ( f.need[i] ) copylist_add(&f.files, i);
+    }
+    sort_copylist(&f.files, copy_order);
+    get_copyinfo(&tocopy, &f.files);
+    stats.files = tocopy.nfiles;
+    stats.bytes = tocopy.size;
+    free(stats.workers);
+    stats.workers = (worker_stat*)aligned_alloc(64, nthreads*sizeof(worker_stat));
+    memset(stats.workers, 0, nthreads*sizeof(worker_stat));
+    stats.nworkers = nthreads;
+    atomic_init(&f.cursor, 0);
+    atomic_init(&f.nextstat, 0);
+    threads = (pthread_t*)malloc(nthreads*sizeof(pthread_t));
+    for ( k = 0; k < nthreads; ++k ) {
+        pthread_create(&threads[k], NULL, fanout_thread_proc, &f);
+    }
+    for ( k = 0; k < nthreads; ++k ) {
+        pthread_join(threads[k], NULL);
+    }
+    free(threads);
+    /* остальные имена скопированных файлов становятся ссылками на них */
+    for ( k = 0; k < ndst; ++k ) {
+        thread_data td;
+        if ( !links[k].ngroups ) continue;
+        memset(&td, 0, sizeof(td));
+        td.files = &work[k];
+        td.links = &links[k];
+        td.srcdir = srcdir;
+        td.dstdir = dstdirs[k];
+        for ( i = 0; i < work[k].count; ++i ) {
+            if ( !links[k].group[i] ) continue;
+            link_copied(&td, i, !(f.failed[work[k].idx[i]] & (1u << k)), &stats.workers[0]);
+        }
+    }
+    for ( k = 0; k < ndst; ++k ) atomic_finish(dstdirs[k]);
+    phase_end(PHASE_COPY, &pc);
+    if ( show_info ) {
+        printf("read %" PRIu64 " files with total size %s once for %u destinations\n",
+               tocopy.nfiles, readable_fs(sizebuf, tocopy.size), ndst);
+        if ( atomic_load(&sparse_skipped) ) {
+            printf("sparse: skipped %s of holes and zero blocks\n", readable_fs(sizebuf, atomic_load(&sparse_skipped)));
+        }
+        if ( atomic_load(&links_created) ) {
+            printf("hard links: created %" PRIu64 " names as links\n", (u_int64_t)atomic_load(&links_created));
+        }
+    }
+    ret = atomic_load(&copy_errors) ? 1 : 0;
+
+out:
+    for ( k = 0; k <= ndst; ++k ) {
+        free_filetable(tables[k]);
+        free(tables[k]);
+    }
+    for ( k = 0; k < ndst; ++k ) {
+        free_copylist(&results[k]);
+        free_copylist(&work[k]);
+        free_hardlinks(&links[k]);
+    }
+    free_copylist(&f.files);
+    free(f.need);
+    free(f.failed);
+    free(results);
+    free(work);
+    free(links);
+    free(times);
+    free(tables);
+    return ret;
+}
+
+/***************************************************************************/
+/* сетевой режим: сервер отдает список своего дерева, клиент сравнивает
+  с ним исходный каталог и одним потоком сообщений передает каталоги и
+  файлы. подтверждений по файлам нет, итог сервер присылает в конце */
+static int net_write_all(int fd, const void* data, size_t size) {
+    const char* p = (const char*)data;
+    while ( size ) {
+        ssize_t wr = write(fd, p, size);
+        if ( wr < 0 ) {
+            if ( errno == EINTR ) continue;
+            return errno;
+        }
+        p += wr;
+        size -= wr;
+    }
+    return 0;
+}
+/* читает ровно size байт: сначала из буфера, остальное из сокета */
+static int net_read(net_reader* r, void* data, size_t size) {
+    char* p = (char*)data;
+    while ( size ) {
+        if ( r->pos == r->len ) {
+            ssize_t rd = read(r->fd, r->buf, NET_BUF_SIZE);
+            if ( rd < 0 ) {
+                if ( errno == EINTR ) continue;
+                return errno;
+            }
+            if ( rd == 0 ) return ECONNRESET;
+            r->pos = 0;
+            r->len = (size_t)rd;
+        }
+        size_t n = r->len-r->pos < size ? r->len-r->pos : size;
+        memcpy(p, r->buf+r->pos, n);
+        r->pos += n;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+/* дописывает данные в пакет, при заполнении отправляет его */
+static int net_put(net_writer* w, const void* data, size_t size) {
+    const char* p = (const char*)data;
+    while ( size ) {
+        size_t n = NET_BUF_SIZE-w->len < size ? NET_BUF_SIZE-w->len : size;
+        memcpy(w->buf+w->len, p, n);
+        w->len += n;
+        p += n;
+        size -= n;
+        if ( w->len == NET_BUF_SIZE ) {
+            int ec = net_write_all(w->fd, w->buf, w->len);
+            w->len = 0;
+            if ( ec ) return ec;
+        }
+    }
+    return 0;
+}
+static int net_flush(net_writer* w) {
+    int ec = w->len ? net_write_all(w->fd, w->buf, w->len) : 0;
+    w->len = 0;
+    return ec;
+}
+/* имя от клиента должно начинаться с '/' и не выходить за корень */
+static int net_name_ok(const char* name) {
+    const char* p = name;
+    if ( *p != '/' ) return 0;
+    while ( *p ) {
+        const char* next = strchr(p+1, '/');
+        size_t len = next ? (size_t)(next-p-1) : strlen(p+1);
+        if ( len == 0 || (len == 1 && p[1] == '.') || (len == 2 && p[1] == '.' && p[2] == '.') ) return 0;
+        if ( !next ) break;
+        p = next;
+    }
+    return 1;
+}
+/* SHA-256 для проверки общего секрета. данные не шифруются, секрет по
+  сети не передается: клиент отвечает HMAC от случайного вызова сервера */
+typedef struct sha256_state {
+    u_int32_t h[8];
+    unsigned char block[64];
+    u_int64_t len; /* обработано байт */
+} sha256_state;
+
+static const u_int32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32-(n))))
+
+static void sha256_init(sha256_state* s) {
+    static const u_int32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(s->h, iv, sizeof(iv));
+    s->len = 0;
+}
+static void sha256_block(sha256_state* s, const unsigned char* p) {
+    u_int32_t w[64], v[8], t1, t2;
+    unsigned i;
+    for ( i = 0; i < 16; ++i ) w[i] = (u_int32_t)p[4*i] << 24 | (u_int32_t)p[4*i+1] << 16 | (u_int32_t)p[4*i+2] << 8 | p[4*i+3];
+    for ( ; i < 64; ++i ) {
+        u_int32_t s0 = SHA256_ROR(w[i-15], 7) ^ SHA256_ROR(w[i-15], 18) ^ (w[i-15] >> 3);
+        u_int32_t s1 = SHA256_ROR(w[i-2], 17) ^ SHA256_ROR(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    memcpy(v, s->h, sizeof(v));
+    for ( i = 0; i < 64; ++i ) {
+        t1 = v[7] + (SHA256_ROR(v[4], 6) ^ SHA256_ROR(v[4], 11) ^ SHA256_ROR(v[4], 25))
+            + ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+        t2 = (SHA256_ROR(v[0], 2) ^ SHA256_ROR(v[0], 13) ^ SHA256_ROR(v[0], 22))
+            + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        memmove(v+1, v, 7*sizeof(u_int32_t));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for ( i = 0; i < 8; ++i ) s->h[i] += v[i];
+}
+static void sha256_update(sha256_state* s, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    while ( len ) {
+        size_t used = s->len % 64, n = 64-used < len ? 64-used : len;
+        memcpy(s->block+used, p, n);
+        s->len += n;
+        p += n;
+        len -= n;
+        if ( s->len % 64 == 0 ) sha256_block(s, s->block);
+    }
+}
+static void sha256_final(sha256_state* s, unsigned char* out) {
+    u_int64_t bits = s->len*8;
+    unsigned char tail[8];
+    unsigned i;
+    sha256_update(s, "\x80", 1);
+    while ( s->len % 64 != 56 ) sha256_update(s, "", 1);
+    for ( i = 0; i < 8; ++i ) tail[i] = (unsigned char)(bits >> (56-8*i));
+    sha256_update(s, tail, 8);
+    for ( i = 0; i < 32; ++i ) out[i] = (unsigned char)(s->h[i/4] >> (24-8*(i%4)));
+}
+/* HMAC-SHA256 по RFC 2104 */
+static void hmac_sha256(const char* key, size_t keylen, const void* data, size_t len, unsigned char* out) {
+    unsigned char k[64], pad[64], inner[32];
+    sha256_state s;
+    unsigned i;
+    memset(k, 0, sizeof(k));
+    if ( keylen > 64 ) {
+        sha256_init(&s);
+        sha256_update(&s, key, keylen);
+        sha256_final(&s, k);
+    } else {
+        memcpy(k, key, keylen);
+    }
+    for ( i = 0; i < 64; ++i ) pad[i] = k[i] ^ 0x36;
+    sha256_init(&s);
+    sha256_update(&s, pad, 64);
+    sha256_update(&s, data, len);
+    sha256_final(&s, inner);
+    for ( i = 0; i < 64; ++i ) pad[i] = k[i] ^ 0x5c;
+    sha256_init(&s);
+    sha256_update(&s, pad, 64);
+    sha256_update(&s, inner, 32);
+    sha256_final(&s, out);
+}
+int net_load_secret(const char* path, char* secret, size_t size) {
+    ssize_t len;
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if ( fd == -1 ) return errno;
+    len = read(fd, secret, size-1);
+    close(fd);
+    if ( len < 0 ) return errno;
+    secret[len] = 0;
+    secret[strcspn(secret, "\r\n")] = 0;
+    return secret[0] ? 0 : EINVAL;
+}
+/* проверка клиента: сервер шлет случайный вызов, клиент отвечает HMAC от
+  него с общим секретом */
+static int net_auth_server(net_reader* r, const char* secret) {
+    unsigned char nonce[NET_NONCE_SIZE], answer[32], expected[32], diff = 0;
+    size_t got = 0;
+    unsigned i;
+    int ec;
+    while ( got < sizeof(nonce) ) {
+        ssize_t n = getrandom(nonce+got, sizeof(nonce)-got, 0);
+        if ( n < 0 ) {
+            if ( errno == EINTR ) continue;
+            return errno;
+        }
+        got += n;
+    }
+    if ( 0 != (ec=net_write_all(r->fd, nonce, sizeof(nonce))) ) return ec;
+    if ( 0 != (ec=net_read(r, answer, sizeof(answer))) ) return ec;
+    hmac_sha256(secret, strlen(secret), nonce, sizeof(nonce), expected);
+    /* сравнение за постоянное время */
+    for ( i = 0; i < sizeof(expected); ++i ) diff |= answer[i] ^ expected[i];
+    return diff ? EACCES : 0;
+}
+static int net_auth_client(net_reader* r, const char* secret) {
+    unsigned char nonce[NET_NONCE_SIZE], answer[32];
+    int ec;
+    if ( 0 != (ec=net_read(r, nonce, sizeof(nonce))) ) return ec;
+    hmac_sha256(secret, strlen(secret), nonce, sizeof(nonce), answer);
+    return net_write_all(r->fd, answer, sizeof(answer));
+}
+/* открывает родительский каталог имени /a/b/c внутри dstfd, не проходя
+  по символическим ссылкам и не выходя за dstfd. в last возвращает
+  последний компонент. ядра без openat2 проходят путь по компонентам */
+static int net_open_parent(int dstfd, const char* name, const char** last) {
+    const char* slash = strrchr(name, '/');
+    struct open_how how;
+    char* dir;
+    int fd;
+    *last = slash+1;
+    if ( slash == name ) return dup(dstfd);
+    dir = strndup(name+1, slash-name-1);
+    memset(&how, 0, sizeof(how));
+    how.flags = O_PATH|O_DIRECTORY|O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH|RESOLVE_NO_SYMLINKS|RESOLVE_NO_MAGICLINKS;
+    fd = (int)syscall(SYS_openat2, dstfd, dir, &how, sizeof(how));
+    if ( fd == -1 && errno == ENOSYS ) {
+        char* comp = dir;
+        fd = dup(dstfd);
+        while ( fd != -1 && comp ) {
+            char* next = strchr(comp, '/');
+            int sub;
+            if ( next ) *next++ = 0;
+            sub = openat(fd, comp, O_PATH|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+            close(fd);
+            fd = sub;
+            comp = next;
+        }
+    }
+    free(dir);
+    return fd;
+}
+/* разбирает [HOST:]PORT, возвращает адрес через getaddrinfo. сервер без
+  явного адреса слушает только loopback */
+static int net_resolve(const char* spec, struct addrinfo** res) {
+    char host[256] = {0};
+    const char* port = strrchr(spec, ':');
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ( port ) {
+        size_t len = (size_t)(port-spec);
+        /* адрес IPv6 в квадратных скобках */
+        if ( len >= 2 && spec[0] == '[' && spec[len-1] == ']' ) {
+            spec++;
+            len -= 2;
+        }
+        if ( len >= sizeof(host) ) return EINVAL;
+        memcpy(host, spec, len);
+        port++;
+    } else {
+        port = spec;
+    }
+    return getaddrinfo(host[0] ? host : "127.0.0.1", port, &hints, res) ? EINVAL : 0;
+}
+/* отправляет таблицу файлов: заголовок, описания файлов и каталогов, пул имен */
+static int net_send_list(int fd, const filetable* ft) {
+    net_writer w;
+    net_list_header h;
+    u_int64_t i;
+    int ec;
+    w.fd = fd;
+    w.len = 0;
+    w.buf = (char*)malloc(NET_BUF_SIZE);
+    memcpy(h.magic, NET_MAGIC, 8);
+    h.nfiles = htole64(ft->nfiles);
+    h.ndirs = htole64(ft->ndirs);
+    h.poolsize = htole64(ft->poolsize);
+    ec = net_put(&w, &h, sizeof(h));
+    for ( i = 0; !ec && i < ft->nfiles; ++i ) {
+        net_entry e;
+        e.name = htole64(ft->files[i].name);
+        e.size = htole64(ft->files[i].size);
+        e.date = htole64((u_int64_t)ft->files[i].date);
+        e.date_ns = htole32(ft->files[i].date_ns);
+        e.pad = 0;
+        ec = net_put(&w, &e, sizeof(e));
+    }
+    for ( i = 0; !ec && i < ft->ndirs; ++i ) {
+        net_entry e;
+        e.name = htole64(ft->dirs[i].name);
+        e.size = 0;
+        e.date = htole64((u_int64_t)ft->dirs[i].date);
+        e.date_ns = htole32(ft->dirs[i].date_ns);
+        e.pad = 0;
+        ec = net_put(&w, &e, sizeof(e));
+    }
+    if ( !ec ) ec = net_put(&w, ft->pool, ft->poolsize);
+    if ( !ec ) ec = net_flush(&w);
+    free(w.buf);
+    return ec;
+}
+/* принимает таблицу файлов сервера */
+static int net_recv_list(net_reader* r, filetable* ft) {
+    net_list_header h;
+    u_int64_t i;
+    int ec;
+    if ( 0 != (ec=net_read(r, &h, sizeof(h))) ) return ec;
+    if ( memcmp(h.magic, NET_MAGIC, 8) ) return EPROTO;
+    ft->nfiles = ft->cap = le64toh(h.nfiles);
+    ft->ndirs = ft->dircap = le64toh(h.ndirs);
+    ft->poolsize = ft->poolcap = le64toh(h.poolsize);
+    ft->files = (fileentry*)calloc(ft->nfiles ? ft->nfiles : 1, sizeof(fileentry));
+    ft->dirs = (direntry*)calloc(ft->ndirs ? ft->ndirs : 1, sizeof(direntry));
+    ft->pool = (char*)malloc(ft->poolsize ? ft->poolsize : 1);
+    if ( !ft->files || !ft->dirs || !ft->pool ) return ENOMEM;
+    for ( i = 0; !ec && i < ft->nfiles+ft->ndirs; ++i ) {
+        net_entry e;
+        if ( 0 != (ec=net_read(r, &e, sizeof(e))) ) break;
+        if ( le64toh(e.name) >= ft->poolsize ) return EPROTO;
+        if ( i < ft->nfiles ) {
+            fileentry* f = &ft->files[i];
+            f->name = le64toh(e.name);
+            f->size = le64toh(e.size);
+            f->date = (time_t)le64toh(e.date);
+            f->date_ns = le32toh(e.date_ns);
+        } else {
+            direntry* d = &ft->dirs[i-ft->nfiles];
+            d->name = le64toh(e.name);
+            d->date = (time_t)le64toh(e.date);
+            d->date_ns = le32toh(e.date_ns);
+        }
+    }
+    if ( !ec ) ec = net_read(r, ft->pool, ft->poolsize);
+    /* пул должен заканчиваться завершающим нулем */
+    if ( !ec && ft->poolsize && ft->pool[ft->poolsize-1] ) ec = EPROTO;
+    return ec;
+}
+/* принимает данные файла из потока и пишет их в fd. если fd == -1,
+  данные пропускаются, чтобы не сбить разбор следующих сообщений */
+static int net_recv_data(net_reader* r, int fd, u_int64_t size, int* werr) {
+    off_t off = 0;
+    while ( size ) {
+        if ( r->pos == r->len ) {
+            ssize_t rd = read(r->fd, r->buf, NET_BUF_SIZE);
+            if ( rd < 0 ) {
+                if ( errno == EINTR ) continue;
+                return errno;
+            }
+            if ( rd == 0 ) return ECONNRESET;
+            r->pos = 0;
+            r->len = (size_t)rd;
+        }
+        size_t n = r->len-r->pos < size ? r->len-r->pos : (size_t)size;
+        if ( fd != -1 && !*werr ) *werr = pwrite_full(fd, r->buf+r->pos, n, off);
+        r->pos += n;
+        off += n;
+        size -= n;
+    }
+    return 0;
+}
+/* обслуживает одного клиента: сканирует свое дерево, отдает список,
+  принимает каталоги и файлы до сообщения об окончании */
+static int serve_session(int fd, const char* dstdir, unsigned nthreads, const char* secret) {
+    net_reader r;
+    net_msg m;
+    net_result res;
+    filetable ft;
+    filetable* tables[1] = {&ft};
+    u_int64_t files = 0, errors = 0;
+    char* name = NULL;
+    size_t namecap = 0;
+    int ec, dstfd;
+    char magic[8];
+
+    r.fd = fd;
+    r.pos = r.len = 0;
+    r.buf = (char*)malloc(NET_BUF_SIZE);
+    if ( 0 != (ec=net_read(&r, magic, sizeof(magic))) || memcmp(magic, NET_MAGIC, 8) ) {
+        free(r.buf);
+        return ec ? ec : EPROTO;
+    }
+    /* до проверки секрета клиент не получает ни списка, ни права записи */
+    if ( 0 != (ec=net_auth_server(&r, secret)) ) {
+        free(r.buf);
+        return ec;
+    }
+    memset(&ft, 0, sizeof(ft));
+    ft.root = dstdir;
+    if ( read_dir_trees(tables, 1, nthreads, NULL) ) {
+        free(r.buf);
+        return EIO;
+    }
+    ec = net_send_list(fd, &ft);
+    free_filetable(&ft);
+    dstfd = open(dstdir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if ( dstfd == -1 ) ec = errno;
+    while ( !ec ) {
+        if ( 0 != (ec=net_read(&r, &m, sizeof(m))) ) break;
+        u_int32_t type = le32toh(m.type), namelen = le32toh(m.namelen);
+        if ( type == NET_END ) break;
+        if ( namelen == 0 || namelen > PATH_MAX ) {
+            ec = EPROTO;
+            break;
+        }
+        if ( namelen+1 > namecap ) {
+            namecap = namelen+1;
+            name = (char*)realloc(name, namecap);
+        }
+        if ( 0 != (ec=net_read(&r, name, namelen)) ) break;
+        name[namelen] = 0;
+        int ok = net_name_ok(name);
+        if ( !ok ) fprintf(stderr, "error: rejected name \"%s\"\n", name);
+        /* символические ссылки в пути не проходятся, иначе клиент мог бы
+          писать за пределы dstdir через ссылку, уже лежащую в нем */
+        const char* last = NULL;
+        int pfd = ok ? net_open_parent(dstfd, name, &last) : -1;
+        int perr = ok && pfd == -1 ? errno : 0;
+        if ( type == NET_MKDIR ) {
+            if ( ok && (perr || (mkdirat(pfd, last, S_IRWXU|S_IRWXG|S_IRWXO) && errno != EEXIST)) ) {
+                fprintf(stderr, "error: %s%s: %s\n", dstdir, name, strerror(perr ? perr : errno));
+                errors++;
+            }
+        } else if ( type == NET_FILE ) {
+            int werr = perr;
+            int out = pfd != -1 ? openat(pfd, last, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC, 0666) : -1;
+            if ( pfd != -1 && out == -1 ) werr = errno;
+            net_file_end fe;
+            ec = net_recv_data(&r, out, le64toh(m.size), &werr);
+            if ( !ec ) ec = net_read(&r, &fe, sizeof(fe));
+            if ( !ec && !werr && fe.error ) werr = (int)le32toh(fe.error);
+            if ( out != -1 ) {
+                /* тайм штамп источника получает только целый файл. оборванный
+                  или добитый нулями удаляю, иначе при сравнении по дате
+                  он выглядел бы актуальным и больше не копировался */
+                if ( !ec && !werr && ok ) {
+                    struct timespec ts[2] = {
+                         {0, UTIME_OMIT}
+                        ,{(time_t)le64toh(m.date), le32toh(m.date_ns)}
+                    };
+                    futimens(out, ts);
+                } else {
+                    unlinkat(pfd, last, 0);
+                }
+                close(out);
+            }
+            if ( ec && !werr ) werr = ec;
+            if ( werr || !ok ) {
+                if ( werr ) fprintf(stderr, "error: %s%s: %s\n", dstdir, name, strerror(werr));
+                errors++;
+            } else {
+                if ( !quiet ) printf("received: %s\n", name);
+                files++;
+            }
+        } else {
+            ec = EPROTO;
+        }
+        if ( pfd != -1 ) close(pfd);
+    }
+    if ( dstfd != -1 ) close(dstfd);
+    if ( !ec ) {
+        res.files = htole64(files);
+        res.errors = htole64(errors);
+        ec = net_write_all(fd, &res, sizeof(res));
+    }
+    free(name);
+    free(r.buf);
+    return ec;
+}
+/* принимает клиентов по очереди и синхронизирует с ними каталог dstdir */
+int run_server(const char* spec, const char* dstdir, unsigned nthreads, const char* secret) {
+    struct addrinfo* ai = NULL;
+    struct sigaction sa;
+    int one = 1, lfd = -1, ec;
+    if ( 0 != (ec=net_resolve(spec, &ai)) ) {
+        printf("wrong address \"%s\"! terminate.\n", spec);
+        return 1;
+    }
+    lfd = socket(ai->ai_family, ai->ai_socktype|SOCK_CLOEXEC, ai->ai_protocol);
+    if ( lfd == -1 || setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))
+        || bind(lfd, ai->ai_addr, ai->ai_addrlen) || listen(lfd, 4) ) {
+        fprintf(stderr, "can't listen on %s: %s\n", spec, strerror(errno));
+        if ( lfd != -1 ) close(lfd);
+        freeaddrinfo(ai);
+        return 1;
+    }
+    freeaddrinfo(ai);
+    /* клиент может оборваться посреди ответа */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+    if ( !quiet ) printf("serving %s on %s\n", dstdir, spec);
+    while ( 1 ) {
+        int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if ( fd == -1 ) {
+            if ( errno == EINTR ) continue;
+            fprintf(stderr, "accept: %s\n", strerror(errno));
+            break;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if ( 0 != (ec=serve_session(fd, dstdir, nthreads, secret)) ) {
+            fprintf(stderr, "session error: %s\n", strerror(ec));
+        }
+        close(fd);
+    }
+    close(lfd);
+    return 1;
+}
+/* отправляет файл: заголовок, данные и net_file_end. мелкие файлы идут
+  в общий пакет, большие - через sendfile сразу в сокет. если файл укоротился,
+  хвост добивается нулями, чтобы не сбить разбор потока, а в завершении
+  передается ошибка, по которой сервер файл удаляет */
+static int net_send_file(net_writer* w, const char* srcname, const char* relname, int* ferr) {
+    net_msg m;
+    struct stat st;
+    size_t namelen = strlen(relname);
+    u_int64_t sent = 0;
+    int ec = 0;
+    int fd = open(srcname, O_RDONLY);
+    *ferr = 0;
+    if ( fd == -1 || fstat(fd, &st) ) {
+        *ferr = errno;
+        if ( fd != -1 ) close(fd);
+        return 0;
+    }
+    m.type = htole32(NET_FILE);
+    m.namelen = htole32((u_int32_t)namelen);
+    m.size = htole64((u_int64_t)st.st_size);
+    m.date = htole64((u_int64_t)st.st_mtim.tv_sec);
+    m.date_ns = htole32((u_int32_t)st.st_mtim.tv_nsec);
+    m.pad = 0;
+    if ( 0 != (ec=net_put(w, &m, sizeof(m))) || 0 != (ec=net_put(w, relname, namelen)) ) {
+        close(fd);
+        return ec;
+    }
+    if ( (u_int64_t)st.st_size <= NET_SMALL_FILE ) {
+        char buf[NET_SMALL_FILE];
+        ssize_t rd = st.st_size ? pread_full(fd, buf, st.st_size, 0) : 0;
+        if ( rd < 0 ) {
+            *ferr = errno;
+            rd = 0;
+        }
+        if ( rd < st.st_size ) {
+            memset(buf+rd, 0, st.st_size-rd);
+            if ( !*ferr ) *ferr = EIO;
+        }
+        ec = net_put(w, buf, st.st_size);
+    } else {
+        if ( 0 != (ec=net_flush(w)) ) {
+            close(fd);
+            return ec;
+        }
+        off_t off = 0;
+        while ( sent < (u_int64_t)st.st_size ) {
+            size_t want = throttle_take((u_int64_t)st.st_size-sent < MAX_SEND_SIZE ? (size_t)(st.st_size-sent) : MAX_SEND_SIZE);
+            ssize_t sz = sendfile(w->fd, fd, &off, want);
+            if ( sz < 0 ) {
+                if ( errno == EINTR ) continue;
+                /* ошибка чтения файла или сокета - различаю по сокету ниже */
+                *ferr = errno;
+                break;
+            }
+            if ( sz == 0 ) {
+                *ferr = EIO;
+                break;
+            }
+            sent += sz;
+        }
+        /* дополняю нулями до объявленного размера */
+        while ( !ec && sent < (u_int64_t)st.st_size ) {
+            char zeros[4096];
+            size_t n = (u_int64_t)st.st_size-sent < sizeof(zeros) ? (size_t)(st.st_size-sent) : sizeof(zeros);
+            memset(zeros, 0, n);
+            ec = net_write_all(w->fd, zeros, n);
+            sent += n;
+        }
+    }
+    if ( !ec ) {
+        net_file_end fe;
+        fe.error = htole32((u_int32_t)*ferr);
+        fe.pad = 0;
+        ec = net_put(w, &fe, sizeof(fe));
+    }
+    close(fd);
+    return ec;
+}
+/* синхронизирует srcdir с каталогом, который отдает сервер spec */
+int run_client(const char* srcdir, const char* spec, unsigned nthreads, int show_info, const char* secret) {
+    struct addrinfo* ai = NULL;
+    struct sigaction sa;
+    filetable src, dst;
+    filetable* tables[1] = {&src};
+    copylist result;
+    net_reader r;
+    net_writer w;
+    net_result res;
+    net_msg m;
+    pathindex diridx;
+    phase_clock pc;
+    dirinfo tocopy;
+    char sizebuf[32];
+    u_int64_t i, *dirs = NULL, ndirs = 0;
+    int fd = -1, one = 1, ec = 0, ret = 1;
+
+    memset(&src, 0, sizeof(src));
+    memset(&dst, 0, sizeof(dst));
+    memset(&result, 0, sizeof(result));
+    src.root = srcdir;
+    dst.root = spec;
+    r.buf = w.buf = NULL;
+
+    if ( net_resolve(spec, &ai) ) {
+        printf("wrong address \"%s\"! terminate.\n", spec);
+        return 1;
+    }
+    /* имя может разрешиться в несколько адресов, например ::1 и 127.0.0.1 */
+    for ( struct addrinfo* a = ai; a; a = a->ai_next ) {
+        fd = socket(a->ai_family, a->ai_socktype|SOCK_CLOEXEC, a->ai_protocol);
+        if ( fd != -1 && 0 == connect(fd, a->ai_addr, a->ai_addrlen) ) break;
+        ec = errno;
+        if ( fd != -1 ) close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(ai);
+    if ( fd == -1 ) {
+        fprintf(stderr, "can't connect to %s: %s\n", spec, strerror(ec));
+        return 1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+    r.fd = w.fd = fd;
+    r.pos = r.len = w.len = 0;
+    r.buf = (char*)malloc(NET_BUF_SIZE);
+    w.buf = (char*)malloc(NET_BUF_SIZE);
+
+    /* сервер сканирует свое дерево, пока клиент сканирует исходное */
+    if ( 0 != (ec=net_write_all(fd, NET_MAGIC, 8)) ) goto out;
+    if ( 0 != (ec=net_auth_client(&r, secret)) ) goto out;
+    if ( 0 != read_dir_trees(tables, 1, nthreads, &stats.phases[PHASE_SCAN_SRC]) ) goto out;
+    phase_begin(&pc);
+    if ( 0 != (ec=net_recv_list(&r, &dst)) ) goto out;
+    phase_end(PHASE_SCAN_DST, &pc);
+
+    phase_begin(&pc);
+    get_difference(&result, &src, &dst, nthreads);
+    /* недостающие каталоги, родители раньше потомков */
+    build_dirindex(&diridx, &dst);
+    dirs = (u_int64_t*)malloc((src.ndirs ? src.ndirs : 1)*sizeof(u_int64_t));
+    for ( i = 0; i < src.ndirs; ++i ) {
+        const char* name = src.pool + src.dirs[i].name;
+        if ( *name && pathindex_find(&diridx, name) < 0 ) dirs[ndirs++] = i;
+    }
+    free_pathindex(&diridx);
+    qsort_r(dirs, ndirs, sizeof(u_int64_t), cmp_dir_path, &src);
+    phase_end(PHASE_DIFF, &pc);
+    get_copyinfo(&tocopy, &result);
+    if ( show_info ) {
+        printf("need to copy %" PRIu64 " files with total size %s\n", tocopy.nfiles, readable_fs(sizebuf, tocopy.size));
+    }
+
+    phase_begin(&pc);
+    free(stats.workers);
+    stats.workers = (worker_stat*)aligned_alloc(64, sizeof(worker_stat));
+    memset(stats.workers, 0, sizeof(worker_stat));
+    stats.nworkers = 1;
+    stats.files = tocopy.nfiles;
+    stats.bytes = tocopy.size;
+    for ( i = 0; !ec && i < ndirs; ++i ) {
+        const char* name = src.pool + src.dirs[dirs[i]].name;
+        memset(&m, 0, sizeof(m));
+        m.type = htole32(NET_MKDIR);
+        m.namelen = htole32((u_int32_t)strlen(name));
+        if ( 0 == (ec=net_put(&w, &m, sizeof(m))) ) ec = net_put(&w, name, strlen(name));
+    }
+    sort_copylist(&result, copy_order);
+    for ( i = 0; !ec && i < result.count; ++i ) {
+        const fileentry* node = &src.files[result.idx[i]];
+        const char* relname = file_name(&src, node);
+        char* srcname = make_filename(srcdir, relname);
+        struct timespec started;
+        int ferr;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        if ( !quiet ) printf("sending: %s\n", srcname);
+        ec = net_send_file(&w, srcname, relname, &ferr);
+        if ( ferr ) {
+            fprintf(stderr, "error: %s: %s\n", srcname, strerror(ferr));
+            atomic_store_explicit(&stats.workers[0].errors, atomic_load_explicit(&stats.workers[0].errors, memory_order_relaxed)+1, memory_order_relaxed);
+        } else if ( !ec ) {
+            stat_copied(&stats.workers[0], node->size, &started, 1);
+        }
+        free(srcname);
+    }
+    if ( !ec ) {
+        memset(&m, 0, sizeof(m));
+        m.type = htole32(NET_END);
+        ec = net_put(&w, &m, sizeof(m));
+    }
+    if ( !ec ) ec = net_flush(&w);
+    if ( !ec ) ec = net_read(&r, &res, sizeof(res));
+    clock_gettime(CLOCK_MONOTONIC, &stats.workers[0].finished);
+    phase_end(PHASE_COPY, &pc);
+    if ( !ec ) {
+        if ( show_info ) {
+            printf("server received %" PRIu64 " files, %" PRIu64 " errors\n", le64toh(res.files), le64toh(res.errors));
+        }
+        ret = le64toh(res.errors) || atomic_load(&stats.workers[0].errors) ? 1 : 0;
+        if ( !tocopy.nfiles && !quiet ) printf("\nthe directories are identical. terminate.\n");
+    }
+
+out:
+    if ( ec ) fprintf(stderr, "error: %s: %s\n", spec, strerror(ec));
+    close(fd);
+    free(r.buf);
+    free(w.buf);
+    free(dirs);
+    free_copylist(&result);
+    free_filetable(&src);
+    free_filetable(&dst);
+    return ret;
+}
+
+/***************************************************************************/
+/* конвейерный режим: обход, сравнение и копирование одновременно */
+static void pipe_list_add(pipe_list* l, const char* name, unsigned char type, const struct stat* st) {
+    size_t len = strlen(name)+1;
+    if ( l->n == l->cap ) {
+        l->cap = l->cap ? l->cap*2 : 64;
+        l->e = (pipe_entry*)realloc(l->e, l->cap*sizeof(pipe_entry));
+    }
+    if ( l->poolsize+len > l->poolcap ) {
+        while ( l->poolsize+len > l->poolcap ) l->poolcap = l->poolcap ? l->poolcap*2 : 4096;
+        l->pool = (char*)realloc(l->pool, l->poolcap);
+    }
+    pipe_entry* e = &l->e[l->n++];
+    e->name = l->poolsize;
+    e->type = type;
+    e->size = st ? (u_int64_t)st->st_size : 0;
+    e->date = st ? st->st_mtime : 0;
+    e->date_ns = st ? (u_int32_t)st->st_mtim.tv_nsec : 0;
+    memcpy(l->pool+l->poolsize, name, len);
+    l->poolsize += len;
+}
+/* читает содержимое одного каталога: обычные файлы с их атрибутами и подкаталоги */
+static int pipe_list_dir(int fd, pipe_list* l, char* buf) {
+    l->n = l->poolsize = 0;
+    while ( 1 ) {
+        long n = syscall(SYS_getdents64, fd, buf, SCAN_DENTS_BUF_SIZE);
+        if ( n < 0 ) return errno;
+        if ( n == 0 ) break;
+        for ( long off = 0; off < n; ) {
+            struct linux_dirent64* de = (struct linux_dirent64*)(buf+off);
+            struct stat st;
+            unsigned char type = de->d_type;
+            off += de->d_reclen;
+            if ( de->d_name[0] == '.' && (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2])) )
+                continue;
+            if ( type == DT_DIR ) {
+                pipe_list_add(l, de->d_name, DT_DIR, NULL);
+                continue;
+            }
+            if ( type != DT_REG && type != DT_UNKNOWN ) continue;
+            if ( -1 == fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) ) continue;
+            if ( S_ISDIR(st.st_mode) ) pipe_list_add(l, de->d_name, DT_DIR, NULL);
+            else if ( S_ISREG(st.st_mode) ) pipe_list_add(l, de->d_name, DT_REG, &st);
+        }
+    }
+    return 0;
+}
+static int cmp_pipe_entry(const void* a, const void* b, void* arg) {
+    const char* pool = (const char*)arg;
+    return strcmp(pool + ((const pipe_entry*)a)->name, pool + ((const pipe_entry*)b)->name);
+}
+/* кладет файл в очередь копирования. если очередь заполнена, ждет,
+  пока потоки копирования ее разберут */
+static void pipe_push(pipeline* p, const pipe_item* item) {
+    pipe_queue* q = &p->queue;
+    pthread_mutex_lock(&q->lock);
+    while ( q->count == q->cap ) pthread_cond_wait(&q->notfull, &q->lock);
+    q->items[(q->head+q->count) % q->cap] = *item;
+    q->count++;
+    pthread_cond_signal(&q->notempty);
+    pthread_mutex_unlock(&q->lock);
+}
+/* берет файл из очереди. возвращает 0, если очередь закрыта и пуста */
+static int pipe_pop(pipeline* p, pipe_item* item) {
+    pipe_queue* q = &p->queue;
+    pthread_mutex_lock(&q->lock);
+    while ( !q->count && !q->closed ) pthread_cond_wait(&q->notempty, &q->lock);
+    if ( !q->count ) {
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+    }
+    *item = q->items[q->head];
+    q->head = (q->head+1) % q->cap;
+    q->count--;
+    pthread_cond_signal(&q->notfull);
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+/* добавляет каталоги к обходу. кладутся в обратном порядке, чтобы
+  первым из стека был взят первый по имени */
+static void pipe_push_dirs(pipeline* p, char** rel, size_t count) {
+    if ( !count ) return;
+    pthread_mutex_lock(&p->dirlock);
+    while ( p->ndirs+count > p->dircap ) {
+        p->dircap = p->dircap ? p->dircap*2 : 64;
+        p->dirs = (char**)realloc(p->dirs, p->dircap*sizeof(char*));
+    }
+    while ( count ) p->dirs[p->ndirs++] = rel[--count];
+    pthread_cond_broadcast(&p->dircond);
+    pthread_mutex_unlock(&p->dirlock);
+}
+/* сравнивает один каталог с его копией: изменившиеся файлы отдает в
+  очередь копирования, подкаталоги - в обход, недостающие подкаталоги
+  назначения создает сразу. оба списка упорядочиваются по имени и сводятся
+  одним встречным проходом, так что памяти нужно не больше размера самого
+  большого каталога. набор копируемых файлов тот же, что у get_difference() */
+static void pipe_dir(pipeline* p, const char* rel, pipe_list* src, pipe_list* dst, char* buf) {
+    size_t rellen = strlen(rel), i, j = 0, nsub = 0;
+    char** subdirs;
+    int sfd = openat(p->srcfd, rellen ? rel+1 : ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if ( sfd == -1 ) {
+        fprintf(stderr, "error opening directory \"%s%s\": %s\n", p->srcdir, rel, strerror(errno));
+        return;
+    }
+    if ( pipe_list_dir(sfd, src, buf) ) {
+        fprintf(stderr, "error reading directory \"%s%s\": %s\n", p->srcdir, rel, strerror(errno));
+    }
+    close(sfd);
+    int dfd = openat(p->dstfd, rellen ? rel+1 : ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    dst->n = dst->poolsize = 0;
+    if ( dfd != -1 ) {
+        pipe_list_dir(dfd, dst, buf);
+        qsort_r(dst->e, dst->n, sizeof(pipe_entry), cmp_pipe_entry, dst->pool);
+    }
+    qsort_r(src->e, src->n, sizeof(pipe_entry), cmp_pipe_entry, src->pool);
+    subdirs = (char**)malloc((src->n ? src->n : 1)*sizeof(char*));
+    for ( i = 0; i < src->n; ++i ) {
+        const pipe_entry* s = &src->e[i];
+        const char* name = src->pool + s->name;
+        const pipe_entry* d = NULL;
+        int c = 1;
+        /* пропускаю имена, которые есть только в каталоге назначения */
+        while ( j < dst->n && (c=strcmp(dst->pool + dst->e[j].name, name)) < 0 ) ++j;
+        if ( j < dst->n && !c ) d = &dst->e[j];
+        char* child = (char*)malloc(rellen+1+strlen(name)+1);
+        sprintf(child, "%s/%s", rel, name);
+        if ( s->type == DT_DIR ) {
+            if ( (!d || d->type != DT_DIR) && dfd != -1
+                && mkdirat(dfd, name, S_IRWXU|S_IRWXG|S_IRWXO) && errno != EEXIST ) {
+                fprintf(stderr, "error: %s%s: %s\n", p->dstdir, child, strerror(errno));
+            }
+            subdirs[nsub++] = child;
+            continue;
+        }
+        fileentry sf = {0, s->size, s->date, s->date_ns, 0, 0};
+        pipe_item item = {child, s->size, s->date, s->date_ns, 0};
+        if ( d && d->type == DT_REG ) {
+            fileentry df = {0, d->size, d->date, d->date_ns, 0, 0};
+            if ( !file_changed(&sf, &df) ) {
+                /* при сверке по хешу содержимое сверит поток копирования */
+                if ( compare_mode != COMPARE_CHECKSUM ) {
+                    free(child);
+                    continue;
+                }
+                item.check = 1;
+            }
+        }
+        pipe_push(p, &item);
+    }
+    if ( dfd != -1 ) close(dfd);
+    pipe_push_dirs(p, subdirs, nsub);
+    free(subdirs);
+}
+/* поток обхода. каталоги берутся с конца списка, поэтому обход идет в глубину */
+static void* pipe_walk_proc(void* arg) {
+    pipeline* p = (pipeline*)arg;
+    pipe_list src, dst;
+    char* buf = (char*)malloc(SCAN_DENTS_BUF_SIZE);
+    memset(&src, 0, sizeof(src));
+    memset(&dst, 0, sizeof(dst));
+    while ( 1 ) {
+        pthread_mutex_lock(&p->dirlock);
+        while ( !p->ndirs && p->active ) pthread_cond_wait(&p->dircond, &p->dirlock);
+        if ( !p->ndirs ) {
+            /* каталогов нет и никто не обходит - обход закончен */
+            pthread_cond_broadcast(&p->dircond);
+            pthread_mutex_unlock(&p->dirlock);
+            break;
+        }
+        char* rel = p->dirs[--p->ndirs];
+        p->active++;
+        pthread_mutex_unlock(&p->dirlock);
+        pipe_dir(p, rel, &src, &dst, buf);
+        free(rel);
+        pthread_mutex_lock(&p->dirlock);
+        if ( 0 == --p->active && !p->ndirs ) pthread_cond_broadcast(&p->dircond);
+        pthread_mutex_unlock(&p->dirlock);
+    }
+    free(src.e);
+    free(src.pool);
+    free(dst.e);
+    free(dst.pool);
+    free(buf);
+    return NULL;
+}
+/* поток копирования конвейера */
+static void* pipe_copy_proc(void* arg) {
+    pipeline* p = (pipeline*)arg;
+    worker_stat* ws = &stats.workers[atomic_fetch_add(&p->nextstat, 1)];
+    unsigned char* hbuf = NULL;
+    pipe_item item;
+    while ( pipe_pop(p, &item) ) {
+        struct timespec started;
+        int err;
+        char* srcname = make_filename(p->srcdir, item.rel);
+        char* dstname = make_filename(p->dstdir, item.rel);
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        if ( item.check ) {
+            u_int64_t h1 = 0, h2 = 0;
+            if ( !hbuf ) hbuf = (unsigned char*)malloc(HASH_BUF_SIZE);
+            if ( 0 == hash_file(srcname, &h1, hbuf) && 0 == hash_file(dstname, &h2, hbuf) && h1 == h2 ) {
+                free(srcname);
+                free(dstname);
+                free(item.rel);
+                continue;
+            }
+        }
+        if ( !quiet ) printf("copying: %s\n", srcname);
+        if ( 0 != (err=copy_file(srcname, dstname, item.date)) ) {
+            fprintf(stderr, "error: %s: %s\n", srcname, strerror(err));
+            atomic_fetch_add(&copy_errors, 1);
+            atomic_store_explicit(&ws->errors, atomic_load_explicit(&ws->errors, memory_order_relaxed)+1, memory_order_relaxed);
+        } else {
+            stat_copied(ws, item.size, &started, 1);
+        }
+        free(srcname);
+        free(dstname);
+        free(item.rel);
+    }
+    free(hbuf);
+    clock_gettime(CLOCK_MONOTONIC, &ws->finished);
+    return NULL;
+}
+/* синхронизирует каталоги конвейером: nthreads потоков обходят оба дерева
+  по каталогам и сравнивают их, столько же потоков копируют найденные файлы.
+  между ними очередь на depth файлов, поэтому память не зависит от размера
+  дерева, а копирование начинается сразу */
+int run_pipeline(const char* srcdir, const char* dstdir, unsigned nthreads, unsigned depth) {
+    pipeline p;
+    pthread_t* walkers = (pthread_t*)malloc(nthreads*sizeof(pthread_t));
+    pthread_t* copiers = (pthread_t*)malloc(nthreads*sizeof(pthread_t));
+    phase_clock pc;
+    unsigned i;
+    memset(&p, 0, sizeof(p));
+    p.srcdir = srcdir;
+    p.dstdir = dstdir;
+    p.srcfd = open(srcdir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    p.dstfd = open(dstdir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if ( p.srcfd == -1 || p.dstfd == -1 ) {
+        fprintf(stderr, "error opening directory: %s\n", strerror(errno));
+        if ( p.srcfd != -1 ) close(p.srcfd);
+        if ( p.dstfd != -1 ) close(p.dstfd);
+        free(walkers);
+        free(copiers);
+        return 1;
+    }
+    pthread_mutex_init(&p.dirlock, NULL);
+    pthread_cond_init(&p.dircond, NULL);
+    pthread_mutex_init(&p.queue.lock, NULL);
+    pthread_cond_init(&p.queue.notfull, NULL);
+    pthread_cond_init(&p.queue.notempty, NULL);
+    p.queue.cap = depth;
+    p.queue.items = (pipe_item*)malloc(depth*sizeof(pipe_item));
+    atomic_init(&p.nextstat, 0);
+    atomic_init(&copy_errors, 0);
+    free(stats.workers);
+    stats.workers = (worker_stat*)aligned_alloc(64, nthreads*sizeof(worker_stat));
+    memset(stats.workers, 0, nthreads*sizeof(worker_stat));
+    stats.nworkers = nthreads;
+    char* root = strdup("");
+    pipe_push_dirs(&p, &root, 1);
+
+    phase_begin(&pc);
+    for ( i = 0; i < nthreads; ++i ) {
+        pthread_create(&copiers[i], NULL, pipe_copy_proc, &p);
+    }
+    for ( i = 0; i < nthreads; ++i ) {
+        pthread_create(&walkers[i], NULL, pipe_walk_proc, &p);
+    }
+    for ( i = 0; i < nthreads; ++i ) {
+        pthread_join(walkers[i], NULL);
+    }
+    /* обход закончен - закрываю очередь, потоки копирования дорабатывают ее */
+    pthread_mutex_lock(&p.queue.lock);
+    p.queue.closed = 1;
+    pthread_cond_broadcast(&p.queue.notempty);
+    pthread_mutex_unlock(&p.queue.lock);
+    for ( i = 0; i < nthreads; ++i ) {
+        pthread_join(copiers[i], NULL);
+    }
+    phase_end(PHASE_COPY, &pc);
+
+    stats.files = stats.bytes = 0;
+    for ( i = 0; i < nthreads; ++i ) {
+        stats.files += atomic_load(&stats.workers[i].files);
+        stats.bytes += atomic_load(&stats.workers[i].bytes);
+    }
+    pthread_mutex_destroy(&p.dirlock);
+    pthread_cond_destroy(&p.dircond);
+    pthread_mutex_destroy(&p.queue.lock);
+    pthread_cond_destroy(&p.queue.notfull);
+    pthread_cond_destroy(&p.queue.notempty);
+    free(p.queue.items);
+    free(p.dirs);
+    nocache_pool_free();
+    tune_pool_free();
+    atomic_finish(dstdir);
+    close(p.srcfd);
+    close(p.dstfd);
+    free(walkers);
+    free(copiers);
+    return atomic_load(&copy_errors) ? 1 : 0;
+}
+
+/***************************************************************************/
+/* режим наблюдения */
+/* события, на которые подписываются каталоги исходного дерева */
+#define WATCH_MASK (IN_CLOSE_WRITE|IN_MOVED_TO|IN_MOVED_FROM|IN_CREATE|IN_ATTRIB|IN_ONLYDIR)
+/* размер буфера чтения событий */
+#define WATCH_BUF_SIZE (64*1024)
+
+volatile sig_atomic_t watch_stop = 0; /* получен сигнал завершения */
+
+static void watch_signal(int sig) {
+    (void)sig;
+    watch_stop = 1;
+}
+static void watch_push(char*** list, size_t* count, size_t* cap, char* path) {
+    if ( *count == *cap ) {
+        *cap = *cap ? *cap*2 : 64;
+        *list = (char**)realloc(*list, *cap*sizeof(char*));
+    }
+    (*list)[(*count)++] = path;
+}
+/* подписывается на каталог relname. повторная подписка на тот же каталог
+  возвращает прежний дескриптор, и его путь обновляется */
+static void watch_add(watcher* w, const char* relname) {
+    char* name = make_filename(w->srcdir, relname);
+    int wd = inotify_add_watch(w->fd, name, WATCH_MASK);
+    free(name);
+    if ( wd < 0 ) {
+        /* каталог мог быть уже удален */
+        if ( errno != ENOENT && errno != ENOTDIR ) {
+            fprintf(stderr, "error watching \"%s%s\": %s\n", w->srcdir, relname, strerror(errno));
+        }
+        return;
+    }
+    if ( wd >= w->npaths ) {
+        int n = w->npaths ? w->npaths : 64;
+        while ( n <= wd ) n *= 2;
+        w->paths = (char**)realloc(w->paths, n*sizeof(char*));
+        memset(w->paths+w->npaths, 0, (n-w->npaths)*sizeof(char*));
+        w->npaths = n;
+    }
+    free(w->paths[wd]);
+    w->paths[wd] = strdup(relname);
+}
+/* подписывается на все каталоги таблицы. имена в таблице отсчитываются
+  от prefix */
+static void watch_add_table(watcher* w, const filetable* ft, const char* prefix) {
+    u_int64_t i;
+    for ( i = 0; i < ft->ndirs; ++i ) {
+        char* rel = make_filename(prefix, ft->pool + ft->dirs[i].name);
+        watch_add(w, rel);
+        free(rel);
+    }
+}
+int watch_init(watcher* w, const filetable* src) {
+    memset(w, 0, sizeof(*w));
+    w->srcdir = src->root;
+    w->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if ( w->fd == -1 ) return errno;
+    watch_add_table(w, src, "");
+    return 0;
+}
+void watch_free(watcher* w) {
+    int i;
+    size_t j;
+    if ( w->fd != -1 ) close(w->fd);
+    for ( i = 0; i < w->npaths; ++i ) free(w->paths[i]);
+    free(w->paths);
+    for ( j = 0; j < w->nfiles; ++j ) free(w->files[j]);
+    free(w->files);
+    for ( j = 0; j < w->nsubtrees; ++j ) free(w->subtrees[j]);
+    free(w->subtrees);
+}
+/* разбирает прочитанные события. измененные файлы и новые каталоги
+  запоминаются до конца окна накопления */
+static void watch_parse(watcher* w, const char* buf, ssize_t len) {
+    const char* p;
+    for ( p = buf; p < buf+len; ) {
+        const struct inotify_event* ev = (const struct inotify_event*)p;
+        p += sizeof(struct inotify_event) + ev->len;
+        /* очередь переполнилась, часть событий потеряна: пересканирую все дерево */
+        if ( ev->mask & IN_Q_OVERFLOW ) {
+            watch_push(&w->subtrees, &w->nsubtrees, &w->subtreecap, strdup(""));
+            continue;
+        }
+        if ( ev->wd < 0 || ev->wd >= w->npaths || !w->paths[ev->wd] ) continue;
+        if ( ev->mask & IN_IGNORED ) {
+            free(w->paths[ev->wd]);
+            w->paths[ev->wd] = NULL;
+            continue;
+        }
+        if ( !ev->len ) continue;
+        char* rel = (char*)malloc(strlen(w->paths[ev->wd])+1+strlen(ev->name)+1);
+        sprintf(rel, "%s/%s", w->paths[ev->wd], ev->name);
+        if ( ev->mask & IN_ISDIR ) {
+            if ( ev->mask & IN_MOVED_FROM ) {
+                /* у перенесенного каталога и его подкаталогов прежние дескрипторы
+                  со старыми путями. пути обновит пересканирование всего дерева */
+                free(rel);
+                rel = strdup("");
+            } else if ( ev->mask & (IN_CREATE|IN_MOVED_TO) ) {
+                /* подписываюсь сразу, чтобы не пропустить файлы, создаваемые в нем */
+                watch_add(w, rel);
+            } else {
+                free(rel);
+                continue;
+            }
+            watch_push(&w->subtrees, &w->nsubtrees, &w->subtreecap, rel);
+        } else if ( ev->mask & (IN_CLOSE_WRITE|IN_MOVED_TO|IN_ATTRIB) ) {
+            watch_push(&w->files, &w->nfiles, &w->filecap, rel);
+        } else {
+            free(rel);
+        }
+    }
+}
+static int cmp_str(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+/* сравнивает и копирует один набор таблиц */
+static u_int64_t watch_copy(filetable* src, filetable* dst, unsigned nthreads) {
+    copylist result;
+    memset(&result, 0, sizeof(result));
+    get_difference(&result, src, dst, nthreads);
+    u_int64_t n = result.count;
+    if ( n ) copy_files(&result, src, dst, nthreads);
+    free_copylist(&result);
+    return n;
+}
+/* синхронизирует накопленные изменения: сначала пересканирует новые
+  поддеревья, затем сравнивает и копирует отдельные измененные файлы */
+static void watch_sync(watcher* w, const char* dstdir, unsigned nthreads) {
+    u_int64_t copied = 0;
+    size_t i, j, n;
+    /* вложенные поддеревья покрываются охватывающими */
+    qsort(w->subtrees, w->nsubtrees, sizeof(char*), cmp_str);
+    for ( i = 0, n = 0; i < w->nsubtrees; ++i ) {
+        const char* sub = w->subtrees[i];
+        for ( j = 0; j < n; ++j ) {
+            size_t len = strlen(w->subtrees[j]);
+            if ( 0 == strncmp(sub, w->subtrees[j], len) && (sub[len] == '/' || !sub[len]) ) break;
+        }
+        if ( j < n ) {
+            free(w->subtrees[i]);
+            continue;
+        }
+        w->subtrees[n++] = w->subtrees[i];
+    }
+    w->nsubtrees = n;
+    for ( i = 0; i < w->nsubtrees; ++i ) {
+        const char* sub = w->subtrees[i];
+        filetable src, dst;
+        memset(&src, 0, sizeof(src));
+        memset(&dst, 0, sizeof(dst));
+        char* srcroot = make_filename(w->srcdir, sub);
+        char* dstroot = make_filename(dstdir, sub);
+        /* корень поддерева в каталоге назначения; его родитель уже существует
+          или создан пересканированием охватывающего каталога */
+        if ( *sub && mkdir(dstroot, S_IRWXU|S_IRWXG|S_IRWXO) && errno != EEXIST ) {
+            fprintf(stderr, "error: %s: %s\n", dstroot, strerror(errno));
+        }
+        src.root = srcroot;
+        dst.root = dstroot;
+        filetable* tables[2] = {&src, &dst};
+        if ( 0 == read_dir_trees(tables, 2, nthreads, NULL) ) {
+            watch_add_table(w, &src, sub);
+            copied += watch_copy(&src, &dst, nthreads);
+        }
+        free_filetable(&src);
+        free_filetable(&dst);
+        free(srcroot);
+        free(dstroot);
+    }
+    /* отдельные файлы. уже скопированные пересканированием дадут пустую разницу.
+      о файлах из событий известно, что они менялись, а правка в ту же секунду,
+      что и прошлое копирование, по целым секундам не видна. поэтому файл
+      копируется, если отличается размер или тайм штамп до наносекунды,
+      какой бы ни была --compare: такой файл в таблицу назначения не попадает */
+    if ( w->nfiles ) {
+        filetable src, dst;
+        struct stat st, dst_st;
+        memset(&src, 0, sizeof(src));
+        memset(&dst, 0, sizeof(dst));
+        src.root = w->srcdir;
+        dst.root = dstdir;
+        qsort(w->files, w->nfiles, sizeof(char*), cmp_str);
+        for ( i = 0; i < w->nfiles; ++i ) {
+            if ( i && 0 == strcmp(w->files[i], w->files[i-1]) ) continue;
+            char* name = make_filename(w->srcdir, w->files[i]);
+            int ok = 0 == lstat(name, &st) && S_ISREG(st.st_mode);
+            free(name);
+            if ( !ok ) continue;
+            filetable_add(&src, w->files[i], &st);
+            name = make_filename(dstdir, w->files[i]);
+            if ( 0 == lstat(name, &dst_st) && S_ISREG(dst_st.st_mode) && dst_st.st_size == st.st_size
+                && dst_st.st_mtim.tv_sec == st.st_mtim.tv_sec && dst_st.st_mtim.tv_nsec == st.st_mtim.tv_nsec ) {
+                filetable_add(&dst, w->files[i], &dst_st);
+            }
+            free(name);
+        }
+        copied += watch_copy(&src, &dst, nthreads);
+        free_filetable(&src);
+        free_filetable(&dst);
+    }
+    if ( !quiet ) {
+        printf("watch: %zu changed files, %zu rescanned subtrees, copied %" PRIu64 " files\n", w->nfiles, w->nsubtrees, copied);
+        fflush(stdout);
+    }
+    for ( i = 0; i < w->nfiles; ++i ) free(w->files[i]);
+    for ( i = 0; i < w->nsubtrees; ++i ) free(w->subtrees[i]);
+    w->nfiles = w->nsubtrees = 0;
+}
+/* ждет событий и синхронизирует изменения до получения SIGINT или SIGTERM.
+  после первого события события копятся, пока не наступит пауза в
+  debounce_ms, но не дольше десяти таких интервалов */
+int watch_loop(watcher* w, const char* dstdir, unsigned nthreads, unsigned debounce_ms) {
+    char* buf = (char*)aligned_alloc(__alignof__(struct inotify_event), WATCH_BUF_SIZE);
+    struct sigaction sa;
+    struct pollfd pfd;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watch_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    pfd.fd = w->fd;
+    pfd.events = POLLIN;
+    while ( !watch_stop ) {
+        struct timespec first, now;
+        int timeout = -1;
+        while ( !watch_stop ) {
+            int rc = poll(&pfd, 1, timeout);
+            if ( rc < 0 && errno != EINTR ) {
+                fprintf(stderr, "error: poll: %s\n", strerror(errno));
+                watch_stop = 1;
+            }
+            if ( rc <= 0 ) {
+                /* пауза в событиях - окно закрыто */
+                if ( rc == 0 ) break;
+                continue;
+            }
+            ssize_t len;
+            while ( (len = read(w->fd, buf, WATCH_BUF_SIZE)) > 0 ) {
+                watch_parse(w, buf, len);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ( timeout == -1 ) first = now;
+            long waited = (now.tv_sec-first.tv_sec)*1000 + (now.tv_nsec-first.tv_nsec)/1000000;
+            if ( waited >= 10*(long)debounce_ms ) break;
+            timeout = (int)debounce_ms;
+        }
+        if ( w->nfiles || w->nsubtrees ) {
+            watch_sync(w, dstdir, nthreads);
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+/***************************************************************************/
+/* статистика */
+static const char* phase_names[PHASE_COUNT] = {
+    "scan_src", "scan_dst", "diff", "mkdir", "copy"
+};
+/* верхние границы групп файлов по размеру, последняя группа без границы */
+static const u_int64_t stat_size_limits[STAT_SIZE_BUCKETS-1] = {
+    4*1024, 64*1024, 1024*1024, 16*1024*1024, 256*1024*1024
+};
+static const char* stat_size_names[STAT_SIZE_BUCKETS] = {
+    "<4K", "<64K", "<1M", "<16M", "<256M", ">=256M"
+};
+
+static double timespec_diff(const struct timespec* from, const struct timespec* to) {
+    return (double)(to->tv_sec-from->tv_sec) + (double)(to->tv_nsec-from->tv_nsec)/1e9;
+}
+void phase_begin(phase_clock* pc) {
+    clock_gettime(CLOCK_MONOTONIC, &pc->wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &pc->cpu);
+}
+void phase_end(int phase, const phase_clock* pc) {
+    struct timespec wall, cpu;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    stats.phases[phase].wall = timespec_diff(&pc->wall, &wall);
+    stats.phases[phase].cpu = timespec_diff(&pc->cpu, &cpu);
+    stats.phases[phase].done = 1;
+}
+/* счетчики меняет только поток-владелец, поэтому атомарное сложение
+  не нужно: relaxed загрузка и запись не дают ни блокировок, ни разделения
+  строк кеша между потоками */
+static inline void stat_add(atomic_uint_fast64_t* counter, u_int64_t v) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed)+v, memory_order_relaxed);
+}
+void stat_copied(worker_stat* ws, u_int64_t size, const struct timespec* started, u_int64_t files) {
+    struct timespec now;
+    unsigned sb = 0, lb;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t us = (now.tv_sec-started->tv_sec)*1000000ll + (now.tv_nsec-started->tv_nsec)/1000;
+    while ( sb < STAT_SIZE_BUCKETS-1 && size >= stat_size_limits[sb] ) sb++;
+    /* интервал k содержит задержки [2^(k-1), 2^k) микросекунд */
+    lb = us > 0 ? 64-__builtin_clzll((u_int64_t)us) : 0;
+    if ( lb >= STAT_LAT_BUCKETS ) lb = STAT_LAT_BUCKETS-1;
+    ws->latency[sb][lb]++;
+    stat_add(&ws->files, files);
+    stat_add(&ws->bytes, size);
+}
+/* суммирует счетчики потоков */
+static void stat_totals(u_int64_t* files, u_int64_t* bytes, u_int64_t* errors) {
+    unsigned i;
+    *files = *bytes = *errors = 0;
+    for ( i = 0; i < stats.nworkers; ++i ) {
+        *files += atomic_load_explicit(&stats.workers[i].files, memory_order_relaxed);
+        *bytes += atomic_load_explicit(&stats.workers[i].bytes, memory_order_relaxed);
+        *errors += atomic_load_explicit(&stats.workers[i].errors, memory_order_relaxed);
+    }
+}
+/* граница задержки в микросекундах, которую не превышает доля q файлов группы */
+static u_int64_t stat_percentile(const u_int64_t* hist, u_int64_t count, double q) {
+    u_int64_t need = (u_int64_t)(count*q+0.5), seen = 0;
+    unsigned k;
+    if ( !need ) need = 1;
+    for ( k = 0; k < STAT_LAT_BUCKETS; ++k ) {
+        seen += hist[k];
+        if ( seen >= need ) return (u_int64_t)1 << k;
+    }
+    return (u_int64_t)1 << (STAT_LAT_BUCKETS-1);
+}
+/* сводит гистограммы потоков для группы размеров */
+static u_int64_t stat_latency(unsigned sb, u_int64_t* hist) {
+    u_int64_t count = 0;
+    unsigned i, k;
+    memset(hist, 0, STAT_LAT_BUCKETS*sizeof(u_int64_t));
+    for ( i = 0; i < stats.nworkers; ++i ) {
+        for ( k = 0; k < STAT_LAT_BUCKETS; ++k ) {
+            hist[k] += stats.workers[i].latency[sb][k];
+            count += stats.workers[i].latency[sb][k];
+        }
+    }
+    return count;
+}
+/* поток вывода прогресса. раз в progress_interval секунд суммирует
+  счетчики потоков и выводит строку в stderr */
+static void* progress_thread_proc(void* p) {
+    progress_data* pd = (progress_data*)p;
+    char b1[32], b2[32], b3[32];
+    u_int64_t lastbytes = 0;
+    struct timespec last = pd->started;
+    pthread_mutex_lock(&pd->lock);
+    while ( !pd->stop ) {
+        struct timespec deadline, now;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += progress_interval;
+        while ( !pd->stop && ETIMEDOUT != pthread_cond_timedwait(&pd->cond, &pd->lock, &deadline) ) {}
+        if ( pd->stop ) break;
+        u_int64_t files, bytes, errors;
+        stat_totals(&files, &bytes, &errors);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double dt = timespec_diff(&last, &now);
+        double elapsed = timespec_diff(&pd->started, &now);
+        double rate = dt > 0 ? (bytes-lastbytes)/dt : 0;
+        /* оставшееся время считаю по средней скорости, она стабильнее текущей */
+        double avg = elapsed > 0 ? bytes/elapsed : 0;
+        u_int64_t eta = avg > 0 && stats.bytes > bytes ? (u_int64_t)((stats.bytes-bytes)/avg) : 0;
+        fprintf(stderr, "progress: %" PRIu64 "/%" PRIu64 " files, %s/%s, %s/s, %" PRIu64 " errors, eta %02u:%02u:%02u\n",
+                files, stats.files, readable_fs(b1, bytes), readable_fs(b2, stats.bytes), readable_fs(b3, (u_int64_t)rate),
+                errors, (unsigned)(eta/3600), (unsigned)(eta/60%60), (unsigned)(eta%60));
+        lastbytes = bytes;
+        last = now;
+    }
+    pthread_mutex_unlock(&pd->lock);
+    return NULL;
+}
+void progress_start(progress_data* pd, pthread_t* thread) {
+    pthread_mutex_init(&pd->lock, NULL);
+    pthread_cond_init(&pd->cond, NULL);
+    pd->stop = 0;
+    clock_gettime(CLOCK_MONOTONIC, &pd->started);
+    pthread_create(thread, NULL, progress_thread_proc, pd);
+}
+void progress_stop(progress_data* pd, pthread_t thread) {
+    pthread_mutex_lock(&pd->lock);
+    pd->stop = 1;
+    pthread_cond_signal(&pd->cond);
+    pthread_mutex_unlock(&pd->lock);
+    pthread_join(thread, NULL);
+    pthread_mutex_destroy(&pd->lock);
+    pthread_cond_destroy(&pd->cond);
+}
+void print_stats() {
+    char sizebuf[32];
+    u_int64_t hist[STAT_LAT_BUCKETS];
+    unsigned i;
+    for ( i = 0; i < PHASE_COUNT; ++i ) {
+        if ( !stats.phases[i].done ) continue;
+        printf("phase %-8s %10.3f s wall %10.3f s cpu\n", phase_names[i], stats.phases[i].wall, stats.phases[i].cpu);
+    }
+    for ( i = 0; i < stats.nworkers; ++i ) {
+        const worker_stat* ws = &stats.workers[i];
+        printf("thread %-3u %8" PRIu64 " files %10s %5" PRIu64 " errors %8.3f s idle\n", i,
+               (u_int64_t)atomic_load(&ws->files), readable_fs(sizebuf, atomic_load(&ws->bytes)),
+               (u_int64_t)atomic_load(&ws->errors), ws->idle);
+    }
+    for ( i = 0; i < STAT_SIZE_BUCKETS; ++i ) {
+        u_int64_t count = stat_latency(i, hist);
+        if ( !count ) continue;
+        printf("latency %-6s %8" PRIu64 " files  p50 <= %" PRIu64 " us  p90 <= %" PRIu64 " us  p99 <= %" PRIu64 " us\n",
+               stat_size_names[i], count, stat_percentile(hist, count, 0.5),
+               stat_percentile(hist, count, 0.9), stat_percentile(hist, count, 0.99));
+    }
+}
+int write_stats_json(const char* path) {
+    u_int64_t files, bytes, errors, hist[STAT_LAT_BUCKETS];
+    unsigned i, k;
+    FILE* f = fopen(path, "w");
+    if ( !f ) return errno;
+    stat_totals(&files, &bytes, &errors);
+    fprintf(f, "{\n  \"phases\": {");
+    for ( i = 0, k = 0; i < PHASE_COUNT; ++i ) {
+        if ( !stats.phases[i].done ) continue;
+        fprintf(f, "%s\n    \"%s\": {\"wall\": %.6f, \"cpu\": %.6f}", k++ ? "," : "",
+                phase_names[i], stats.phases[i].wall, stats.phases[i].cpu);
+    }
+    fprintf(f, "\n  },\n  \"to_copy\": {\"files\": %" PRIu64 ", \"bytes\": %" PRIu64 "},\n", stats.files, stats.bytes);
+    fprintf(f, "  \"copied\": {\"files\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"errors\": %" PRIu64 "},\n", files, bytes, errors);
+    fprintf(f, "  \"threads\": [");
+    for ( i = 0; i < stats.nworkers; ++i ) {
+        const worker_stat* ws = &stats.workers[i];
+        fprintf(f, "%s\n    {\"files\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"errors\": %" PRIu64 ", \"idle\": %.6f}",
+                i ? "," : "", (u_int64_t)atomic_load(&ws->files), (u_int64_t)atomic_load(&ws->bytes),
+                (u_int64_t)atomic_load(&ws->errors), ws->idle);
+    }
+    fprintf(f, "\n  ],\n  \"latency_us\": [");
+    for ( i = 0; i < STAT_SIZE_BUCKETS; ++i ) {
+        u_int64_t count = stat_latency(i, hist);
+        fprintf(f, "%s\n    {\"size\": \"%s\", \"count\": %" PRIu64, i ? "," : "", stat_size_names[i], count);
+        if ( count ) {
+            fprintf(f, ", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64,
+                    stat_percentile(hist, count, 0.5), stat_percentile(hist, count, 0.9), stat_percentile(hist, count, 0.99));
+        }
+        /* интервал k: задержки [2^(k-1), 2^k) микросекунд */
+        fprintf(f, ", \"log2_buckets\": [");
+        for ( k = 0; k < STAT_LAT_BUCKETS; ++k ) {
+            fprintf(f, "%s%" PRIu64, k ? "," : "", hist[k]);
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "\n  ]\n}\n");
+    return fclose(f) ? errno : 0;
+}
+
+/***************************************************************************/
+/* встроенный тест производительности */
+#define BENCH_MAX_RUNS 16
+
+/* параметры теста */
+typedef struct bench_config {
+    const char* dir; /* каталог для временного дерева */
+    u_int64_t files; /* кол-во файлов */
+    u_int64_t minsize; /* минимальный размер файла */
+    u_int64_t maxsize; /* максимальный размер файла */
+    unsigned depth; /* глубина дерева каталогов */
+    unsigned fanout; /* кол-во подкаталогов в каждом каталоге */
+    unsigned sparse; /* процент файлов с дырами */
+    unsigned modified; /* процент файлов, меняемых в каталоге назначения перед повторным прогоном */
+    unsigned threads[BENCH_MAX_RUNS]; /* проверяемые кол-ва потоков */
+    unsigned nthreads;
+    int engines[BENCH_MAX_RUNS]; /* проверяемые способы копирования */
+    unsigned nengines;
+    u_int64_t seed; /* начальное значение генератора */
+    int keep; /* не удалять дерево после теста */
+    char* spec; /* разобранная строка параметров, на нее указывает dir */
+} bench_config;
+
+/* показатели одного этапа */
+typedef struct bench_sample {
+    struct timespec wall; /* время начала */
+    struct timespec cpu; /* процессорное время процесса на начало */
+    u_int64_t syscalls; /* syscr+syscw из /proc/self/io на начало */
+} bench_sample;
+
+static u_int64_t bench_rand(u_int64_t* state) {
+    u_int64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dull;
+}
+/* размер файла распределен логарифмически равномерно: сначала
+  выбирается разрядность, затем значение внутри нее */
+static u_int64_t bench_size(const bench_config* cfg, u_int64_t* state) {
+    unsigned lo = 64 - (cfg->minsize ? __builtin_clzll(cfg->minsize) : 64);
+    unsigned hi = 64 - (cfg->maxsize ? __builtin_clzll(cfg->maxsize) : 64);
+    unsigned bits = lo + (unsigned)(bench_rand(state) % (hi-lo+1));
+    u_int64_t size = bits ? ((u_int64_t)1 << (bits-1)) | (bench_rand(state) & (((u_int64_t)1 << (bits-1))-1)) : 0;
+    if ( size < cfg->minsize ) size = cfg->minsize;
+    if ( size > cfg->maxsize ) size = cfg->maxsize;
+    return size;
+}
+/* разбирает список значений через ':' */
+static int bench_parse_list(const char* val, unsigned* out, int* engines, unsigned* n) {
+    char* copy = strdup(val);
+    char* save = NULL;
+    char* tok;
+    int ec = 0;
+    *n = 0;
+    for ( tok = strtok_r(copy, ":", &save); tok && !ec; tok = strtok_r(NULL, ":", &save) ) {
+        if ( *n == BENCH_MAX_RUNS ) {
+            ec = -1;
+        } else if ( engines ) {
+            engines[*n] = parse_copy_engine(tok);
+            if ( engines[(*n)++] == ENGINE_COUNT ) ec = -1;
+        } else {
+            out[*n] = (unsigned)atoi(tok);
+            if ( !out[(*n)++] ) ec = -1;
+        }
+    }
+    free(copy);
+    return ec || !*n ? -1 : 0;
+}
+/* разбирает строку параметров вида key=value,key=value */
+static int bench_parse(bench_config* cfg, const char* spec) {
+    char* copy = strdup(spec);
+    char* save = NULL;
+    char* tok;
+    int ec = 0;
+    const char* tmp = getenv("TMPDIR");
+    cfg->dir = tmp && *tmp ? tmp : "/tmp";
+    cfg->files = 10000;
+    cfg->minsize = 0;
+    cfg->maxsize = 1024*1024;
+    cfg->depth = 3;
+    cfg->fanout = 4;
+    cfg->sparse = 0;
+    cfg->modified = 10;
+    cfg->threads[0] = 1;
+    cfg->threads[1] = 2;
+    cfg->threads[2] = 4;
+    cfg->nthreads = 3;
+    cfg->engines[0] = ENGINE_AUTO;
+    cfg->nengines = 1;
+    cfg->seed = 1;
+    cfg->keep = 0;
+    for ( tok = strtok_r(copy, ",", &save); tok && !ec; tok = strtok_r(NULL, ",", &save) ) {
+        char* val = strchr(tok, '=');
+        if ( !val ) {
+            ec = -1;
+            break;
+        }
+        *val++ = 0;
+        if ( 0 == strcmp(tok, "dir") ) cfg->dir = val;
+        else if ( 0 == strcmp(tok, "files") ) cfg->files = strtoull(val, NULL, 10);
+        else if ( 0 == strcmp(tok, "min") ) ec = parse_size(val, &cfg->minsize);
+        else if ( 0 == strcmp(tok, "max") ) ec = parse_size(val, &cfg->maxsize);
+        else if ( 0 == strcmp(tok, "depth") ) cfg->depth = (unsigned)atoi(val);
+        else if ( 0 == strcmp(tok, "fanout") ) cfg->fanout = (unsigned)atoi(val);
+        else if ( 0 == strcmp(tok, "sparse") ) cfg->sparse = (unsigned)atoi(val);
+        else if ( 0 == strcmp(tok, "modified") ) cfg->modified = (unsigned)atoi(val);
+        else if ( 0 == strcmp(tok, "threads") ) ec = bench_parse_list(val, cfg->threads, NULL, &cfg->nthreads);
+        else if ( 0 == strcmp(tok, "engines") ) ec = bench_parse_list(val, NULL, cfg->engines, &cfg->nengines);
+        else if ( 0 == strcmp(tok, "seed") ) cfg->seed = strtoull(val, NULL, 10);
+        else if ( 0 == strcmp(tok, "keep") ) cfg->keep = atoi(val);
+        else ec = -1;
+    }
+    cfg->spec = copy;
+    if ( !cfg->files || cfg->minsize > cfg->maxsize || cfg->sparse > 100 || cfg->modified > 100 ) ec = -1;
+    if ( !cfg->seed ) cfg->seed = 1;
+    return ec;
+}
+/* генерирует исходное дерево: каталоги глубиной depth по fanout
+  подкаталогов, файлы раскладываются по ним случайно */
+static int bench_generate(const bench_config* cfg, const char* srcdir) {
+    u_int64_t state = cfg->seed;
+    u_int64_t ndirs = 1, cap = 64, level = 0, levelend = 1, i, f;
+    char** dirs = (char**)malloc(cap*sizeof(char*));
+    char* buf = (char*)malloc(READWRITE_BUF_SIZE);
+    int ec = 0;
+    dirs[0] = strdup("");
+    /* каталоги в ширину, уровень за уровнем */
+    for ( i = 0; i < ndirs && level < cfg->depth; ++i ) {
+        unsigned k;
+        for ( k = 0; k < cfg->fanout; ++k ) {
+            char name[32];
+            if ( ndirs == cap ) {
+                cap *= 2;
+                dirs = (char**)realloc(dirs, cap*sizeof(char*));
+            }
+            snprintf(name, sizeof(name), "/d%u", k);
+            dirs[ndirs] = (char*)malloc(strlen(dirs[i])+strlen(name)+1);
+            strcpy(dirs[ndirs], dirs[i]);
+            strcat(dirs[ndirs], name);
+            char* full = make_filename(srcdir, dirs[ndirs]);
+            if ( mkdir(full, S_IRWXU|S_IRWXG|S_IRWXO) && errno != EEXIST ) ec = errno;
+            free(full);
+            ndirs++;
+        }
+        if ( i+1 == levelend ) {
+            level++;
+            levelend = ndirs;
+        }
+    }
+    for ( i = 0; i < READWRITE_BUF_SIZE; i += 8 ) {
+        u_int64_t r = bench_rand(&state);
+        memcpy(buf+i, &r, 8);
+    }
+    /* файлы с тайм штампом в прошлом, чтобы изменения были заметны по mtime */
+    struct timespec ts[2] = {{time(NULL)-3600, 0}, {time(NULL)-3600, 0}};
+    for ( f = 0; f < cfg->files && !ec; ++f ) {
+        char rel[64];
+        const char* dir = dirs[bench_rand(&state) % ndirs];
+        u_int64_t size = bench_size(cfg, &state);
+        int sparse = cfg->sparse && bench_rand(&state) % 100 < cfg->sparse;
+        snprintf(rel, sizeof(rel), "/f%" PRIu64, f);
+        char* relname = (char*)malloc(strlen(dir)+strlen(rel)+1);
+        strcpy(relname, dir);
+        strcat(relname, rel);
+        char* name = make_filename(srcdir, relname);
+        free(relname);
+        int fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+        free(name);
+        if ( fd == -1 ) {
+            ec = errno;
+            break;
+        }
+        if ( sparse ) {
+            /* данные в начале и в середине, остальное - дыры */
+            u_int64_t part = size < SPARSE_BLOCK ? size : SPARSE_BLOCK;
+            if ( ftruncate(fd, size) ) ec = errno;
+            if ( !ec ) ec = pwrite_full(fd, buf, part, 0);
+            if ( !ec && size >= 2*SPARSE_BLOCK ) ec = pwrite_full(fd, buf, part, (size/2) & ~(u_int64_t)(SPARSE_BLOCK-1));
+        } else {
+            u_int64_t off;
+            for ( off = 0; off < size && !ec; off += READWRITE_BUF_SIZE ) {
+                u_int64_t part = size-off < READWRITE_BUF_SIZE ? size-off : READWRITE_BUF_SIZE;
+                u_int64_t shift = bench_rand(&state) % (READWRITE_BUF_SIZE-part+1);
+                ec = pwrite_full(fd, buf+shift, part, off);
+            }
+        }
+        futimens(fd, ts);
+        close(fd);
+    }
+    for ( i = 0; i < ndirs; ++i ) free(dirs[i]);
+    free(dirs);
+    free(buf);
+    return ec;
+}
+/* меняет часть файлов каталога назначения: половину удаляет,
+  у остальных портит начало и тайм штамп */
+static void bench_modify(const bench_config* cfg, const filetable* dst, u_int64_t seed) {
+    /* измененная копия старше источника, созданного с now-3600, иначе
+      сравнение по mtime ее бы не заметило */
+    struct timespec ts[2] = {{time(NULL)-7200, 0}, {time(NULL)-7200, 0}};
+    u_int64_t state = seed, i;
+    for ( i = 0; i < dst->nfiles; ++i ) {
+        if ( bench_rand(&state) % 100 >= cfg->modified ) continue;
+        char* name = make_filename(dst->root, file_name(dst, &dst->files[i]));
+        if ( bench_rand(&state) & 1 ) {
+            unlink(name);
+        } else {
+            int fd = open(name, O_WRONLY);
+            if ( fd != -1 ) {
+                u_int64_t r = bench_rand(&state);
+                pwrite_full(fd, (const char*)&r, dst->files[i].size < 8 ? dst->files[i].size : 8, 0);
+                futimens(fd, ts);
+                close(fd);
+            }
+        }
+        free(name);
+    }
+}
+static int bench_remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+/* удаляет дерево каталогов */
+static void bench_remove(const char* path) {
+    nftw(path, bench_remove_entry, 64, FTW_DEPTH|FTW_PHYS);
+}
+/* кол-во системных вызовов чтения и записи процесса (syscr и syscw).
+  open, stat и getdents в них не входят */
+static u_int64_t bench_syscalls() {
+    char buf[512];
+    u_int64_t r = 0, w = 0;
+    int fd = open("/proc/self/io", O_RDONLY);
+    if ( fd == -1 ) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf)-1);
+    close(fd);
+    if ( n <= 0 ) return 0;
+    buf[n] = 0;
+    const char* p = strstr(buf, "syscr:");
+    if ( p ) r = strtoull(p+6, NULL, 10);
+    p = strstr(buf, "syscw:");
+    if ( p ) w = strtoull(p+6, NULL, 10);
+    return r+w;
+}
+static void bench_start(bench_sample* s) {
+    s->syscalls = bench_syscalls();
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &s->cpu);
+    clock_gettime(CLOCK_MONOTONIC, &s->wall);
+}
+static double bench_elapsed(const struct timespec* from, const struct timespec* to) {
+    return (double)(to->tv_sec-from->tv_sec) + (double)(to->tv_nsec-from->tv_nsec)/1e9;
+}
+/* выводит результат этапа одной строкой JSON */
+static void bench_report(const bench_sample* s, const char* run, const char* phase, unsigned nthreads, int engine, u_int64_t files, u_int64_t bytes) {
+    struct timespec wall, cpu;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    u_int64_t syscalls = bench_syscalls()-s->syscalls;
+    double secs = bench_elapsed(&s->wall, &wall);
+    double rate = secs > 0 ? 1.0/secs : 0;
+    printf("{\"run\":\"%s\",\"phase\":\"%s\",\"threads\":%u,\"engine\":\"%s\",\"files\":%" PRIu64 ",\"bytes\":%" PRIu64
+           ",\"seconds\":%.6f,\"cpu_seconds\":%.6f,\"files_per_sec\":%.1f,\"mb_per_sec\":%.2f,\"io_syscalls_per_file\":%.2f}\n",
+           run, phase, nthreads, engine == ENGINE_AUTO ? "auto" : engine_names[engine], files, bytes,
+           secs, bench_elapsed(&s->cpu, &cpu), files*rate, bytes*rate/(1024.0*1024.0),
+           files ? (double)syscalls/files : 0.0);
+    fflush(stdout);
+}
+/* один прогон: сканирование, сравнение и копирование по отдельности */
+static int bench_pass(const char* srcdir, const char* dstdir, const char* run, unsigned nthreads, int engine) {
+    filetable src, dst;
+    copylist result;
+    dirinfo tocopy;
+    bench_sample s;
+    memset(&src, 0, sizeof(src));
+    memset(&dst, 0, sizeof(dst));
+    memset(&result, 0, sizeof(result));
+    src.root = srcdir;
+    dst.root = dstdir;
+    bench_start(&s);
+    {
+        filetable* tables[2] = {&src, &dst};
+        if ( 0 != read_dir_trees(tables, 2, nthreads, NULL) ) return -1;
+    }
+    bench_report(&s, run, "scan", nthreads, engine, src.nfiles+dst.nfiles, 0);
+    bench_start(&s);
+    get_difference(&result, &src, &dst, nthreads);
+    get_copyinfo(&tocopy, &result);
+    bench_report(&s, run, "diff", nthreads, engine, src.nfiles, 0);
+    bench_start(&s);
+    if ( tocopy.nfiles ) copy_files(&result, &src, &dst, nthreads);
+    bench_report(&s, run, "copy", nthreads, engine, tocopy.nfiles, tocopy.size);
+    free_filetable(&src);
+    free_filetable(&dst);
+    free_copylist(&result);
+    return atomic_load(&copy_errors) ? -1 : 0;
+}
+/* генерирует тестовое дерево во временном каталоге и для каждого сочетания
+  кол-ва потоков и способа копирования выполняет полное копирование в пустой
+  каталог и обновление частично измененного каталога назначения */
+int run_bench(const char* spec) {
+    bench_config cfg;
+    unsigned t, e;
+    int ec = 0;
+    if ( bench_parse(&cfg, spec) ) {
+        printf("wrong bench parameters \"%s\"! terminate.\n", spec);
+        free(cfg.spec);
+        return 1;
+    }
+    char* root = (char*)malloc(strlen(cfg.dir)+32);
+    sprintf(root, "%s/dsync2-bench-XXXXXX", cfg.dir);
+    if ( !mkdtemp(root) ) {
+        fprintf(stderr, "error: %s: %s\n", root, strerror(errno));
+        free(root);
+        return 1;
+    }
+    char* srcdir = make_filename(root, "/src");
+    char* dstdir = make_filename(root, "/dst");
+    int saved_engine = copy_engine;
+    quiet = 1;
+    if ( mkdir(srcdir, S_IRWXU) || (ec=bench_generate(&cfg, srcdir)) ) {
+        fprintf(stderr, "error: can't generate tree in %s: %s\n", root, strerror(ec ? ec : errno));
+        ec = 1;
+    }
+    for ( e = 0; !ec && e < cfg.nengines; ++e ) {
+        for ( t = 0; !ec && t < cfg.nthreads; ++t ) {
+            filetable dst;
+            copy_engine = cfg.engines[e];
+            /* способы, запомненные предыдущим прогоном, не переносятся */
+            engine_cache_count = 0;
+            bench_remove(dstdir);
+            mkdir(dstdir, S_IRWXU);
+            ec = bench_pass(srcdir, dstdir, "full", cfg.threads[t], cfg.engines[e]);
+            if ( ec || !cfg.modified ) continue;
+            memset(&dst, 0, sizeof(dst));
+            dst.root = dstdir;
+            {
+                filetable* tables[1] = {&dst};
+                read_dir_trees(tables, 1, cfg.threads[t], NULL);
+            }
+            bench_modify(&cfg, &dst, cfg.seed+t+e*BENCH_MAX_RUNS);
+            free_filetable(&dst);
+            ec = bench_pass(srcdir, dstdir, "update", cfg.threads[t], cfg.engines[e]);
+        }
+    }
+    copy_engine = saved_engine;
+    free(stats.workers);
+    stats.workers = NULL;
+    if ( cfg.keep ) {
+        fprintf(stderr, "bench tree is kept in %s\n", root);
+    } else {
+        bench_remove(root);
     }
+    free(srcdir);
+    free(dstdir);
+    free(root);
+    free(cfg.spec);
+    return ec ? 1 : 0;
 }